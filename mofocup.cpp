@@ -42,77 +42,482 @@ Version:
 1.2.1
 */
 
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <math.h>
+#include <mutex>
 #include <sqlite3.h>
 #include <sstream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <thread>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <vector>
 #include "bzfsAPI.h"
+#include "mofocup_api.h"
+#include "mofocup_core.h"
+#include "mofocup_live.h"
+
+#define MAX_CUPS 16 //the most cups a server can have registered at once
+#define KILL_PAIR_HISTORY 4096 //the most recent kills remembered when looking for players farming points
+#define EVENT_BATCH_SIZE 512 //the most events written to the event log in one transaction
+#define EVENT_QUEUE_LIMIT 65536 //the most events held in memory while waiting to be written
+#define EVENT_WRITE_INTERVAL 5 //the most seconds an event waits before it is written
+#define METRICS_WRITE_INTERVAL 15 //how many seconds apart the metrics file is written
+#define METRIC_BUCKET_COUNT 12 //the amount of latency buckets in the metrics histograms
+#define SNAPSHOT_MAGIC 0x5346434d //"MCFS", the start of every snapshot file
+#define SNAPSHOT_VERSION 1 //changes whenever the layout of the snapshot file changes
+#define STATS_OUTPUT_LIMIT 65536 //the most bytes of answers held for a stats client, anyone who doesn't read them is dropped
+
+#if MAX_CUPS > MOFOCUP_LIVE_MAX_CUPS
+#error "Every cup needs a place in the live stats segment"
+#endif
 
 class mofocup : public bz_Plugin, public bz_CustomSlashCommandHandler
 {
 public:
     sqlite3* db; //sqlite database we'll be using
+    sqlite3* readDb; //read-only connection to the same database for the standings
     std::string dbfilename; //the path to the database
+    std::string configfilename; //the path to the cup registry configuration
+    std::string archivefilename; //the path to the database finished cups are moved to
 
     virtual const char* Name (){return "MoFo Cup [RC 5]";}
     virtual void Init(const char* commandLine);
     virtual void Cleanup(void);
 
     virtual void Event(bz_EventData *eventData);
+    virtual int GeneralCallback(const char* name, void* data);
     virtual bool SlashCommand(int playerID, bz_ApiString command, bz_ApiString message, bz_APIStringList *params);
 
-    virtual void addCurrentPlayingTime(std::string bzid, std::string callsign);
+    struct cupDescriptor;
+
+    //how long something took, counted in the buckets of metricBuckets for the metrics file
+    struct latencyHistogram
+    {
+        uint64_t buckets[METRIC_BUCKET_COUNT]; //how many took no longer than each bucket and longer than the one before it
+        uint64_t count;
+        double sum; //seconds
+    };
+
+    //a player's place in a cup, as shown on the leader board
+    struct cupStanding
+    {
+        std::string callsign;
+        std::string score;
+        uint64_t bzid; //0 when nobody holds the place
+    };
+
+    //the score of a player on the server including everything that hasn't been written to the database yet
+    struct liveScore
+    {
+        int playerID;
+        int score;
+        int persistedScore; //the score in the database
+    };
+    typedef std::map<uint64_t, liveScore> liveScoreMap; //by BZID
+    typedef int (mofocup::*scoringHook)(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+
+    //every statement run more than once, their SQL is in statementQueries
+    enum preparedStatement
+    {
+        eAddCurrentPlayingTime,
+        eAddDailyPoints,
+        eAddPlayer,
+        eAddPlayerPoints,
+        eAddRating,
+        eGetCurrentCup,
+        eGetCurrentPlayerStats,
+        eGetEnrolledPlayers,
+        eGetPlayingTime,
+        eGetPoints,
+        eIncrementPoints,
+        eOpenNextCup,
+        eSaveRating,
+        eUpdatePlayerRatio,
+        eAttachReadArchive,
+        eCountPlayersAhead,
+        eGetArchivedCup,
+        eGetArchivedPlayer,
+        eGetArchivedStandings,
+        eGetCupRatios,
+        eGetPlayerStandingFromBZID,
+        eGetPlayerStandingFromCallsign,
+        eGetRecentPlayer,
+        eGetRecentStandings,
+        eGetTopPlayers,
+        eIsFirstTime,
+        eStatementCount
+    };
+
+    virtual void addCurrentPlayingTime(uint64_t bzid, std::string callsign);
+    virtual std::string answerStatsQuery(const mofocupLiveStats &stats, std::string query);
+    virtual bool archiveCup(int cupID);
+    virtual void archiveFinishedCups(void);
+    virtual int checkQueryPlans(void);
     virtual void cleanCup(void);
+    virtual void closeLiveStats(void);
     virtual std::string convertToString(int myInt);
     virtual std::string convertToString(double myDouble);
+    virtual std::string convertToString(uint64_t myBZID);
+    virtual void dispatchScoring(bz_EventData *eventData, int playerID, uint64_t bzid, std::string callsign);
     virtual void doQuery(std::string query);
+    virtual void enrollPlayer(uint64_t bzid, std::string callsign);
+    virtual std::vector<int> enrollPlayers(std::vector<int> playerIDs);
+    virtual void finalizeStatements(sqlite3 *connection);
+    virtual void finishEventWriter(void);
+    virtual void finishStatsServer(void);
+    virtual cupDescriptor* findCupByAlias(std::string alias);
+    virtual void flushAllPlayers(void);
+    virtual void flushPendingPoints(int playerID, uint64_t bzid);
     virtual std::string formatScore(std::string place, std::string callsign, std::string points);
-    virtual std::vector<std::string> getPlayerInCupStanding(std::string cup, std::string place);
-    virtual std::vector<std::string> getPlayerStandingFromBZID(std::string cup, std::string bzid);
+    virtual std::string getConfigValue(std::string section, std::string key, std::string defaultValue);
+    virtual void getFormulaVariables(bz_EventData *eventData, int *variables);
+    virtual int getLivePlace(cupDescriptor &cup, int score, const liveScoreMap &scores);
+    virtual int getLiveScore(cupDescriptor &cup, int playerID);
+    virtual liveScoreMap getLiveScores(cupDescriptor &cup);
+    virtual std::vector<std::string> getLiveStandingFromBZID(cupDescriptor &cup, uint64_t bzid, const liveScoreMap &scores);
+    virtual std::vector<std::string> getLiveStandingFromCallsign(cupDescriptor &cup, std::string callsign, const liveScoreMap &scores);
+    virtual std::vector<cupStanding> getLiveTopPlayers(cupDescriptor &cup, const liveScoreMap &scores);
+    virtual cupStanding getPlayerInCupStanding(std::string cup, int place);
+    virtual std::vector<std::string> getPlayerStandingFromBZID(std::string cup, uint64_t bzid);
     virtual std::vector<std::string> getPlayerStandingFromCallsign(std::string cup, std::string callsign);
+    virtual sqlite3_stmt* getStatement(preparedStatement statement);
     virtual bool isDigit(std::string someString);
-    virtual bool isFirstTime(std::string bzid);
-    virtual bool isPlayerAvailable(std::string bzid);
+    virtual bool isFarmedKill(bz_PlayerDieEventData_V1 *diedata);
+    virtual bool isFirstTime(uint64_t bzid);
+    virtual bool isGenocideHit(bz_PlayerDieEventData_V1 *diedata);
+    virtual bool isPlayerAvailable(uint64_t bzid);
     virtual bool isValidPlayerID(int playerID);
-    virtual void incrementPoints(std::string bzid, std::string cup, std::string pointsToIncrement);
+    virtual void incrementPoints(uint64_t bzid, std::string cup, std::string pointsToIncrement);
+    virtual void loadConfig(std::string filename);
+    virtual bool loadCurrentCup(void);
+    virtual void loadCupRegistry(void);
+    virtual void loadPlayerTotals(int playerID, uint64_t bzid);
+    virtual void loadSnapshot(void);
+    virtual void logEvent(bz_EventData *eventData, uint64_t bzid, const int *variables, const int *points, bool farmed);
+    virtual void logStatementProfiles(void);
+    virtual void observeLatency(latencyHistogram &histogram, double seconds);
+    virtual void openLiveStats(void);
+    virtual bool openNextCup(double previousEndTime);
     virtual int playersKilledByGenocide(bz_eTeamType killerTeam);
-    virtual sqlite3_stmt* prepareQuery(std::string sql);
+    virtual uint64_t parseBZID(std::string bzid);
+    virtual void publishLiveStats(void);
+    virtual void readSnapshot(void);
+    virtual void recordPlayingTime(uint64_t bzid, std::string callsign, int timePlayed);
+    virtual void recordStatementProfile(preparedStatement index, sqlite3_stmt *statement, bool started, double seconds);
+    virtual bool registerCup(std::string name, std::string alias, std::string hookName, std::string flushPolicy, int topN, std::string formula);
+    virtual void reportEventWriterErrors(void);
+    virtual void reportStatsServerErrors(void);
+    virtual void rolloverCup(void);
+    virtual void saveRating(cupDescriptor &cup, uint64_t bzid, double rating);
+    virtual bool saveSnapshot(void);
+    virtual int scoreBounty(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+    virtual int scoreCapture(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+    virtual int scoreGeno(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+    virtual int scoreKill(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+    virtual int scoreRating(cupDescriptor &cup, bz_EventData *eventData, const int *variables);
+    virtual void serveStats(void);
+    virtual void showArchivedCup(int playerID, cupDescriptor *cup, std::string month);
+    virtual void showRecentStandings(int playerID, cupDescriptor *cup, std::string period, int days);
     virtual void startCup(void);
-    virtual void trackNewPlayingTime(std::string bzid);
-    virtual void updatePlayerRatio(std::string bzid);
+    virtual void startEventWriter(void);
+    virtual void startStatsServer(void);
+    virtual int stepStatement(preparedStatement index, sqlite3_stmt *&statement);
+    virtual std::string toLowerCase(std::string someString);
+    virtual void trackNewPlayingTime(uint64_t bzid, std::string callsign);
+    virtual std::string trimWhitespace(std::string someString);
+    virtual void updatePlayerRatio(uint64_t bzid);
+    virtual void updateStandingPlaces(cupDescriptor &cup);
+    virtual void writeEvents(void);
+    virtual void writeMetrics(void);
 
     //we're storing the time people play so we can rank players based on how quick they make as many caps
     struct playingTimeStructure
     {
-        std::string bzid;
+        uint64_t bzid;
+        std::string callsign;
         double joinTime;
     };
     std::vector<playingTimeStructure> playingTime;
+    uint64_t playerBZIDs[256]; //the BZID of the player in each slot, parsed when they join, 0 if they aren't registered
+    std::string playerCallsigns[256]; //the callsign of the player in each slot
+    int recordedPlayingTime[256]; //the seconds the database has for the player in each slot, kept in step as more are written
+    std::bitset<256> dirtyPlayers; //the players who have earned points since the last database update
+    std::bitset<256> ratedPlayers; //the players whose skill ratings have been loaded
+
+    //the recent kills between each pair of players, so two players killing each other over and over stop earning points
+    struct killPairEntry
+    {
+        unsigned char killerID, victimID;
+        unsigned short killerGeneration, victimGeneration; //which player held each slot when the kill was made
+        double time;
+    };
+    killPairEntry recentKills[KILL_PAIR_HISTORY]; //oldest first, starting at recentKillsStart
+    unsigned int recentKillsStart, recentKillsCount;
+    unsigned short killPairCounts[256][256]; //kills made by a slot on another slot that are still in recentKills
+    unsigned short slotGenerations[256]; //changes every time a player leaves so their kills aren't held against the next player
+    double farmingWindow; //how many seconds a kill is remembered
+    int farmingLimit; //how many kills of the same player within the window earn points, 0 doesn't limit them
+
+    mofocupConfig config; //the settings read from the configuration file
+    mofocupDatabase cupDatabase; //the schema, the archive and the queries shared with the tools, on the main connection
+
+    //points are either written as soon as they are earned or held in memory until the next database update
+    enum cupFlushPolicy
+    {
+        eImmediateFlush,
+        eDeferredFlush
+    };
 
-    std::string top5Players[4][5][3]; //0 - Bounty | 1 - CTF | 2 - Geno | 3 - Kills
-    double lastDatabaseUpdate;
-    typedef std::map<std::string, sqlite3_stmt*> PreparedStatementMap; // Define the type as a shortcut
-    PreparedStatementMap preparedStatements; // Create the object to store prepared statements
+    //everything we need to know about a cup, loaded from the configuration file when the plugin starts
+    struct cupDescriptor
+    {
+        std::string name; //the `CupType` used in the database
+        std::string alias; //the parameter used with /cup
+        std::string hookName; //the name of the scoring hook, used for debug messages
+        scoringHook hook; //the function that calculates the points earned from an event
+        cupFlushPolicy flushPolicy; //when earned points are written to the database
+        int topN; //the amount of players shown on the leader board and announced when they move up
+        scoringFormula formula; //how many points an event scored by the hook is worth
+        bool rated; //ranked by a skill rating kept in memory instead of points per day played
+        int pendingPoints[256]; //points earned by each player that haven't been written to the database yet
+        int recordedPoints[256]; //the points the database has for each player on the server, kept in step as more are written
+        double ratings[256]; //the skill rating of each player, only used by rated cups
+        int standingPlaces[256]; //the place of each player as of the last database update, 0 if they don't have one yet
+        int standingScores[256]; //the score each player was ranked by as of the last database update
+        uint64_t pointsAwarded; //every point the cup has awarded since the plugin was loaded
+        std::vector<cupStanding> topPlayers; //the top of the cup as of the last database update
+    };
+    std::vector<cupDescriptor> cups;
+    std::vector<int> eventSubscribers[bz_eLastEvent]; //the index of the cups that score each event type
+
+    //every kill and capture is kept in an append-only log that a background thread writes in batches
+    struct eventRecord
+    {
+        bz_eEventType eventType;
+        int cupID;
+        double timestamp; //seconds since the epoch
+        uint64_t bzid; //the player who made the kill or the capture
+        uint64_t victimBZID; //the player who was killed, 0 for captures or unregistered players
+        std::string flag; //the flag the kill was made with or the team flag that was captured
+        bz_eTeamType team; //the team of the player who made the kill or the capture
+        bz_eTeamType victimTeam; //the team of the player who was killed or whose flag was captured
+        int variables[eFormulaVariableCount]; //what the scoring formulas were given for this event
+        int points[MAX_CUPS]; //the points awarded by each cup, in the order of the registry
+        bool farmed; //a kill no cup awarded points for because the killer farmed the victim
+    };
+    std::string eventsfilename; //the path to the event log database
+    std::vector<eventRecord> eventQueue; //events waiting to be written
+    std::vector<std::string> eventCupNames; //the name of each cup, copied for the event writer when it starts
+    std::mutex eventQueueMutex; //guards everything the game thread and the event writer share
+    std::condition_variable eventQueueReady;
+    std::thread eventWriter;
+    bool eventWriterStopping;
+    unsigned int droppedEvents; //events that didn't fit in the queue since the last report
+    std::string eventWriterError; //the last error the event writer ran into, reported by the game thread
+
+    //the live counters and leader boards are published to shared memory for scoreboards on the same host, see mofocup_live.h
+    std::string liveStatsName; //the name of the shared memory segment, empty if it isn't published
+    mofocupLiveStats *liveStats; //the mapped segment, NULL if it isn't published
+    double lastLiveStatsUpdate;
+
+    //the live stats are also served on a unix socket by a background thread, answered from its own copy of the stats above
+    std::string statsSocketName; //the path of the socket, empty if the stats aren't served
+    std::thread statsServer;
+    int statsListener, statsEpoll, statsWakeup; //the listening socket, the epoll instance and the eventfd used to stop the thread, -1 when closed
+    std::mutex statsServerMutex; //guards statsServerError
+    std::string statsServerError; //why the stats server stopped, reported by the game thread
+
+    //counters written in the Prometheus text format so the server's monitoring can keep an eye on the plugin
+    std::string metricsfilename; //the path of the metrics file, empty if it isn't written
+    double lastMetricsUpdate;
+    uint64_t eventsHandled[bz_eLastEvent]; //every event received, by type
+    uint64_t farmedKills; //kills that didn't earn points because the players were farming
+    latencyHistogram statementLatency; //every statement run on the game thread's connections
+    latencyHistogram flushLatency; //every database update
+
+    //where the database time goes, for each statement in statementQueries
+    struct statementProfile
+    {
+        uint64_t runs;
+        double seconds;
+        uint64_t rowsScanned; //rows stepped through by full table scans
+        uint64_t sorts;
+    };
+    bool profileStatements; //whether the statements are profiled
+    statementProfile statementProfiles[eStatementCount];
+    std::string queryPlanCheck; //what happens when a statement run on every event would scan a whole table: warn, strict or off
+
+    //everything kept in memory is saved to a snapshot when the plugin is unloaded and picked up when it's loaded, so a reload loses nothing
+    struct snapshotHeader
+    {
+        uint32_t magic, version;
+        int32_t cupID, cupCount;
+        int64_t savedAt; //seconds since the epoch
+        double lastDatabaseUpdate, flagDropped; //how many seconds before the snapshot was saved
+        int32_t flagID, lastPlayerDied;
+        uint32_t sessionCount, killCount;
+    };
+    struct snapshotPlayer
+    {
+        uint64_t bzid;
+        char callsign[32];
+        int32_t bounty;
+        uint8_t dirty, rated;
+        uint16_t generation;
+    };
+    struct snapshotCup
+    {
+        char name[32];
+        int32_t pendingPoints[256];
+        double ratings[256];
+        int32_t standingPlaces[256], standingScores[256];
+        uint32_t topCount; //the amount of snapshotStanding that follow
+    };
+    struct snapshotStanding
+    {
+        uint64_t bzid;
+        char callsign[32];
+        int32_t score;
+    };
+    struct snapshotSession
+    {
+        uint64_t bzid;
+        char callsign[32];
+        double unrecordedTime; //seconds played since the playing time was last written
+    };
+    struct snapshotContents
+    {
+        snapshotHeader header;
+        std::vector<snapshotPlayer> players; //by slot
+        std::vector<snapshotCup> cups;
+        std::vector<std::vector<snapshotStanding> > standings; //the top of each cup
+        std::vector<snapshotSession> sessions;
+        std::vector<killPairEntry> kills;
+    };
+    std::string snapshotfilename; //the path of the snapshot
+    double snapshotAge; //how many seconds a snapshot can be picked up for, after that it's written to the database instead
+    snapshotContents *savedSnapshot; //the snapshot read when the plugin was loaded, NULL once it has been picked up
 
-    sqlite3_stmt *addCurrentPlayingTimeStmt, *getPlayerInCupStandingStmt, *getPlayerStandingFromBZIDStmt, *getPlayerStandingFromCallsignStmt, *isFirstTimeStmt,
-        *incrementPointsStmt, *getCurrentPlayerStatsStmt, *updatePlayerRatioStmt;
+    int currentCupID; //the cup being played on this server
+    double currentCupEndTime; //when the current cup ends, in seconds since the epoch
+    double lastDatabaseUpdate;
+    sqlite3_stmt *statements[eStatementCount]; //NULL until they're first needed
 };
 
 BZ_PLUGIN(mofocup);
 
-//Initialize all the available cups
-std::string cups[] = {"Bounty", "CTF", "Geno", "Kill"};
+//The scoring hooks a cup can use and the event each one of them scores, their default formulas are in mofocup_core.cpp
+struct scoringHookEntry
+{
+    const char* name;
+    bz_eEventType eventType;
+    mofocup::scoringHook hook;
+};
+
+static const scoringHookEntry scoringHooks[] = {
+    {"bounty", bz_ePlayerDieEvent, &mofocup::scoreBounty},
+    {"ctf",    bz_eCaptureEvent,   &mofocup::scoreCapture},
+    {"geno",   bz_ePlayerDieEvent, &mofocup::scoreGeno},
+    {"kill",   bz_ePlayerDieEvent, &mofocup::scoreKill},
+    {"rating", bz_ePlayerDieEvent, &mofocup::scoreRating}
+};
+
+//The SQL of every statement in mofocup::preparedStatement, in the same order, and whether it runs on the read-only connection
+struct statementEntry
+{
+    const char* sql;
+    bool readOnly;
+};
+
+static const statementEntry statementQueries[] = {
+    {"UPDATE `Players` SET `PlayingTime` = `PlayingTime` + ? WHERE `BZID` = ? AND `CupID` = ?", false},
+    {"INSERT INTO `DailyPoints` VALUES (?1, ?2, date('now'), ?3, ?4) ON CONFLICT DO UPDATE SET `Points` = `Points` + excluded.`Points`", false},
+    {"INSERT OR IGNORE INTO `Players` (`BZID`, `Callsign`, `CupID`, `PlayingTime`) VALUES (?, ?, ?, 1)", false},
+    {"INSERT INTO `Points` (`CupType`, `BZID`, `CupID`, `Points`, `Ratio`) VALUES (?1, ?2, ?3, ?4, ?4)", false},
+    {"INSERT INTO `Points` VALUES (?2, ?3, ?4, ?1, ?1)", false},
+    {"SELECT `CupID`, `EndTime` FROM `Cups` WHERE `ServerID` = ?1 AND `StartTime` <= ?2 AND ?2 < `EndTime` ORDER BY `StartTime` DESC LIMIT 1", false},
+    {"SELECT `Points`.`Points`, `Players`.`PlayingTime`, `Points`.`Ratio` FROM `Points`, `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` AND `Points`.`BZID` = ? AND `CupType` = ? AND `Points`.`CupID` = ?", false},
+    {"SELECT `BZID` FROM `Players` WHERE `CupID` = ?", false},
+    {"SELECT `PlayingTime` FROM `Players` WHERE `BZID` = ? AND `CupID` = ?", false},
+    {"SELECT `Points` FROM `Points` WHERE `CupType` = ? AND `BZID` = ? AND `CupID` = ?", false},
+    {"UPDATE `Points` SET `Points` = `Points` + ? WHERE `CupType` = ? AND `BZID` = ? AND `CupID` = ?", false},
+    {"INSERT INTO `Cups` (`ServerID`, `StartTime`, `EndTime`) SELECT ?1, `Start`, strftime('%s', `Start`, 'unixepoch', 'start of month', '+1 month') FROM (SELECT MAX(?2, CAST(strftime('%s', 'now', 'start of month') AS REAL)) AS `Start`)", false},
+    {"UPDATE `Points` SET `Points` = ?1, `Ratio` = ?1 WHERE `CupType` = ?2 AND `BZID` = ?3 AND `CupID` = ?4", false},
+    {"UPDATE `Points` SET `Ratio` = ? WHERE `CupType` = ? AND `BZID` = ? AND `CupID` = ?", false},
+    {"ATTACH DATABASE ? AS `archive`", true},
+    {"SELECT COUNT(*) FROM `Points` WHERE `CupType` = ? AND `CupID` = ? AND `Ratio` > ?", true},
+    {"SELECT `CupID` FROM `archive`.`Cups` WHERE `ServerID` = ? AND strftime('%Y-%m', `StartTime`, 'unixepoch') = ? ORDER BY `StartTime` DESC LIMIT 1", true},
+    {"SELECT `Place`, `Callsign`, `Ratio` FROM `archive`.`Standings` WHERE `CupID` = ? AND `CupType` = ? AND `BZID` = ?", true},
+    {"SELECT `Place`, `Callsign`, `Ratio` FROM `archive`.`Standings` WHERE `CupID` = ? AND `CupType` = ? AND `Place` <= ? ORDER BY `Place`", true},
+    {"SELECT `BZID`, `Ratio` FROM `Points` WHERE `CupType` = ? AND `CupID` = ? ORDER BY `Ratio` DESC", true},
+    {LIVE_STANDING_BY_BZID_QUERY, true},
+    {LIVE_STANDING_BY_CALLSIGN_QUERY, true},
+    {"SELECT `Total`, (SELECT COUNT(*) FROM (SELECT SUM(`Points`) AS `Others` FROM `DailyPoints` WHERE `CupID` = ?1 AND `CupType` = ?2 AND `Day` >= date('now', ?3) GROUP BY `BZID`) WHERE `Others` > `Total`) + 1 FROM (SELECT SUM(`Points`) AS `Total` FROM `DailyPoints` WHERE `CupID` = ?1 AND `CupType` = ?2 AND `Day` >= date('now', ?3) AND `BZID` = ?4) WHERE `Total` IS NOT NULL", true},
+    {"SELECT COALESCE(`Players`.`Callsign`, 'Anonymous'), SUM(`DailyPoints`.`Points`) AS `Total` FROM `DailyPoints` LEFT JOIN `Players` ON `Players`.`BZID` = `DailyPoints`.`BZID` AND `Players`.`CupID` = `DailyPoints`.`CupID` WHERE `DailyPoints`.`CupID` = ?1 AND `CupType` = ?2 AND `Day` >= date('now', ?3) GROUP BY `DailyPoints`.`BZID` ORDER BY `Total` DESC LIMIT ?4", true},
+    {LIVE_STANDINGS_QUERY, true},
+    {"SELECT `PlayingTime` FROM `Players` WHERE `BZID` = ? AND `CupID` = ?", true}
+};
+
+static_assert(sizeof(statementQueries) / sizeof(statementQueries[0]) == mofocup::eStatementCount, "Every statement needs its SQL");
+
+//The statements run on every event and database update, their query plans are checked when the plugin is loaded
+static const mofocup::preparedStatement hotStatements[] = {
+    mofocup::eAddCurrentPlayingTime, mofocup::eAddDailyPoints, mofocup::eAddRating, mofocup::eGetCurrentPlayerStats, mofocup::eGetEnrolledPlayers,
+    mofocup::eGetPlayingTime, mofocup::eGetPoints, mofocup::eIncrementPoints, mofocup::eSaveRating, mofocup::eUpdatePlayerRatio,
+    mofocup::eCountPlayersAhead, mofocup::eGetCupRatios, mofocup::eGetPlayerStandingFromBZID,
+    mofocup::eGetPlayerStandingFromCallsign, mofocup::eGetTopPlayers, mofocup::eIsFirstTime
+};
+
+//The upper bounds, in seconds, of the latency buckets in the metrics file
+static const double metricBuckets[METRIC_BUCKET_COUNT] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1};
+
+//The events the plugin handles and the names they are given in the metrics file
+struct metricEventEntry
+{
+    bz_eEventType eventType;
+    const char* name;
+};
+
+static const metricEventEntry metricEvents[] = {
+    {bz_eCaptureEvent, "capture"},
+    {bz_eFlagDroppedEvent, "flag_dropped"},
+    {bz_ePlayerDieEvent, "die"},
+    {bz_ePlayerJoinEvent, "join"},
+    {bz_ePlayerPartEvent, "part"},
+    {bz_ePlayerPausedEvent, "paused"},
+    {bz_eTickEvent, "tick"}
+};
+
 //Keep track of bounties
 int numberOfKills[256] = {0}; //the bounty a player has on their turret
-int rampage[8] = {0, 6, 12, 18, 24, 30, 36, 999}; //rampages
 int lastPlayerDied = -1; //the last person who was killed
 int flagID = -1; //if the flag id is either 0 or 1, it's a team flag
 double timeDropped = 0; //the time a team flag was dropped
-int bountyPoints[253] = {0}, genoPoints[253] = {0}, killPoints[253] = {0};
+
+//Called by SQLite after every statement run on the game thread's connections finishes
+static int timeStatement(unsigned int, void *plugin, void *, void *elapsed)
+{
+    ((mofocup*)plugin)->observeLatency(((mofocup*)plugin)->statementLatency, *(sqlite3_int64*)elapsed / 1e9);
+
+    return 0;
+}
 
 void mofocup::Init(const char* commandLine)
 {
@@ -129,8 +534,44 @@ void mofocup::Init(const char* commandLine)
     }
 
     dbfilename = std::string(commandLine);
+
+    if (dbfilename.find(",") != std::string::npos) //a cup configuration file was given after the database
+    {
+        configfilename = dbfilename.substr(dbfilename.find(",") + 1);
+        dbfilename = dbfilename.substr(0, dbfilename.find(","));
+    }
+
+    loadConfig(configfilename);
+    archivefilename = getConfigValue("MoFoCup", "archive", dbfilename + ".archive");
+    eventsfilename = getConfigValue("MoFoCup", "events", dbfilename + ".events");
+    farmingWindow = atof(getConfigValue("MoFoCup", "farmingWindow", "600").c_str());
+    farmingLimit = atoi(getConfigValue("MoFoCup", "farmingLimit", "5").c_str());
+    liveStatsName = getConfigValue("MoFoCup", "liveStats", "");
+    statsSocketName = getConfigValue("MoFoCup", "statsSocket", "");
+    metricsfilename = getConfigValue("MoFoCup", "metrics", "");
+    snapshotfilename = getConfigValue("MoFoCup", "snapshot", dbfilename + ".snapshot");
+    snapshotAge = atof(getConfigValue("MoFoCup", "snapshotAge", "60").c_str());
+    profileStatements = (toLowerCase(getConfigValue("MoFoCup", "profileStatements", "false")) == "true");
+    queryPlanCheck = toLowerCase(getConfigValue("MoFoCup", "queryPlans", "warn"));
+
+    memset(playerBZIDs, 0, sizeof(playerBZIDs));
+    memset(recordedPlayingTime, 0, sizeof(recordedPlayingTime));
+    recentKillsStart = recentKillsCount = 0;
+    memset(killPairCounts, 0, sizeof(killPairCounts));
+    memset(slotGenerations, 0, sizeof(slotGenerations));
+    memset(eventsHandled, 0, sizeof(eventsHandled));
+    memset(&statementLatency, 0, sizeof(statementLatency));
+    memset(&flushLatency, 0, sizeof(flushLatency));
+    farmedKills = 0;
+    lastMetricsUpdate = 0;
+    lastDatabaseUpdate = 0; //the first tick with players on the server updates the database
+    memset(statements, 0, sizeof(statements));
+    memset(statementProfiles, 0, sizeof(statementProfiles));
+    savedSnapshot = NULL;
+
     bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Using the following database: %s", dbfilename.c_str());
     sqlite3_open(dbfilename.c_str(),&db);
+    readDb = NULL;
 
     if (db == 0) //we couldn't read the database provided
     {
@@ -141,9 +582,47 @@ void mofocup::Init(const char* commandLine)
 
     if (db != 0) //if the database connection succeed and the database is empty, let's create the tables needed
     {
-        doQuery("CREATE TABLE IF NOT EXISTS \"Players\" (\"BZID\" INTEGER NOT NULL UNIQUE DEFAULT (0), \"Callsign\" TEXT NOT NULL DEFAULT ('Anonymous'), \"CupID\" INTEGER NOT NULL DEFAULT (0), \"PlayingTime\" INTEGER NOT NULL DEFAULT (0));");
-        doQuery("CREATE TABLE IF NOT EXISTS \"Cups\" (\"CupID\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, \"ServerID\" TEXT NOT NULL, \"StartTime\" REAL NOT NULL, \"EndTime\" REAL NOT NULL);");
-        doQuery("CREATE TABLE IF NOT EXISTS \"Points\" (\"CupType\" TEXT NOT NULL, \"BZID\" INTEGER NOT NULL, \"CupID\" INTEGER NOT NULL, \"Points\" INTEGER NOT NULL, \"Ratio\" INTEGER NOT NULL)");
+        cupDatabase.use(db);
+
+        //finished cups are moved to their own database so the tables in the main database only hold the current cup
+        if (!cupDatabase.attachArchive(archivefilename))
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not open the archive database %s :: %s", archivefilename.c_str(), cupDatabase.lastError.c_str());
+
+        if (!cupDatabase.createSchema())
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not create the tables :: %s", cupDatabase.lastError.c_str());
+
+        if (!metricsfilename.empty()) //time every statement for the metrics, nobody looks at the times otherwise
+            sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, timeStatement, this);
+
+        //in WAL mode the standings can be read from a snapshot while the points are being written
+        doQuery("PRAGMA main.journal_mode = WAL;");
+        doQuery("PRAGMA archive.journal_mode = WAL;");
+
+        if (sqlite3_open_v2(dbfilename.c_str(), &readDb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+        {
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not open a read-only connection to %s :: %s", dbfilename.c_str(), sqlite3_errmsg(readDb));
+            bz_debugMessage(0, "DEBUG :: MoFo Cup :: The standings will be read from the main connection.");
+
+            sqlite3_close(readDb);
+            readDb = db;
+        }
+        else
+        {
+            if (!metricsfilename.empty())
+                sqlite3_trace_v2(readDb, SQLITE_TRACE_PROFILE, timeStatement, this);
+
+            sqlite3_stmt *attachReadArchiveStmt = getStatement(eAttachReadArchive);
+
+            if (attachReadArchiveStmt != NULL)
+            {
+                sqlite3_bind_text(attachReadArchiveStmt, 1, archivefilename.c_str(), -1, SQLITE_TRANSIENT);
+
+                if (stepStatement(eAttachReadArchive, attachReadArchiveStmt) != SQLITE_DONE)
+                    bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not open the archive database %s :: %s", archivefilename.c_str(), sqlite3_errmsg(readDb));
+
+                sqlite3_reset(attachReadArchiveStmt);
+            }
+        }
     }
 
     //unload the plugin if any events fail to register
@@ -160,7 +639,21 @@ void mofocup::Init(const char* commandLine)
         bz_unloadPlugin(Name());
     }
 
+    loadCupRegistry();
+    openLiveStats();
+    startStatsServer();
+    startEventWriter();
+    readSnapshot(); //before any cup is archived, the snapshot may hold points for a cup that ended while the plugin wasn't running
+    archiveFinishedCups(); //catch up on any cup that ended while the plugin wasn't running
     startCup();
+    loadSnapshot(); //carry on where the plugin left off when it was last unloaded
+
+    if (checkQueryPlans() > 0 && queryPlanCheck == "strict") //a schema or query change made a statement run on every event scan a whole table
+    {
+        bz_debugMessage(0, "DEBUG :: MoFo Cup :: Unloading MoFoCup plugin...");
+        bz_unloadPlugin(Name());
+    }
+
     bz_debugMessage(4, "DEBUG :: MoFo Cup :: Successfully loaded and database connection ready.");
 }
 
@@ -171,12 +664,28 @@ void mofocup::Cleanup()
     bz_removeCustomSlashCommand("rank");
     bz_removeCustomSlashCommand("refreshcup");
 
+    saveSnapshot(); //anything that couldn't be saved is written to the database by cleanCup()
+    logStatementProfiles();
     cleanCup();
+    finishEventWriter();
+    finishStatsServer();
+    closeLiveStats();
+
+    finalizeStatements(readDb);
+
+    if (readDb != NULL && readDb != db) //the connections stay open across /refreshcup, so only close them on unload
+        sqlite3_close(readDb);
+
+    if (db != NULL)
+        sqlite3_close(db);
+
     bz_debugMessage(4, "DEBUG :: MoFo Cup :: Successfully unloaded and database connection closed.");
 }
 
 void mofocup::Event(bz_EventData* eventData)
 {
+    eventsHandled[eventData->eventType]++;
+
     switch (eventData->eventType)
     {
         case bz_eCaptureEvent:
@@ -207,22 +716,17 @@ void mofocup::Event(bz_EventData* eventData)
             */
 
             bz_CTFCaptureEventData_V1* ctfdata = (bz_CTFCaptureEventData_V1*)eventData;
-            std::string bzid = bz_getPlayerByIndex(ctfdata->playerCapping)->bzID.c_str(),
-                        callsign = bz_getPlayerByIndex(ctfdata->playerCapping)->callsign.c_str();
+            uint64_t bzid = playerBZIDs[ctfdata->playerCapping];
+            std::string callsign = playerCallsigns[ctfdata->playerCapping];
 
-            if (bzid.empty()) //ignore the cap if it's an unregistered player
+            if (bzid == 0) //ignore the cap if it's an unregistered player
                 return;
 
             //update playing time of the capper to accurately calculate the total points
             addCurrentPlayingTime(bzid, callsign);
-            trackNewPlayingTime(bzid);
-
-            int bonusPoints = 8 * (bz_getTeamCount(ctfdata->teamCapped) - bz_getTeamCount(ctfdata->teamCapping)) + 3 * bz_getTeamCount(ctfdata->teamCapped); //calculate the amount of bonus points
+            trackNewPlayingTime(bzid, callsign);
 
-            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has captured the flag earning %i points towards the CTF Cup", callsign.c_str(), bzid.c_str(), bonusPoints);
-
-            incrementPoints(bzid, "CTF", convertToString(bonusPoints));
-            updatePlayerRatio(bzid);
+            dispatchScoring(eventData, ctfdata->playerCapping, bzid, callsign);
         }
         break;
 
@@ -249,12 +753,12 @@ void mofocup::Event(bz_EventData* eventData)
             if (diedata->killerID == 253) //ignore kills made by world weapons
                 return;
 
-            std::string bzid = bz_getPlayerByIndex(diedata->killerID)->bzID.c_str(),
-                        callsign = bz_getPlayerByIndex(diedata->killerID)->callsign.c_str();
-
-            if (bzid.empty()) //No need to continue if the player isn't registered
+            if (diedata->killerID < 0 || diedata->killerID > 255 || playerBZIDs[diedata->killerID] == 0) //No need to continue if the player isn't registered
                 return;
 
+            uint64_t bzid = playerBZIDs[diedata->killerID];
+            std::string callsign = playerCallsigns[diedata->killerID];
+
             /*
                 MoFo Cup :: Bounty Cup
                 ----------------------
@@ -267,60 +771,19 @@ void mofocup::Event(bz_EventData* eventData)
             if (diedata->playerID != diedata->killerID) //if it's not a selfkill, increment their bounty
                 numberOfKills[diedata->killerID]++;
 
-            //store scoring info
-            int killerRampageScore = 0;
-            int killerBonusScore = 0;
-
-            if (diedata->playerID == lastPlayerDied && diedata->playerID != diedata->killerID && timeDropped + 3 > bz_getCurrentTime()) //check if a team flag carrier was killed
-                killerBonusScore = 2; //2 points for killing a team flag carrier
-
-            if (numberOfKills[diedata->playerID] > 0) //if the player who died had a bounty
-            {
-                for (int i = 0; i < sizeof(rampage)/sizeof(int); i++) //go through all the rampage levels
-                {
-                    //figure out what number to multiply by for a bounty total
-                    if (numberOfKills[diedata->playerID] >= rampage[i] && numberOfKills[diedata->playerID] < rampage[i+1] && diedata->playerID != diedata->killerID)
-                        killerRampageScore = 2 * i;
-                }
-            }
-
-            if (killerRampageScore + killerBonusScore > 0)
-            {
-                bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) earned %i total bounty points.", callsign.c_str(), bzid.c_str(), killerRampageScore + killerBonusScore);
-                bountyPoints[diedata->killerID] += killerRampageScore + killerBonusScore;
-            }
-
-            numberOfKills[diedata->playerID] = 0; //reset the bounty on the player who died to 0
-
             /*
-                MoFo Cup :: Geno Cup
-                ----------------------
+                MoFo Cup :: Scoring
+                -------------------
 
-                Keep track of all the points a player has earned by killing
-                a team using genocide
+                Every cup that scores kills (Bounty, Geno, Kills, etc.) gets
+                a chance to award points before the bounty on the player who
+                died is cleared
 
             */
 
-            if (((diedata->flagKilledWith == "R*" && diedata->team != eRedTeam) ||
-                diedata->flagKilledWith == "G*" && diedata->team != eGreenTeam ||
-                diedata->flagKilledWith == "B*" && diedata->team != eBlueTeam ||
-                diedata->flagKilledWith == "P*" && diedata->team != ePurpleTeam) && //check if it's a geno hit
-                diedata->team != diedata->killerTeam && //check that it's not affecting the same team
-                diedata->playerID != diedata->killerID) //check that it's not a selfkill
-            {
-                genoPoints[diedata->killerID] += playersKilledByGenocide(diedata->killerTeam) + 1;
-                bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has got a geno hit earning %i points towards the Geno Cup", callsign.c_str(), bzid.c_str(), playersKilledByGenocide(diedata->killerTeam));
-            }
-
-            /*
-                MoFo Cup :: Kills Cup
-                ---------------------
-
-                Keep track of all the kills a player makes
-
-            */
+            dispatchScoring(eventData, diedata->killerID, bzid, callsign);
 
-            killPoints[diedata->killerID] += 1;
+            numberOfKills[diedata->playerID] = 0; //reset the bounty on the player who died to 0
         }
         break;
 
@@ -340,10 +803,14 @@ void mofocup::Event(bz_EventData* eventData)
             */
 
             bz_PlayerJoinPartEventData_V1* joindata = (bz_PlayerJoinPartEventData_V1*)eventData;
-            std::string bzid = joindata->record->bzID.c_str(),
-                        callsign = joindata->record->callsign.c_str();
+            uint64_t bzid = parseBZID(joindata->record->bzID.c_str());
+            std::string callsign = joindata->record->callsign.c_str();
+
+            //the only time a player's BZID is read as text
+            playerBZIDs[joindata->playerID] = bzid;
+            playerCallsigns[joindata->playerID] = callsign;
 
-            if (bzid.empty() || joindata->record->team == eObservers) //don't do anything if the player is an observer or is not registered
+            if (bzid == 0 || joindata->record->team == eObservers) //don't do anything if the player is an observer or is not registered
                 return;
 
             if (isFirstTime(bzid)) //introduce players into the MoFo Cup
@@ -352,16 +819,13 @@ void mofocup::Event(bz_EventData* eventData)
                 bz_sendTextMessagef(BZ_SERVER, joindata->playerID, "The MoFo Cup is a monthly tournament that consists of the most Bounty, CTF, Geno hits, and kills a player has made.");
                 bz_sendTextMessagef(BZ_SERVER, joindata->playerID, "Type '/help cup' for more information about the MoFo Cup!");
 
-                for (int i = 0; i < sizeof(cups)/sizeof(std::string); i++) //Add players to the database for the first time playing
-                {
-                    doQuery("INSERT OR IGNORE INTO `Points` VALUES ('" + cups[i] + "', " + bzid + ", (SELECT `CupID` FROM `Cups` WHERE `ServerID` = '" + bz_getPublicAddr().c_str() + "' AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`), 0, 0)");
-                }
-
-                doQuery("INSERT OR IGNORE INTO `Players` VALUES (" + bzid + ", '" + callsign + "', (SELECT `CupID` FROM `Cups` WHERE `ServerID` = '" + bz_getPublicAddr().c_str() + "' AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`), 1)");
+                enrollPlayer(bzid, callsign);
             }
 
-            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has started to play, now recording playing time.", callsign.c_str(), bzid.c_str());
-            trackNewPlayingTime(bzid);
+            loadPlayerTotals(joindata->playerID, bzid);
+
+            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) has started to play, now recording playing time.", callsign.c_str(), (unsigned long long)bzid);
+            trackNewPlayingTime(bzid, callsign);
         }
         break;
 
@@ -380,26 +844,36 @@ void mofocup::Event(bz_EventData* eventData)
             */
 
             bz_PlayerJoinPartEventData_V1* partdata = (bz_PlayerJoinPartEventData_V1*)eventData;
-            std::string bzid = partdata->record->bzID.c_str(),
-                        callsign = partdata->record->callsign.c_str();
+            uint64_t bzid = playerBZIDs[partdata->playerID];
+            std::string callsign = playerCallsigns[partdata->playerID];
             numberOfKills[partdata->playerID] = 0;
+            playerBZIDs[partdata->playerID] = 0;
+            playerCallsigns[partdata->playerID].clear();
+
+            recordedPlayingTime[partdata->playerID] = 0;
+
+            for (unsigned int i = 0; i < cups.size(); i++)
+            {
+                cups[i].standingPlaces[partdata->playerID] = 0;
+                cups[i].recordedPoints[partdata->playerID] = 0;
+            }
+
+            //forget the kills this player was part of, whoever gets the slot next starts clean
+            slotGenerations[partdata->playerID]++;
+
+            for (int i = 0; i < 256; i++)
+                killPairCounts[partdata->playerID][i] = killPairCounts[i][partdata->playerID] = 0;
 
-            if (bzid.empty() || partdata->record->team == eObservers) //don't do anything if the player is an observer or is not registered
+            if (bzid == 0 || partdata->record->team == eObservers) //don't do anything if the player is an observer or is not registered
                 return;
 
             addCurrentPlayingTime(bzid, callsign); //they left, let's add their playing time to the database
 
-            if (bountyPoints[partdata->playerID] > 0) incrementPoints(bzid, "Bounty", convertToString(bountyPoints[partdata->playerID]));
-            if (genoPoints[partdata->playerID] > 0) incrementPoints(bzid, "Geno", convertToString(genoPoints[partdata->playerID]));
-            if (killPoints[partdata->playerID] > 0) incrementPoints(bzid, "Kill", convertToString(killPoints[partdata->playerID]));
-
+            flushPendingPoints(partdata->playerID, bzid);
             updatePlayerRatio(bzid);
+            ratedPlayers.reset(partdata->playerID);
 
-            bountyPoints[partdata->playerID] = 0;
-            genoPoints[partdata->playerID] = 0;
-            killPoints[partdata->playerID] = 0;
-
-            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has left. Updated their playing time and ratio.", callsign.c_str(), bzid.c_str());
+            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) has left. Updated their playing time and ratio.", callsign.c_str(), (unsigned long long)bzid);
         }
         break;
 
@@ -415,21 +889,36 @@ void mofocup::Event(bz_EventData* eventData)
             */
 
             bz_PlayerPausedEventData_V1* pausedata = (bz_PlayerPausedEventData_V1*)eventData;
-            std::string bzid = bz_getPlayerByIndex(pausedata->playerID)->bzID.c_str(),
-                        callsign = bz_getPlayerByIndex(pausedata->playerID)->callsign.c_str();
+            uint64_t bzid = playerBZIDs[pausedata->playerID];
+            std::string callsign = playerCallsigns[pausedata->playerID];
 
-            if (bzid.empty()) //don't bother if the player isn't registered
+            if (bzid == 0) //don't bother if the player isn't registered
                 return;
 
             if (pausedata->pause) //when a player pauses, we add their current playing time to the database
                 addCurrentPlayingTime(bzid, callsign);
             else //start tracking a player's playing time when they have unpaused
-                trackNewPlayingTime(bzid);
+                trackNewPlayingTime(bzid, callsign);
         }
         break;
 
         case bz_eTickEvent:
         {
+            if (currentCupID > 0 && currentCupEndTime <= time(NULL)) //the current cup is over, start the next one
+                rolloverCup();
+
+            if (liveStats != NULL && lastLiveStatsUpdate + 1 <= bz_getCurrentTime()) //scoreboards don't need the stats more than once a second
+            {
+                lastLiveStatsUpdate = bz_getCurrentTime();
+                publishLiveStats();
+            }
+
+            if (!metricsfilename.empty() && lastMetricsUpdate + METRICS_WRITE_INTERVAL <= bz_getCurrentTime())
+            {
+                lastMetricsUpdate = bz_getCurrentTime();
+                writeMetrics();
+            }
+
             if (bz_getTeamCount(eRedTeam) + bz_getTeamCount(eGreenTeam) + bz_getTeamCount(eBlueTeam) + bz_getTeamCount(ePurpleTeam) == 0)
                 return;
 
@@ -437,50 +926,28 @@ void mofocup::Event(bz_EventData* eventData)
             {
                 lastDatabaseUpdate = bz_getCurrentTime(); //Get the current time
 
-                bz_APIIntList *playerList = bz_newIntList();
-                bz_getPlayerIndexList(playerList);
-
-                for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
-                {
-                    std::string bzid = bz_getPlayerByIndex(playerList->get(i))->bzID.c_str(),
-                                callsign = bz_getPlayerByIndex(playerList->get(i))->callsign.c_str();
-
-                    if (bzid.empty()) //Go to the next player if this player isn't registered
-                        continue;
-
-                    addCurrentPlayingTime(bzid, callsign);
-
-                    if (bountyPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Bounty", convertToString(bountyPoints[playerList->get(i)]));
-                    if (genoPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Geno", convertToString(genoPoints[playerList->get(i)]));
-                    if (killPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Kill", convertToString(killPoints[playerList->get(i)]));
-
-                    bountyPoints[playerList->get(i)] = 0;
-                    genoPoints[playerList->get(i)] = 0;
-                    killPoints[playerList->get(i)] = 0;
+                flushAllPlayers();
+                archiveFinishedCups(); //move any cup that has ended out of the live tables
+                reportEventWriterErrors();
+                reportStatsServerErrors();
 
-                    updatePlayerRatio(bzid);
-                    trackNewPlayingTime(bzid);
-                }
-
-                bz_deleteIntList(playerList);
-
-                for (int i = 0; i < 4; i++) //loop through all the cups
+                for (unsigned int i = 0; i < cups.size(); i++) //loop through all the cups
                 {
-                    for (int j = 0; j < 5; j++) //loop through the top 5 players
+                    for (int j = 0; j < cups[i].topN; j++) //loop through the top players
                     {
-                        std::vector<std::string> getPlayerInformation = getPlayerInCupStanding(cups[i], convertToString(j));
+                        cupStanding getPlayerInformation = getPlayerInCupStanding(cups[i].name, j);
 
-                        if (strcmp(getPlayerInformation[2].c_str(), top5Players[i][j][2].c_str()) != 0) //if a player has a new position in the top 5
+                        if (getPlayerInformation.bzid != cups[i].topPlayers[j].bzid) //if a player has a new position in the top players
                         {
-                            if (isPlayerAvailable(getPlayerInformation[2])) //if the player is playing on the server, announce it
-                                bz_sendTextMessagef(BZ_SERVER, BZ_ALLUSERS, "Congrats to %s for being #%i in the %s Cup!!!", getPlayerInformation[0].c_str(), j + 1, cups[i].c_str());
-
-                            //update the player stats
-                            top5Players[i][j][0] = getPlayerInformation[0];
-                            top5Players[i][j][1] = getPlayerInformation[1];
-                            top5Players[i][j][2] = getPlayerInformation[2];
+                            if (isPlayerAvailable(getPlayerInformation.bzid)) //if the player is playing on the server, announce it
+                                bz_sendTextMessagef(BZ_SERVER, BZ_ALLUSERS, "Congrats to %s for being #%i in the %s Cup!!!", getPlayerInformation.callsign.c_str(), j + 1, cups[i].name.c_str());
                         }
+
+                        //update the player stats
+                        cups[i].topPlayers[j] = getPlayerInformation;
                     }
+
+                    updateStandingPlaces(cups[i]); //remember where everyone playing stands for the live stats
                 }
             }
         }
@@ -491,45 +958,142 @@ void mofocup::Event(bz_EventData* eventData)
     }
 }
 
+int mofocup::GeneralCallback(const char* name, void* data)
+{
+    /*
+        Answer a request from another plugin for the standings, see
+        mofocup_api.h. Other plugins send their own requests to every
+        plugin, so the name is checked before anything is read from the
+        data. Everything is answered from memory.
+    */
+
+    if (name == NULL || data == NULL)
+        return MOFOCUP_API_UNKNOWN;
+
+    std::string request = name;
+    char *cupName;
+    int playerID = -1;
+
+    if (request != MOFOCUP_API_RANK && request != MOFOCUP_API_TOP && request != MOFOCUP_API_LIVE_SCORE)
+        return MOFOCUP_API_UNKNOWN;
+
+    if (*(uint32_t*)data != MOFOCUP_API_VERSION) //every request starts with the version it was built for, the rest may be laid out differently
+        return MOFOCUP_API_UNKNOWN;
+
+    if (request == MOFOCUP_API_RANK)
+    {
+        cupName = ((mofocupRankRequest*)data)->cup;
+        playerID = ((mofocupRankRequest*)data)->playerID;
+    }
+    else if (request == MOFOCUP_API_TOP)
+        cupName = ((mofocupTopRequest*)data)->cup;
+    else
+    {
+        cupName = ((mofocupLiveScoreRequest*)data)->cup;
+        playerID = ((mofocupLiveScoreRequest*)data)->playerID;
+    }
+
+    std::string cupNameOrAlias(cupName, strnlen(cupName, MOFOCUP_LIVE_NAME_LENGTH));
+    cupDescriptor *cup = findCupByAlias(cupNameOrAlias);
+
+    for (unsigned int i = 0; i < cups.size() && cup == NULL; i++)
+    {
+        if (cups[i].name == cupNameOrAlias)
+            cup = &cups[i];
+    }
+
+    if (cup == NULL)
+        return MOFOCUP_API_NO_CUP;
+
+    if (request == MOFOCUP_API_TOP)
+    {
+        mofocupTopRequest *top = (mofocupTopRequest*)data;
+        int wanted = std::min(top->count, MOFOCUP_LIVE_MAX_TOP);
+
+        for (top->count = 0; top->count < wanted && top->count < (int)cup->topPlayers.size() && cup->topPlayers[top->count].bzid != 0; top->count++) //stop at the first place nobody holds yet
+        {
+            mofocupLiveStanding &standing = top->top[top->count];
+
+            standing.bzid = cup->topPlayers[top->count].bzid;
+            standing.score = atoi(cup->topPlayers[top->count].score.c_str());
+            standing.reserved = 0;
+            snprintf(standing.callsign, sizeof(standing.callsign), "%s", cup->topPlayers[top->count].callsign.c_str());
+        }
+
+        return MOFOCUP_API_OK;
+    }
+
+    if (playerID < 0 || playerID >= 256 || playerBZIDs[playerID] == 0)
+        return MOFOCUP_API_NO_PLAYER;
+
+    if (request == MOFOCUP_API_RANK)
+    {
+        mofocupRankRequest *rank = (mofocupRankRequest*)data;
+
+        rank->bzid = playerBZIDs[playerID];
+        rank->place = cup->standingPlaces[playerID];
+        rank->score = (rank->place > 0 ? cup->standingScores[playerID] : 0);
+    }
+    else
+    {
+        mofocupLiveScoreRequest *liveScore = (mofocupLiveScoreRequest*)data;
+
+        liveScore->bzid = playerBZIDs[playerID];
+        liveScore->score = getLiveScore(*cup, playerID);
+        liveScore->pendingPoints = cup->pendingPoints[playerID];
+    }
+
+    return MOFOCUP_API_OK;
+}
+
 bool mofocup::SlashCommand(int playerID, bz_ApiString command, bz_ApiString message, bz_APIStringList *params)
 {
     if(command == "cup")
     {
-        if (strcmp(params->get(0).c_str(), "bounty") == 0 ||
-            strcmp(params->get(0).c_str(), "ctf") == 0 ||
-            strcmp(params->get(0).c_str(), "geno") == 0 ||
-            strcmp(params->get(0).c_str(), "kills") == 0)
-        {
-            std::string cup;
+        cupDescriptor *cupInfo = findCupByAlias(params->get(0).c_str());
 
-            if (strcmp(params->get(0).c_str(), "bounty") == 0) cup = "Bounty";
-            else if (strcmp(params->get(0).c_str(), "ctf") == 0) cup = "CTF";
-            else if (strcmp(params->get(0).c_str(), "geno") == 0) cup = "Geno";
-            else if (strcmp(params->get(0).c_str(), "kills") == 0) cup = "Kill";
+        if (cupInfo != NULL && params->size() > 1 && toLowerCase(params->get(1).c_str()) == "today") //today's points
+        {
+            showRecentStandings(playerID, cupInfo, "Today", 1);
+        }
+        else if (cupInfo != NULL && params->size() > 1 && toLowerCase(params->get(1).c_str()) == "week") //the points of the last seven days
+        {
+            showRecentStandings(playerID, cupInfo, "This Week", 7);
+        }
+        else if (cupInfo != NULL && params->size() > 1) //looking up a finished cup
+        {
+            showArchivedCup(playerID, cupInfo, params->get(1).c_str());
+        }
+        else if (cupInfo != NULL)
+        {
+            std::string cup = cupInfo->name;
+            liveScoreMap liveScores = getLiveScores(*cupInfo); //the points earned since the last database update count too
+            std::vector<cupStanding> topPlayers = getLiveTopPlayers(*cupInfo, liveScores);
 
             bz_sendTextMessagef(BZ_SERVER, playerID, "Planet MoFo %s Cup", cup.c_str());
             bz_sendTextMessage(BZ_SERVER, playerID, "--------------------");
             bz_sendTextMessage(BZ_SERVER, playerID, "        Callsign                    Points");
 
-            for (int i = 0; i < 5; i++) //get the stats for top 5 players
-            {
-                std::vector<std::string> playerInfo = getPlayerInCupStanding(cup, convertToString(i));
-
-                bz_sendTextMessage(BZ_SERVER, playerID, formatScore(convertToString(i + 1), playerInfo[0], playerInfo[1]).c_str());
-            }
+            for (unsigned int i = 0; i < topPlayers.size(); i++) //get the stats for the top players
+                bz_sendTextMessage(BZ_SERVER, playerID, formatScore(convertToString((int)i + 1), topPlayers[i].callsign, topPlayers[i].score).c_str());
 
-            if (std::string(bz_getPlayerByIndex(playerID)->bzID.c_str()).empty()) //check if player is registered to display their stats
+            if (playerBZIDs[playerID] == 0) //check if player is registered to display their stats
                 return true;
 
             bz_sendTextMessage(BZ_SERVER, playerID, " "); //nice little space
 
-            std::vector<std::string> myPlayerInfo = getPlayerStandingFromBZID(cup, bz_getPlayerByIndex(playerID)->bzID.c_str()); //get player's stats
+            std::vector<std::string> myPlayerInfo = getLiveStandingFromBZID(*cupInfo, playerBZIDs[playerID], liveScores); //get player's stats
 
-            bz_sendTextMessage(BZ_SERVER, playerID, formatScore(myPlayerInfo[0], bz_getPlayerByIndex(playerID)->callsign.c_str(), myPlayerInfo[1]).c_str());
+            bz_sendTextMessage(BZ_SERVER, playerID, formatScore(myPlayerInfo[0], playerCallsigns[playerID], myPlayerInfo[1]).c_str());
         }
         else //give the user some help
         {
-            bz_sendTextMessage(BZ_SERVER, playerID, "Usage: /cup <bounty | ctf | geno | kills>");
+            std::string aliases; //build the list of cups players can look up
+
+            for (unsigned int i = 0; i < cups.size(); i++)
+                aliases += (i == 0 ? "" : " | ") + cups[i].alias;
+
+            bz_sendTextMessagef(BZ_SERVER, playerID, "Usage: /cup <%s> [today | week | YYYY-MM]", aliases.c_str());
             bz_sendTextMessage(BZ_SERVER, playerID, "See '/help cup' for more information regarding the MoFo Cup.");
         }
 
@@ -537,7 +1101,7 @@ bool mofocup::SlashCommand(int playerID, bz_ApiString command, bz_ApiString mess
     }
     else if(command == "rank")
     {
-        if (std::string(bz_getPlayerByIndex(playerID)->bzID.c_str()).empty())
+        if (playerBZIDs[playerID] == 0)
         {
             bz_sendTextMessage(BZ_SERVER, playerID, "You are not a registered BZFlag player, please register at 'http://forums.bzflag.org' in order to join the MoFo Cup.");
             return true;
@@ -554,26 +1118,26 @@ bool mofocup::SlashCommand(int playerID, bz_ApiString command, bz_ApiString mess
 
         if (strcmp(params->get(0).c_str(), "") != 0) //if we are searching for a callsign
         {
-            for (int i = 0; i < sizeof(cups)/sizeof(std::string); i++) //go through each cup
+            for (unsigned int i = 0; i < cups.size(); i++) //go through each cup
             {
-                std::vector<std::string> playerRank = getPlayerStandingFromCallsign(cups[i], callsignToLookup);
+                std::vector<std::string> playerRank = getLiveStandingFromCallsign(cups[i], callsignToLookup, getLiveScores(cups[i]));
 
                 if (strcmp(playerRank[0].c_str(), "-1") == 0)
                     bz_sendTextMessagef(BZ_SERVER, playerID, "%s is not part of the current MoFo Cup.", callsignToLookup.c_str());
                 else
-                    bz_sendTextMessagef(BZ_SERVER, playerID, "%s is currently #%s in the %s Cup with a score of %s", callsignToLookup.c_str(), playerRank[0].c_str(), cups[i].c_str(), playerRank[1].c_str());
+                    bz_sendTextMessagef(BZ_SERVER, playerID, "%s is currently #%s in the %s Cup with a score of %s", callsignToLookup.c_str(), playerRank[0].c_str(), cups[i].name.c_str(), playerRank[1].c_str());
             }
         }
         else
         {
-            for (int i = 0; i < sizeof(cups)/sizeof(std::string); i++) //go through each cup
+            for (unsigned int i = 0; i < cups.size(); i++) //go through each cup
             {
-                std::vector<std::string> playerRank = getPlayerStandingFromBZID(cups[i], bz_getPlayerByIndex(playerID)->bzID.c_str());
+                std::vector<std::string> playerRank = getLiveStandingFromBZID(cups[i], playerBZIDs[playerID], getLiveScores(cups[i]));
 
                 if (strcmp(playerRank[0].c_str(), "-1") == 0)
                     bz_sendTextMessage(BZ_SERVER, playerID, "You are not part of the MoFo Cup yet. Get in there and cap or kill someone!");
                 else
-                    bz_sendTextMessagef(BZ_SERVER, playerID, "You are currently #%s in the %s Cup with a score of %s", playerRank[0].c_str(), cups[i].c_str(), playerRank[1].c_str());
+                    bz_sendTextMessagef(BZ_SERVER, playerID, "You are currently #%s in the %s Cup with a score of %s", playerRank[0].c_str(), cups[i].name.c_str(), playerRank[1].c_str());
             }
         }
 
@@ -584,7 +1148,7 @@ bool mofocup::SlashCommand(int playerID, bz_ApiString command, bz_ApiString mess
         if (bz_hasPerm(playerID, "mofocup"))
         {
             bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, "WARNING: There may be lag or jitter spikes for the next minute or so.");
-            bz_sendTextMessagef(BZ_SERVER, eAdministrators, "%s has requested the MoFo Cup database to be forcefully updated.", bz_getPlayerByIndex(playerID)->callsign.c_str());
+            bz_sendTextMessagef(BZ_SERVER, eAdministrators, "%s has requested the MoFo Cup database to be forcefully updated.", playerCallsigns[playerID].c_str());
 
             cleanCup();
             startCup();
@@ -596,7 +1160,7 @@ bool mofocup::SlashCommand(int playerID, bz_ApiString command, bz_ApiString mess
     }
 }
 
-void mofocup::addCurrentPlayingTime(std::string bzid, std::string callsign)
+void mofocup::addCurrentPlayingTime(uint64_t bzid, std::string callsign)
 {
     /*
         This function will add a player's current playing time
@@ -607,21 +1171,9 @@ void mofocup::addCurrentPlayingTime(std::string bzid, std::string callsign)
     {
         for (unsigned int i = 0; i < playingTime.size(); i++) //Go through all the stored playing times
         {
-            if (strcmp(playingTime.at(i).bzid.c_str(), bzid.c_str()) == 0) //We found the playing time stored for the specified BZID
+            if (playingTime.at(i).bzid == bzid) //We found the playing time stored for the specified BZID
             {
-                int timePlayed = bz_getCurrentTime() - playingTime.at(i).joinTime; //get the player's playing time
-
-                bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has played for %i seconds. Updating the database...", callsign.c_str(), bzid.c_str(), timePlayed);
-
-                //build the query
-                sqlite3_bind_text(addCurrentPlayingTimeStmt, 1, bzid.c_str(), -1, SQLITE_TRANSIENT);
-                sqlite3_bind_text(addCurrentPlayingTimeStmt, 2, convertToString(timePlayed).c_str(), -1, SQLITE_TRANSIENT);
-                sqlite3_bind_text(addCurrentPlayingTimeStmt, 3, bzid.c_str(), -1, SQLITE_TRANSIENT);
-                sqlite3_bind_text(addCurrentPlayingTimeStmt, 4, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
-
-                //prepare to execute and execute the query
-                sqlite3_step(addCurrentPlayingTimeStmt);
-                sqlite3_reset(addCurrentPlayingTimeStmt);
+                recordPlayingTime(bzid, callsign, bz_getCurrentTime() - playingTime.at(i).joinTime);
 
                 playingTime.erase(playingTime.begin() + i, playingTime.begin() + i + 1); //remove this stored time from the structure
             }
@@ -629,446 +1181,2903 @@ void mofocup::addCurrentPlayingTime(std::string bzid, std::string callsign)
     }
 }
 
-void mofocup::cleanCup(void)
+std::string mofocup::answerStatsQuery(const mofocupLiveStats &stats, std::string query)
 {
-    bz_APIIntList *playerList = bz_newIntList();
-    bz_getPlayerIndexList(playerList);
+    /*
+        Answer a query sent to the stats socket. Every answer ends with an
+        empty line and anything that can't be answered is a single line
+        starting with "error".
+
+            cups           - the alias, name and 1 if it's rated, for every cup
+            top <alias>    - the place, BZID, score and callsign of the top players of a cup
+            rank <player>  - the alias, place, score, unflushed points and rating in every cup of a player, by BZID or callsign
+            players        - the slot, BZID, team, bounty and callsign of everyone on the server
+    */
 
-    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    std::ostringstream answer;
+    std::string command = toLowerCase(query.substr(0, query.find(" ")));
+    std::string argument = (query.find(" ") == std::string::npos) ? "" : trimWhitespace(query.substr(query.find(" ") + 1));
+
+    if (command == "cups")
+    {
+        for (unsigned int i = 0; i < stats.cupCount; i++)
+            answer << stats.cups[i].alias << " " << stats.cups[i].name << " " << stats.cups[i].rated << "\n";
+    }
+    else if (command == "top")
     {
-        std::string bzid = bz_getPlayerByIndex(playerList->get(i))->bzID.c_str(),
-                    callsign = bz_getPlayerByIndex(playerList->get(i))->callsign.c_str();
-        numberOfKills[playerList->get(i)] = 0;
+        unsigned int cupIndex = 0;
 
-        if (bzid.empty() || bz_getPlayerByIndex(playerList->get(i))->team == eObservers) //don't do anything if the player is an observer or is not registered
-            return;
+        while (cupIndex < stats.cupCount && argument != stats.cups[cupIndex].alias)
+            cupIndex++;
 
-        addCurrentPlayingTime(bzid, callsign); //they left, let's add their playing time to the database
+        if (cupIndex == stats.cupCount)
+            return "error unknown cup\n\n";
 
-        if (bountyPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Bounty", convertToString(bountyPoints[playerList->get(i)]));
-        if (genoPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Geno", convertToString(genoPoints[playerList->get(i)]));
-        if (killPoints[playerList->get(i)] > 0) incrementPoints(bzid, "Kill", convertToString(killPoints[playerList->get(i)]));
+        const mofocupLiveCup &cup = stats.cups[cupIndex];
 
-        updatePlayerRatio(bzid);
+        for (int j = 0; j < cup.topCount; j++)
+            answer << j + 1 << " " << cup.top[j].bzid << " " << cup.top[j].score << " " << cup.top[j].callsign << "\n";
+    }
+    else if (command == "rank")
+    {
+        uint64_t bzid = parseBZID(argument);
+        int playerID = 0;
 
-        bountyPoints[playerList->get(i)] = 0;
-        genoPoints[playerList->get(i)] = 0;
-        killPoints[playerList->get(i)] = 0;
+        while (playerID < MOFOCUP_LIVE_MAX_PLAYERS &&
+               (stats.players[playerID].bzid == 0 || (bzid != 0 ? stats.players[playerID].bzid != bzid : toLowerCase(stats.players[playerID].callsign) != toLowerCase(argument))))
+            playerID++;
 
-        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Stats recorded for %s (%s) while preparing for plugin clean up.", callsign.c_str(), bzid.c_str());
-    }
+        if (playerID == MOFOCUP_LIVE_MAX_PLAYERS)
+            return "error player isn't playing\n\n";
 
-    bz_deleteIntList(playerList);
+        const mofocupLivePlayer &player = stats.players[playerID];
 
-    sqlite3_finalize(addCurrentPlayingTimeStmt);
-    sqlite3_finalize(getPlayerInCupStandingStmt);
-    sqlite3_finalize(getPlayerStandingFromBZIDStmt);
-    sqlite3_finalize(getPlayerStandingFromCallsignStmt);
-    sqlite3_finalize(isFirstTimeStmt);
-    sqlite3_finalize(incrementPointsStmt);
-    sqlite3_finalize(getCurrentPlayerStatsStmt);
-    sqlite3_finalize(updatePlayerRatioStmt);
+        for (unsigned int i = 0; i < stats.cupCount; i++)
+            answer << stats.cups[i].alias << " " << player.places[i] << " " << player.scores[i] << " " << player.pendingPoints[i] << " " << player.ratings[i] << "\n";
+    }
+    else if (command == "players")
+    {
+        for (int playerID = 0; playerID < MOFOCUP_LIVE_MAX_PLAYERS; playerID++)
+        {
+            if (stats.players[playerID].callsign[0] != 0)
+                answer << playerID << " " << stats.players[playerID].bzid << " " << stats.players[playerID].team << " " << stats.players[playerID].bounty << " " << stats.players[playerID].callsign << "\n";
+        }
+    }
+    else
+        return "error unknown query\n\n";
 
-    if (db != NULL) //close the database connection since we won't need it
-      sqlite3_close(db);
+    answer << "\n";
+    return answer.str();
 }
 
-std::string mofocup::convertToString(int myInt)
+bool mofocup::archiveCup(int cupID)
 {
     /*
-        Convert an integer into a string
+        Move a finished cup to the archive database, see
+        mofocupDatabase::archiveCup()
     */
 
-    std::string myString;
-    std::stringstream string;
-    string << myInt; //Use an stringstream to pass an int through a string
-    myString = string.str();
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Archiving cup #%i...", cupID);
 
-    return myString;
+    if (!cupDatabase.archiveCup(cupID))
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not archive cup #%i :: %s", cupID, cupDatabase.lastError.c_str());
+        return false;
+    }
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Cup #%i has been archived.", cupID);
+
+    return true;
 }
 
-std::string mofocup::convertToString(double myDouble)
+void mofocup::archiveFinishedCups(void)
 {
     /*
-        Convert an double into a string
+        Archive every cup on this server that has ended but is still
+        in the live tables
     */
 
-    std::ostringstream myString;
-
-    if (!(myString << myDouble))
-        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Error converting %d to a string", myDouble);
+    std::vector<int> finishedCups = cupDatabase.getFinishedCups(bz_getPublicAddr().c_str());
 
-    return myString.str();
+    for (unsigned int i = 0; i < finishedCups.size(); i++)
+        archiveCup(finishedCups[i]);
 }
 
-void mofocup::doQuery(std::string query)
+int mofocup::checkQueryPlans(void)
 {
     /*
-        Execute a SQL query without the need of any return values
+        Ask SQLite how it will run each of the statements run on every
+        event and database update and warn about any that would step
+        through a whole table or sort their results in a temporary
+        B-tree, they get slower with every player in the cup. Sorting only
+        the ties of an index is fine. Returns how many statements would.
     */
 
-    bz_debugMessage(2, "DEBUG :: MoFo Cup :: Executing following SQL query...");
-    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s", query.c_str());
+    if (queryPlanCheck == "off")
+        return 0;
 
-    char* db_err = 0; //a place to store the error
-    int ret = sqlite3_exec(db, query.c_str(), NULL, 0, &db_err); //execute
+    int slowStatements = 0;
 
-    if (db_err != 0) //print out any errors
+    for (unsigned int i = 0; i < sizeof(hotStatements) / sizeof(hotStatements[0]); i++)
     {
-        bz_debugMessage(2, "DEBUG :: MoFo Cup :: SQL ERROR!");
-        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s", db_err);
-    }
+        sqlite3_stmt *statement = getStatement(hotStatements[i]);
+
+        if (statement == NULL)
+            continue;
+
+        sqlite3 *connection = sqlite3_db_handle(statement);
+        std::string sql = sqlite3_sql(statement);
+        sqlite3_stmt *explainStmt;
+        bool slow = false;
+
+        if (sqlite3_prepare_v2(connection, ("EXPLAIN QUERY PLAN " + sql).c_str(), -1, &explainStmt, 0) != SQLITE_OK)
+        {
+            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: SQLite :: Could not explain '%s' :: Error #%i: %s", sql.c_str(), sqlite3_errcode(connection), sqlite3_errmsg(connection));
+            continue;
+        }
+
+        while (sqlite3_step(explainStmt) == SQLITE_ROW)
+        {
+            std::string detail = (const char*)sqlite3_column_text(explainStmt, 3);
+            bool tableScan = (detail.compare(0, 5, "SCAN ") == 0 && detail.find(" USING ") == std::string::npos &&
+                              detail.find("(subquery") == std::string::npos && detail != "SCAN CONSTANT ROW");
+            bool temporarySort = (detail.compare(0, 20, "USE TEMP B-TREE FOR ") == 0 && detail.find(" OF ") == std::string::npos); //not "RIGHT PART OF ORDER BY"
+
+            if (tableScan || temporarySort)
+            {
+                bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Warning! '%s' will %s :: %s", sql.c_str(), tableScan ? "scan a whole table" : "sort in a temporary B-tree", detail.c_str());
+                slow = true;
+            }
+        }
+
+        sqlite3_finalize(explainStmt);
+
+        if (slow)
+            slowStatements++;
+    }
+
+    return slowStatements;
 }
 
-std::string mofocup::formatScore(std::string place, std::string callsign, std::string points)
+void mofocup::cleanCup(void)
 {
-    /*
-        Format the leader board with spacing
-    */
+    flushAllPlayers(); //record everyone's stats while preparing for plugin clean up
 
-    place = "#" + place;
-    if (callsign.length() >= 26) callsign = callsign.substr(0, 26);
-    while (place.length() < 8) place += " ";
-    while (callsign.length() < 28) callsign += " ";
-    while (points.length() < 6) points += " ";
+    playingTime.clear();
+    ratedPlayers.reset();
+    memset(numberOfKills, 0, sizeof(numberOfKills));
 
-    return (place + callsign + points);
+    bz_debugMessage(2, "DEBUG :: MoFo Cup :: Stats recorded for all players while preparing for plugin clean up.");
+
+    finalizeStatements(db); //startCup() prepares them again when they're next needed
+    cupDatabase.close(); //only finalizes its statements, the connection is ours
 }
 
-std::vector<std::string> mofocup::getPlayerInCupStanding(std::string cup, std::string place)
+void mofocup::closeLiveStats(void)
 {
     /*
-        Get the information for the Nth player in the cup
+        Remove the live stats segment so scoreboards don't keep showing
+        the stats of a server that's gone. The stats server has to be
+        stopped first.
     */
 
-    std::vector<std::string> playerStats(3);
-
-    sqlite3_bind_text(getPlayerInCupStandingStmt, 1, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerInCupStandingStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerInCupStandingStmt, 3, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerInCupStandingStmt, 4, place.c_str(), -1, SQLITE_TRANSIENT);
+    if (liveStats == NULL)
+        return;
 
-    if (sqlite3_step(getPlayerInCupStandingStmt) == SQLITE_ROW)
+    if (liveStatsName.empty())
+        delete liveStats;
+    else
     {
-        if ((char*)sqlite3_column_text(getPlayerInCupStandingStmt, 0) != NULL ||
-            (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 1) != NULL ||
-            (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 2) != NULL)
-        {
-            playerStats[0] = (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 0);
-            playerStats[1] = (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 1);
-            playerStats[2] = (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 2);
-
-            sqlite3_reset(getPlayerInCupStandingStmt);
-            return playerStats;
-        }
+        munmap(liveStats, sizeof(mofocupLiveStats));
+        shm_unlink(liveStatsName.c_str());
     }
 
-    playerStats[0] = "Anonymous";
-    playerStats[1] = "-1";
-    playerStats[2] = "0";
+    liveStats = NULL;
+}
 
-    sqlite3_reset(getPlayerInCupStandingStmt);
-    return playerStats;
+std::string mofocup::convertToString(int myInt)
+{
+    /*
+        Convert an integer into a string
+    */
+
+    std::string myString;
+    std::stringstream string;
+    string << myInt; //Use an stringstream to pass an int through a string
+    myString = string.str();
+
+    return myString;
 }
 
-std::vector<std::string> mofocup::getPlayerStandingFromBZID(std::string cup, std::string bzid)
+std::string mofocup::convertToString(double myDouble)
 {
     /*
-        Get the information for a player based on callsign
+        Convert an double into a string
     */
 
-    std::vector<std::string> playerStats(2);
+    std::ostringstream myString;
 
-    sqlite3_bind_text(getPlayerStandingFromBZIDStmt, 1, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerStandingFromBZIDStmt, 2, bzid.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerStandingFromBZIDStmt, 3, cup.c_str(), -1, SQLITE_TRANSIENT);
+    if (!(myString << myDouble))
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Error converting %d to a string", myDouble);
 
-    if (sqlite3_step(getPlayerStandingFromBZIDStmt) == SQLITE_ROW)
-    {
-        if ((char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 0) != NULL ||
-            (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 1) != NULL)
-        {
-            playerStats[1] = (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 0);
-            playerStats[0] = (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 1);
+    return myString.str();
+}
 
-            sqlite3_reset(getPlayerStandingFromBZIDStmt);
-            return playerStats;
-        }
-    }
+std::string mofocup::convertToString(uint64_t myBZID)
+{
+    /*
+        Convert a BZID into a string
+    */
 
-    playerStats[1] = "-1";
-    playerStats[0] = "-1";
+    std::stringstream string;
+    string << myBZID;
 
-    sqlite3_reset(getPlayerStandingFromBZIDStmt);
-    return playerStats;
+    return string.str();
 }
 
-std::vector<std::string> mofocup::getPlayerStandingFromCallsign(std::string cup, std::string callsign)
+void mofocup::dispatchScoring(bz_EventData *eventData, int playerID, uint64_t bzid, std::string callsign)
 {
     /*
-        Get the information for a player based on callsign
+        Give every cup that scores this type of event a chance to
+        award points to the player responsible for it
     */
 
-    std::vector<std::string> playerStats(2);
+    bool ratioChanged = false;
+    int variables[eFormulaVariableCount] = {0};
+    int awardedPoints[MAX_CUPS] = {0};
 
-    sqlite3_bind_text(getPlayerStandingFromCallsignStmt, 1, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerStandingFromCallsignStmt, 2, callsign.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(getPlayerStandingFromCallsignStmt, 3, cup.c_str(), -1, SQLITE_TRANSIENT);
+    getFormulaVariables(eventData, variables);
 
-    if (sqlite3_step(getPlayerStandingFromCallsignStmt) == SQLITE_ROW)
+    if (eventData->eventType == bz_ePlayerDieEvent && isFarmedKill((bz_PlayerDieEventData_V1*)eventData)) //no cup counts a farmed kill
     {
-        if ((char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 0) != NULL ||
-            (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 2) != NULL)
-        {
-            playerStats[1] = (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 0);
-            playerStats[0] = (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 2);
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) has killed the same player too often, no points awarded", callsign.c_str(), (unsigned long long)bzid);
+        farmedKills++;
+        logEvent(eventData, bzid, variables, awardedPoints, true);
+        return;
+    }
 
-            sqlite3_reset(getPlayerStandingFromCallsignStmt);
-            return playerStats;
+    for (unsigned int i = 0; i < eventSubscribers[eventData->eventType].size(); i++) //only the cups that care about this event
+    {
+        cupDescriptor &cup = cups[eventSubscribers[eventData->eventType][i]];
+        int points = (this->*cup.hook)(cup, eventData, variables);
+
+        if (points == 0) //a negative score costs points, like capping a smaller team's flag
+            continue;
+
+        awardedPoints[eventSubscribers[eventData->eventType][i]] = points;
+        cup.pointsAwarded += points;
+
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) earned %i points towards the %s Cup", callsign.c_str(), (unsigned long long)bzid, points, cup.name.c_str());
+
+        if (cup.flushPolicy == eDeferredFlush) //hold on to the points until the next database update
+        {
+            cup.pendingPoints[playerID] += points;
+            dirtyPlayers.set(playerID);
+        }
+        else
+        {
+            incrementPoints(bzid, cup.name, convertToString(points));
+            cup.recordedPoints[playerID] += points;
+            ratioChanged = true;
         }
     }
 
-    playerStats[1] = "-1";
-    playerStats[0] = "-1";
+    if (ratioChanged)
+        updatePlayerRatio(bzid);
 
-    sqlite3_reset(getPlayerStandingFromCallsignStmt);
-    return playerStats;
+    logEvent(eventData, bzid, variables, awardedPoints, false);
 }
 
-void mofocup::incrementPoints(std::string bzid, std::string cup, std::string pointsToIncrement)
+void mofocup::doQuery(std::string query)
 {
     /*
-        Increment a player's points in the respective table by the
-        specified value
+        Execute a SQL query without the need of any return values
     */
 
-    bz_debugMessagef(4, "DEBUG :: MoFo Cup :: incrementPoints() receiving...");
-    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   BZID -> %s", bzid.c_str());
-    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Cup -> %s", cup.c_str());
-    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Points -> %s", pointsToIncrement.c_str());
+    bz_debugMessage(2, "DEBUG :: MoFo Cup :: Executing following SQL query...");
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s", query.c_str());
 
-    //build the query
-    sqlite3_bind_text(incrementPointsStmt, 1, bzid.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(incrementPointsStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(incrementPointsStmt, 3, pointsToIncrement.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(incrementPointsStmt, 4, cup.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(incrementPointsStmt, 5, bzid.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(incrementPointsStmt, 6, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+    char* db_err = 0; //a place to store the error
+    int ret = sqlite3_exec(db, query.c_str(), NULL, 0, &db_err); //execute
 
-    //execute
-    sqlite3_step(incrementPointsStmt);
-    sqlite3_reset(incrementPointsStmt);
+    if (db_err != 0) //print out any errors
+    {
+        bz_debugMessage(2, "DEBUG :: MoFo Cup :: SQL ERROR!");
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s", db_err);
+    }
 }
 
-bool mofocup::isDigit(std::string myString)
+void mofocup::enrollPlayer(uint64_t bzid, std::string callsign)
 {
     /*
-        Check to see if a string is a digit
+        Add a player to every cup of the current MoFo Cup. The callsign is
+        bound instead of being written into the query so any callsign can
+        be stored, and everything is written in one transaction so a
+        player joining costs a single commit.
     */
 
-    for (int i = 0; i < myString.size(); i++) //Go through entire string
+    sqlite3_stmt *addPlayerPointsStmt = getStatement(eAddPlayerPoints);
+    sqlite3_stmt *addPlayerStmt = getStatement(eAddPlayer);
+
+    if (addPlayerPointsStmt == NULL || addPlayerStmt == NULL)
+        return;
+
+    doQuery("SAVEPOINT enrollPlayer"); //a savepoint so a player can also be added as part of a bigger transaction
+
+    bool success = true;
+
+    for (unsigned int i = 0; i < cups.size() && success; i++) //every cup starts at 0 points, or the starting rating for rated cups
     {
-        if (!isdigit(myString[i])) //If one character is not a digit, then the string is not a digit
-            return false;
+        sqlite3_bind_text(addPlayerPointsStmt, 1, cups[i].name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(addPlayerPointsStmt, 2, bzid);
+        sqlite3_bind_int(addPlayerPointsStmt, 3, currentCupID);
+        sqlite3_bind_int(addPlayerPointsStmt, 4, cups[i].rated ? STARTING_RATING : 0);
+
+        success = (stepStatement(eAddPlayerPoints, addPlayerPointsStmt) == SQLITE_DONE);
+        sqlite3_reset(addPlayerPointsStmt);
     }
-    return true; //All characters are digits
+
+    if (success)
+    {
+        sqlite3_bind_int64(addPlayerStmt, 1, bzid);
+        sqlite3_bind_text(addPlayerStmt, 2, callsign.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(addPlayerStmt, 3, currentCupID);
+
+        success = (stepStatement(eAddPlayer, addPlayerStmt) == SQLITE_DONE);
+        sqlite3_reset(addPlayerStmt);
+    }
+
+    if (!success)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not enter %s (%llu) into the cup :: %s", callsign.c_str(), (unsigned long long)bzid, sqlite3_errmsg(db));
+        doQuery("ROLLBACK TO enrollPlayer");
+    }
+
+    doQuery("RELEASE enrollPlayer");
 }
 
-bool mofocup::isFirstTime(std::string bzid)
+std::vector<int> mofocup::enrollPlayers(std::vector<int> playerIDs)
 {
     /*
-        Check if it's the player's first time as part of the current cup
+        Add the players in these slots to every cup of the current MoFo
+        Cup, unless they already are. Everyone who is already entered is
+        found with one query and everyone else is added with one statement
+        per table in a single transaction, so it takes the same handful of
+        queries whether one or sixty players are online. Returns the slots
+        of the players who were added.
     */
 
-    sqlite3_bind_text(isFirstTimeStmt, 1, bzid.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(isFirstTimeStmt, 2, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+    std::vector<uint64_t> enrolledBZIDs;
+    std::vector<int> newPlayers;
+    sqlite3_stmt *getEnrolledPlayersStmt = getStatement(eGetEnrolledPlayers);
+
+    if (getEnrolledPlayersStmt == NULL)
+        return newPlayers;
+
+    sqlite3_bind_int(getEnrolledPlayersStmt, 1, currentCupID);
+
+    while (stepStatement(eGetEnrolledPlayers, getEnrolledPlayersStmt) == SQLITE_ROW)
+        enrolledBZIDs.push_back(sqlite3_column_int64(getEnrolledPlayersStmt, 0));
+
+    sqlite3_reset(getEnrolledPlayersStmt);
+    std::sort(enrolledBZIDs.begin(), enrolledBZIDs.end());
 
-    if (sqlite3_step(isFirstTimeStmt) == SQLITE_ROW)
+    for (unsigned int i = 0; i < playerIDs.size(); i++)
     {
-        sqlite3_reset(isFirstTimeStmt);
-        return false;
+        if (!std::binary_search(enrolledBZIDs.begin(), enrolledBZIDs.end(), playerBZIDs[playerIDs[i]]))
+            newPlayers.push_back(playerIDs[i]);
     }
 
-    sqlite3_reset(isFirstTimeStmt);
-    return true;
+    if (newPlayers.empty())
+        return newPlayers;
+
+    //the statements depend on how many players are being added, so they're only used once instead of being kept with the prepared statements
+    std::string insertPlayersQuery = "INSERT OR IGNORE INTO `Players` (`BZID`, `Callsign`, `CupID`, `PlayingTime`) VALUES (?, ?, ?, 1)";
+    std::string insertPointsQuery = "INSERT INTO `Points` (`CupType`, `BZID`, `CupID`, `Points`, `Ratio`) SELECT `Cup`.`column1`, `Player`.`column1`, ?1, `Cup`.`column2`, `Cup`.`column2` FROM (VALUES (?, ?)";
+
+    for (unsigned int i = 1; i < newPlayers.size(); i++)
+        insertPlayersQuery += ", (?, ?, ?, 1)";
+
+    for (unsigned int i = 1; i < cups.size(); i++)
+        insertPointsQuery += ", (?, ?)";
+
+    insertPointsQuery += ") AS `Cup`, (VALUES (?)";
+
+    for (unsigned int i = 1; i < newPlayers.size(); i++)
+        insertPointsQuery += ", (?)";
+
+    insertPointsQuery += ") AS `Player`";
+
+    sqlite3_stmt *insertPlayersStmt = NULL, *insertPointsStmt = NULL;
+    bool success = (sqlite3_prepare_v2(db, insertPlayersQuery.c_str(), -1, &insertPlayersStmt, 0) == SQLITE_OK &&
+                    (cups.empty() || sqlite3_prepare_v2(db, insertPointsQuery.c_str(), -1, &insertPointsStmt, 0) == SQLITE_OK));
+
+    if (success)
+    {
+        int parameter = 1;
+
+        for (unsigned int i = 0; i < newPlayers.size(); i++)
+        {
+            sqlite3_bind_int64(insertPlayersStmt, parameter++, playerBZIDs[newPlayers[i]]);
+            sqlite3_bind_text(insertPlayersStmt, parameter++, playerCallsigns[newPlayers[i]].c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(insertPlayersStmt, parameter++, currentCupID);
+        }
+    }
+
+    if (success && insertPointsStmt != NULL)
+    {
+        int parameter = 1;
+        sqlite3_bind_int(insertPointsStmt, parameter++, currentCupID);
+
+        for (unsigned int i = 0; i < cups.size(); i++) //every cup starts at 0 points, or the starting rating for rated cups
+        {
+            sqlite3_bind_text(insertPointsStmt, parameter++, cups[i].name.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(insertPointsStmt, parameter++, cups[i].rated ? STARTING_RATING : 0);
+        }
+
+        for (unsigned int i = 0; i < newPlayers.size(); i++)
+            sqlite3_bind_int64(insertPointsStmt, parameter++, playerBZIDs[newPlayers[i]]);
+    }
+
+    doQuery("SAVEPOINT enrollPlayers"); //a savepoint so players can also be added as part of a bigger transaction
+
+    success = success && sqlite3_step(insertPlayersStmt) == SQLITE_DONE && (insertPointsStmt == NULL || sqlite3_step(insertPointsStmt) == SQLITE_DONE);
+
+    if (!success)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not enter %i players into the cup :: %s", (int)newPlayers.size(), sqlite3_errmsg(db));
+        doQuery("ROLLBACK TO enrollPlayers");
+        newPlayers.clear();
+    }
+
+    doQuery("RELEASE enrollPlayers");
+
+    sqlite3_finalize(insertPlayersStmt);
+    sqlite3_finalize(insertPointsStmt);
+
+    return newPlayers;
 }
 
-bool mofocup::isPlayerAvailable(std::string bzid)
+mofocup::cupDescriptor* mofocup::findCupByAlias(std::string alias)
 {
     /*
-        Check if a player is on the server based on the BZID
+        Find the cup players refer to with the /cup command
     */
 
-    bz_APIIntList *playerList = bz_newIntList();
-    bz_getPlayerIndexList(playerList);
-
-    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    for (unsigned int i = 0; i < cups.size(); i++)
     {
-        if (strcmp(bz_getPlayerByIndex(playerList->get(i))->bzID.c_str(), bzid.c_str()) == 0 && bz_getPlayerByIndex(playerList->get(i))->team != eObservers)
-        {
-            bz_deleteIntList(playerList);
-            return true;
-        }
+        if (cups[i].alias == alias)
+            return &cups[i];
     }
 
-    bz_deleteIntList(playerList);
-    return false;
+    return NULL;
 }
 
-bool mofocup::isValidPlayerID(int playerID)
+void mofocup::finalizeStatements(sqlite3 *connection)
 {
-    bz_APIIntList *playerList = bz_newIntList();
-    bz_getPlayerIndexList(playerList);
+    /*
+        Finalize the statements prepared on a connection, before it's
+        closed or when the cup is refreshed. They're prepared again the
+        next time they're needed.
+    */
 
-    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    for (int i = 0; i < eStatementCount; i++)
     {
-        if (playerList->get(i) == playerID)
+        if (statements[i] != NULL && sqlite3_db_handle(statements[i]) == connection)
         {
-            bz_deleteIntList(playerList);
-            return true;
+            sqlite3_finalize(statements[i]);
+            statements[i] = NULL;
         }
     }
-
-    bz_deleteIntList(playerList);
-    return false;
 }
 
-int mofocup::playersKilledByGenocide(bz_eTeamType killerTeam)
+void mofocup::finishEventWriter(void)
 {
     /*
-        Get the amount of players that have been ideally killed
-        by a genocide hit because not all players on a team will
-        be spawned at the time of the hit
+        Stop the event writer once everything it was given has been
+        written to the event log
     */
 
-    int playerCount = 0; //the value we'll return
-    bz_APIIntList *playerList = bz_newIntList();
-    bz_getPlayerIndexList(playerList);
+    if (!eventWriter.joinable())
+        return;
 
-    for (unsigned int i = 0; i < playerList->size(); i++) //go through all the players
     {
-        //check a player is part of the team affected, not an observer, and is spawned
-        if (bz_getPlayerByIndex(playerList->get(i))->team != killerTeam &&
-            bz_getPlayerByIndex(playerList->get(i))->team != eObservers &&
-            bz_getPlayerByIndex(playerList->get(i))->spawned)
-            playerCount++;
+        std::lock_guard<std::mutex> lock(eventQueueMutex);
+        eventWriterStopping = true;
     }
 
-    bz_deleteIntList(playerList);
-    return playerCount;
+    eventQueueReady.notify_one();
+    eventWriter.join();
+
+    reportEventWriterErrors();
 }
 
-sqlite3_stmt* mofocup::prepareQuery(std::string sql)
+void mofocup::finishStatsServer(void)
 {
     /*
-        Thanks to blast for this function
+        Stop the stats server and remove its socket
     */
 
-    // Search our std::map for this statement
-    PreparedStatementMap::iterator itr = preparedStatements.find(sql);
-
-    // If it doesn't exist, create it
-    if (itr == preparedStatements.end())
+    if (statsServer.joinable())
     {
-        sqlite3_stmt* newStatement;
+        uint64_t stop = 1;
 
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &newStatement, 0) != SQLITE_OK)
-        {
-            bz_debugMessagef(2, "DEBUG :: MoFo Cup :: SQLite :: Failed to generate prepared statement for '%s' :: Error #%i: %s", sql.c_str(), sqlite3_errcode(db), sqlite3_errmsg(db));
-            return NULL;
-        }
-        else
-        {
-            preparedStatements[sql] = newStatement;
-        }
+        if (write(statsWakeup, &stop, sizeof(stop)) != sizeof(stop))
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not stop the stats server :: %s", strerror(errno));
+
+        statsServer.join();
+        reportStatsServerErrors();
+    }
+
+    if (statsListener >= 0)
+    {
+        close(statsListener);
+        unlink(statsSocketName.c_str());
     }
 
-    return preparedStatements[sql];
+    if (statsEpoll >= 0)
+        close(statsEpoll);
+
+    if (statsWakeup >= 0)
+        close(statsWakeup);
+
+    statsListener = statsEpoll = statsWakeup = -1;
 }
 
-void mofocup::startCup(void)
+void mofocup::flushAllPlayers(void)
 {
-    addCurrentPlayingTimeStmt = prepareQuery("UPDATE `Players` SET `PlayingTime` = (SELECT `PlayingTime` FROM `Players` WHERE `BZID` = ?) + ? WHERE `BZID` = ? AND `CupID` = (SELECT `CupID` FROM `Cups` WHERE `ServerID` = ? AND strftime('%s', 'now') < `EndTime` AND strftime('%s', 'now') > `StartTime`)");
-    getPlayerInCupStandingStmt = prepareQuery("SELECT `Players`.`Callsign`, `Points`.`Ratio`, `Players`.`BZID` FROM `Points`, `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `CupType` = ? AND `Points`.`CupID` = (SELECT `Cups`.`CupID` FROM `Cups` WHERE `Points`.`CupType` = ? AND `Cups`.`ServerID` = ? AND strftime('%s','now') < `Cups`.`EndTime` AND strftime('%s','now') > `Cups`.`StartTime`) ORDER BY `Points`.`Ratio` DESC, `Players`.`PlayingTime` ASC LIMIT 1 OFFSET ?");
-    getPlayerStandingFromBZIDStmt = prepareQuery("SELECT `Ratio`, (SELECT COUNT(*) FROM `Points` AS c2 WHERE c2.Ratio > c1.Ratio AND `CupType` = ?) + 1 AS row_Num FROM `Points` AS c1 WHERE `BZID` = ? AND `CupType` = ?");
-    getPlayerStandingFromCallsignStmt = prepareQuery("SELECT `Ratio`, `BZID` AS myBZID, (SELECT COUNT(*) FROM `Points` AS c2 WHERE c2.Ratio > c1.Ratio AND `CupType` = ?) + 1 AS rowNum FROM `Points` AS c1 WHERE (SELECT `Callsign` FROM `Players` WHERE `BZID` = myBZID) LIKE ? AND `CupType` = ?");
-    isFirstTimeStmt = prepareQuery("SELECT `PlayingTime` FROM `Players` WHERE `BZID` = ? AND `CupID` = (SELECT `CupID` FROM `Cups` WHERE `ServerID` = ? AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`)");
-    incrementPointsStmt = prepareQuery("UPDATE `Points` SET `Points` = (SELECT `Points` FROM `Points` WHERE `BZID` = ? AND `CupType` = ?) + ? WHERE `CupType` = ? AND `BZID` = ? AND `CupID` = (SELECT `CupID` FROM `Cups` WHERE `ServerID` = ? AND strftime('%s', 'now') < `EndTime` AND strftime('%s', 'now') > `StartTime`)");
-    getCurrentPlayerStatsStmt = prepareQuery("SELECT `Points`.`Points`, `Players`.`PlayingTime`, `Points`.`Ratio` FROM `Points`, `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `Points`.`BZID` = ? AND `CupType` = ? AND `Points`.`CupID` = (SELECT `CupID` FROM `Cups` WHERE `ServerID` = ? AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`)");
-    updatePlayerRatioStmt = prepareQuery("UPDATE `Points` SET `Ratio` = ? WHERE `CupType` = ? AND `BZID` = ? AND `CupID` = (SELECT `CupID` FROM `Cups` WHERE `ServerID` = ? AND strftime('%s', 'now') < `EndTime` AND strftime('%s', 'now') > `StartTime`)");
+    /*
+        Write the playing time of everyone who is playing and the points
+        of everyone who has scored since the last update, then update the
+        ratio of those players. Observers, paused players and anyone whose
+        stats haven't changed are skipped so the cost of an update depends
+        on how much is going on rather than how many players are online.
+    */
 
-    bz_APIIntList *playerList = bz_newIntList();
-    bz_getPlayerIndexList(playerList);
+    std::chrono::steady_clock::time_point flushStart = std::chrono::steady_clock::now();
+    std::vector<uint64_t> changedPlayers; //the players whose ratio needs to be updated
+    double now = bz_getCurrentTime();
 
-    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    for (unsigned int i = 0; i < playingTime.size(); i++) //everyone who is playing right now
     {
-        std::string bzid = bz_getPlayerByIndex(playerList->get(i))->bzID.c_str(),
-                    callsign = bz_getPlayerByIndex(playerList->get(i))->callsign.c_str();
+        recordPlayingTime(playingTime[i].bzid, playingTime[i].callsign, now - playingTime[i].joinTime);
+
+        playingTime[i].joinTime = now; //keep counting from here
+        changedPlayers.push_back(playingTime[i].bzid);
+    }
 
-        if (bzid.empty() || bz_getPlayerByIndex(playerList->get(i))->team == eObservers) //don't do anything if the player is an observer or is not registered
+    for (unsigned int playerID = 0; playerID < dirtyPlayers.size() && dirtyPlayers.any(); playerID++) //everyone who has scored
+    {
+        if (!dirtyPlayers.test(playerID))
             continue;
 
-        if (isFirstTime(bzid)) //introduce players into the MoFo Cup
-        {
-            bz_sendTextMessagef(BZ_SERVER, playerList->get(i), "Welcome %s! By playing on Apocalypse, you have been entered to this month's MoFo Cup.", callsign.c_str());
-            bz_sendTextMessagef(BZ_SERVER, playerList->get(i), "The MoFo Cup is a monthly tournament that consists of the most Bounty, CTF, Geno hits, and kills a player has made.");
-            bz_sendTextMessagef(BZ_SERVER, playerList->get(i), "Type '/help cup' for more information about the MoFo Cup!");
+        uint64_t bzid = playerBZIDs[playerID];
 
-            for (int i = 0; i < sizeof(cups)/sizeof(std::string); i++) //Add players to the database for the first time playing
-            {
-                doQuery("INSERT OR IGNORE INTO `Points` VALUES ('" + cups[i] + "', " + bzid + ", (SELECT `CupID` FROM `Cups` WHERE `ServerID` = '" + bz_getPublicAddr().c_str() + "' AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`), 0, 0)");
-            }
+        if (bzid != 0)
+        {
+            flushPendingPoints(playerID, bzid);
 
-            doQuery("INSERT OR IGNORE INTO `Players` VALUES (" + bzid + ", '" + callsign + "', (SELECT `CupID` FROM `Cups` WHERE `ServerID` = '" + bz_getPublicAddr().c_str() + "' AND strftime('%s','now') < `EndTime` AND strftime('%s','now') > `StartTime`), 1)");
+            if (std::find(changedPlayers.begin(), changedPlayers.end(), bzid) == changedPlayers.end())
+                changedPlayers.push_back(bzid);
         }
 
-        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%s) has started to play, now recording playing time.", callsign.c_str(), bzid.c_str());
-        trackNewPlayingTime(bzid);
+        dirtyPlayers.reset(playerID);
     }
 
-    bz_deleteIntList(playerList);
+    for (unsigned int i = 0; i < changedPlayers.size(); i++)
+        updatePlayerRatio(changedPlayers[i]);
 
-    if (addCurrentPlayingTimeStmt == NULL || getPlayerInCupStandingStmt == NULL || getPlayerStandingFromBZIDStmt == NULL ||
-        getPlayerStandingFromCallsignStmt == NULL || isFirstTimeStmt == NULL || incrementPointsStmt == NULL ||
-        getCurrentPlayerStatsStmt == NULL || updatePlayerRatioStmt == NULL)
-        bz_unloadPlugin(Name());
+    observeLatency(flushLatency, std::chrono::duration<double>(std::chrono::steady_clock::now() - flushStart).count());
 }
 
-void mofocup::trackNewPlayingTime(std::string bzid)
+void mofocup::flushPendingPoints(int playerID, uint64_t bzid)
 {
     /*
-        Create a new slot in the structure in order to keep track
-        of a player's playing time
+        Write the points a player has earned since the last database
+        update for every cup that holds on to them
     */
 
-    playingTimeStructure newPlayingTime;
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        if (cups[i].rated && ratedPlayers.test(playerID) && dirtyPlayers.test(playerID))
+            saveRating(cups[i], bzid, cups[i].ratings[playerID]);
 
-    newPlayingTime.bzid = bzid;
-    newPlayingTime.joinTime = bz_getCurrentTime();
+        if (cups[i].pendingPoints[playerID] != 0)
+        {
+            incrementPoints(bzid, cups[i].name, convertToString(cups[i].pendingPoints[playerID]));
+            cups[i].recordedPoints[playerID] += cups[i].pendingPoints[playerID];
+        }
 
-    playingTime.push_back(newPlayingTime);
+        cups[i].pendingPoints[playerID] = 0;
+    }
+
+    dirtyPlayers.reset(playerID);
 }
 
-void mofocup::updatePlayerRatio(std::string bzid)
+std::string mofocup::formatScore(std::string place, std::string callsign, std::string points)
 {
     /*
-        Go through all the cups, and update each player's ratio in the table
-        for the appropriate cup
+        Format the leader board with spacing
     */
 
-    for (int i = 0; i < sizeof(cups)/sizeof(std::string); i++) //go through each cup
-    {
-        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: Updating (%s) player stats for player BZID -> %s", cups[i].c_str(), bzid.c_str());
-
+    place = "#" + place;
+    if (callsign.length() >= 26) callsign = callsign.substr(0, 26);
+    while (place.length() < 8) place += " ";
+    while (callsign.length() < 28) callsign += " ";
+    while (points.length() < 6) points += " ";
+
+    return (place + callsign + points);
+}
+
+std::string mofocup::getConfigValue(std::string section, std::string key, std::string defaultValue)
+{
+    /*
+        Get a setting from the configuration file or the default
+        value if it wasn't set
+    */
+
+    return config.getValue(section, key, defaultValue);
+}
+
+void mofocup::getFormulaVariables(bz_EventData *eventData, int *variables)
+{
+    /*
+        Work out everything the scoring formulas can use for an event once,
+        no matter how many cups score it
+    */
+
+    if (eventData->eventType == bz_ePlayerDieEvent)
+    {
+        bz_PlayerDieEventData_V1* diedata = (bz_PlayerDieEventData_V1*)eventData;
+
+        variables[eVictimBounty] = numberOfKills[diedata->playerID];
+        variables[eFlagCarrierKill] = (diedata->playerID == lastPlayerDied && timeDropped + 3 > bz_getCurrentTime()) ? 1 : 0; //check if a team flag carrier was killed
+        variables[eSelfKill] = (diedata->playerID == diedata->killerID) ? 1 : 0;
+
+        if (isGenocideHit(diedata))
+            variables[eGenoVictims] = playersKilledByGenocide(diedata->killerTeam);
+    }
+    else if (eventData->eventType == bz_eCaptureEvent)
+    {
+        bz_CTFCaptureEventData_V1* ctfdata = (bz_CTFCaptureEventData_V1*)eventData;
+
+        variables[eCappedTeamSize] = bz_getTeamCount(ctfdata->teamCapped);
+        variables[eCappingTeamSize] = bz_getTeamCount(ctfdata->teamCapping);
+    }
+}
+
+int mofocup::getLivePlace(cupDescriptor &cup, int score, const liveScoreMap &scores)
+{
+    /*
+        Work out the place a score would have in a cup right now. Everyone
+        ahead of it in the database is counted, then the players on the
+        server are counted by their live score instead of the one in the
+        database.
+    */
+
+    sqlite3_stmt *countPlayersAheadStmt = getStatement(eCountPlayersAhead);
+    int playersAhead = 0;
+
+    if (countPlayersAheadStmt != NULL)
+    {
+        sqlite3_bind_text(countPlayersAheadStmt, 1, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(countPlayersAheadStmt, 2, currentCupID);
+        sqlite3_bind_int(countPlayersAheadStmt, 3, score);
+
+        if (stepStatement(eCountPlayersAhead, countPlayersAheadStmt) == SQLITE_ROW)
+            playersAhead = sqlite3_column_int(countPlayersAheadStmt, 0);
+
+        sqlite3_reset(countPlayersAheadStmt);
+    }
+
+    for (liveScoreMap::const_iterator it = scores.begin(); it != scores.end(); ++it)
+    {
+        if (it->second.persistedScore > score)
+            playersAhead--;
+
+        if (it->second.score > score)
+            playersAhead++;
+    }
+
+    return playersAhead + 1;
+}
+
+int mofocup::getLiveScore(cupDescriptor &cup, int playerID)
+{
+    /*
+        Work out the score a player on the server has in a cup right now
+        from what's kept in memory, the same score getLiveScores() gets
+        from the database
+    */
+
+    if (cup.rated)
+    {
+        if (ratedPlayers.test(playerID))
+            return (int)floor(cup.ratings[playerID] + 0.5);
+
+        return (cup.standingPlaces[playerID] > 0 ? cup.standingScores[playerID] : 0); //they haven't been rated yet
+    }
+
+    int secondsPlayed = recordedPlayingTime[playerID];
+    double now = bz_getCurrentTime();
+
+    for (unsigned int i = 0; i < playingTime.size(); i++) //the time played since it was last written
+    {
+        if (playingTime[i].bzid == playerBZIDs[playerID])
+            secondsPlayed += (int)(now - playingTime[i].joinTime);
+    }
+
+    return calculateRatio(cup.recordedPoints[playerID] + cup.pendingPoints[playerID], secondsPlayed);
+}
+
+mofocup::liveScoreMap mofocup::getLiveScores(cupDescriptor &cup)
+{
+    /*
+        Get the score every player on the server has in a cup right now,
+        adding the points they have earned and the time they have played
+        since the last database update to what's in the database. Rated
+        cups use the rating kept in memory.
+    */
+
+    liveScoreMap scores;
+    std::vector<int> playerIDs;
+
+    for (int playerID = 0; playerID < 256; playerID++)
+    {
+        if (playerBZIDs[playerID] != 0)
+            playerIDs.push_back(playerID);
+    }
+
+    if (playerIDs.empty())
+        return scores;
+
+    //the statement depends on how many players are on the server, so it's only used once instead of being kept with the prepared statements
+    std::string query = "SELECT `Points`.`BZID`, `Points`.`Points`, `Points`.`Ratio`, `Players`.`PlayingTime` FROM `Points`, `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` AND `CupType` = ? AND `Points`.`CupID` = ? AND `Points`.`BZID` IN (?";
+
+    for (unsigned int i = 1; i < playerIDs.size(); i++)
+        query += ", ?";
+
+    query += ")";
+
+    sqlite3_stmt *getLiveScoresStmt;
+
+    if (sqlite3_prepare_v2(readDb, query.c_str(), -1, &getLiveScoresStmt, 0) != SQLITE_OK)
+    {
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: SQLite :: Failed to generate prepared statement for '%s' :: Error #%i: %s", query.c_str(), sqlite3_errcode(readDb), sqlite3_errmsg(readDb));
+        return scores;
+    }
+
+    sqlite3_bind_text(getLiveScoresStmt, 1, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getLiveScoresStmt, 2, currentCupID);
+
+    for (unsigned int i = 0; i < playerIDs.size(); i++)
+        sqlite3_bind_int64(getLiveScoresStmt, i + 3, playerBZIDs[playerIDs[i]]);
+
+    double now = bz_getCurrentTime();
+
+    while (sqlite3_step(getLiveScoresStmt) == SQLITE_ROW)
+    {
+        uint64_t bzid = sqlite3_column_int64(getLiveScoresStmt, 0);
+        int playerID = -1;
+
+        for (unsigned int i = 0; i < playerIDs.size() && playerID < 0; i++)
+        {
+            if (playerBZIDs[playerIDs[i]] == bzid)
+                playerID = playerIDs[i];
+        }
+
+        liveScore playerScore;
+        playerScore.playerID = playerID;
+        playerScore.persistedScore = sqlite3_column_int(getLiveScoresStmt, 2);
+        playerScore.score = playerScore.persistedScore;
+
+        if (cup.rated && ratedPlayers.test(playerID))
+            playerScore.score = (int)floor(cup.ratings[playerID] + 0.5);
+        else if (!cup.rated)
+        {
+            int points = sqlite3_column_int(getLiveScoresStmt, 1) + cup.pendingPoints[playerID];
+            int secondsPlayed = sqlite3_column_int(getLiveScoresStmt, 3);
+
+            for (unsigned int i = 0; i < playingTime.size(); i++) //the time played since it was last written
+            {
+                if (playingTime[i].bzid == bzid)
+                    secondsPlayed += (int)(now - playingTime[i].joinTime);
+            }
+
+            if (secondsPlayed > 0) //the same ratio updatePlayerRatio() writes
+                playerScore.score = calculateRatio(points, secondsPlayed);
+        }
+
+        scores[bzid] = playerScore;
+    }
+
+    sqlite3_finalize(getLiveScoresStmt);
+
+    return scores;
+}
+
+std::vector<std::string> mofocup::getLiveStandingFromBZID(cupDescriptor &cup, uint64_t bzid, const liveScoreMap &scores)
+{
+    /*
+        Get a player's place and score in a cup right now, in the same
+        form as getPlayerStandingFromBZID()
+    */
+
+    liveScoreMap::const_iterator it = scores.find(bzid);
+
+    if (it == scores.end()) //the player isn't on the server, or isn't part of the cup
+    {
+        std::vector<std::string> playerStats = getPlayerStandingFromBZID(cup.name, bzid);
+
+        if (playerStats[0] != "-1")
+            playerStats[0] = convertToString(getLivePlace(cup, atoi(playerStats[1].c_str()), scores));
+
+        return playerStats;
+    }
+
+    std::vector<std::string> playerStats(2);
+    playerStats[0] = convertToString(getLivePlace(cup, it->second.score, scores));
+    playerStats[1] = convertToString(it->second.score);
+
+    return playerStats;
+}
+
+std::vector<std::string> mofocup::getLiveStandingFromCallsign(cupDescriptor &cup, std::string callsign, const liveScoreMap &scores)
+{
+    /*
+        Get a player's place and score in a cup right now by their callsign,
+        in the same form as getPlayerStandingFromCallsign()
+    */
+
+    for (liveScoreMap::const_iterator it = scores.begin(); it != scores.end(); ++it) //someone on the server
+    {
+        if (toLowerCase(playerCallsigns[it->second.playerID]) == toLowerCase(callsign))
+            return getLiveStandingFromBZID(cup, it->first, scores);
+    }
+
+    std::vector<std::string> playerStats = getPlayerStandingFromCallsign(cup.name, callsign);
+
+    if (playerStats[0] != "-1") //their score hasn't changed since they left, but the players around them may have moved
+        playerStats[0] = convertToString(getLivePlace(cup, atoi(playerStats[1].c_str()), scores));
+
+    return playerStats;
+}
+
+std::vector<mofocup::cupStanding> mofocup::getLiveTopPlayers(cupDescriptor &cup, const liveScoreMap &scores)
+{
+    /*
+        Get the top of a cup right now. Only the players on the server can
+        have a different score from the one in the database, so the top
+        of the cup is among the players on the server and as many players
+        from the database as there are places.
+    */
+
+    std::vector<cupStanding> topPlayers;
+    std::vector<int> topScores;
+    std::vector<uint64_t> onlinePlayers; //in the order the database has them, so ties stay in the same order
+    sqlite3_stmt *getTopPlayersStmt = getStatement(eGetTopPlayers);
+
+    if (getTopPlayersStmt != NULL)
+    {
+        sqlite3_bind_int(getTopPlayersStmt, 1, currentCupID);
+        sqlite3_bind_text(getTopPlayersStmt, 2, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(getTopPlayersStmt, 3, cup.topN + scores.size());
+        sqlite3_bind_int(getTopPlayersStmt, 4, 0);
+
+        while (stepStatement(eGetTopPlayers, getTopPlayersStmt) == SQLITE_ROW)
+        {
+            uint64_t bzid = sqlite3_column_int64(getTopPlayersStmt, 1);
+            liveScoreMap::const_iterator it = scores.find(bzid);
+
+            cupStanding playerStats;
+            playerStats.callsign = (char*)sqlite3_column_text(getTopPlayersStmt, 2);
+            playerStats.bzid = bzid;
+
+            int score = (it == scores.end()) ? sqlite3_column_int(getTopPlayersStmt, 4) : it->second.score;
+            playerStats.score = convertToString(score);
+
+            if (it != scores.end()) //players on the server are added below, wherever their live score puts them
+            {
+                onlinePlayers.push_back(bzid);
+                continue;
+            }
+
+            topPlayers.push_back(playerStats);
+            topScores.push_back(score);
+        }
+
+        sqlite3_reset(getTopPlayersStmt);
+    }
+
+    for (liveScoreMap::const_iterator it = scores.begin(); it != scores.end(); ++it) //the players on the server too far down to be returned
+    {
+        if (std::find(onlinePlayers.begin(), onlinePlayers.end(), it->first) == onlinePlayers.end())
+            onlinePlayers.push_back(it->first);
+    }
+
+    for (unsigned int i = 0; i < onlinePlayers.size(); i++)
+    {
+        liveScoreMap::const_iterator it = scores.find(onlinePlayers[i]);
+        unsigned int place = 0;
+
+        while (place < topScores.size() && topScores[place] >= it->second.score) //ties stay behind the players already there
+            place++;
+
+        cupStanding playerStats;
+        playerStats.callsign = playerCallsigns[it->second.playerID];
+        playerStats.score = convertToString(it->second.score);
+        playerStats.bzid = it->first;
+
+        topPlayers.insert(topPlayers.begin() + place, playerStats);
+        topScores.insert(topScores.begin() + place, it->second.score);
+    }
+
+    cupStanding nobody;
+    nobody.callsign = "Anonymous";
+    nobody.score = "-1";
+    nobody.bzid = 0;
+
+    topPlayers.resize(cup.topN, nobody); //the places nobody holds yet look the same as they always have
+
+    return topPlayers;
+}
+
+mofocup::cupStanding mofocup::getPlayerInCupStanding(std::string cup, int place)
+{
+    /*
+        Get the information for the Nth player in the cup
+    */
+
+    sqlite3_stmt *getPlayerInCupStandingStmt = getStatement(eGetTopPlayers);
+    cupStanding playerStats;
+
+    //nobody holds the place unless it's found
+    playerStats.callsign = "Anonymous";
+    playerStats.score = "-1";
+    playerStats.bzid = 0;
+
+    if (getPlayerInCupStandingStmt == NULL)
+        return playerStats;
+
+    sqlite3_bind_int(getPlayerInCupStandingStmt, 1, currentCupID);
+    sqlite3_bind_text(getPlayerInCupStandingStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getPlayerInCupStandingStmt, 3, 1);
+    sqlite3_bind_int(getPlayerInCupStandingStmt, 4, place);
+
+    if (stepStatement(eGetTopPlayers, getPlayerInCupStandingStmt) == SQLITE_ROW)
+    {
+        if ((char*)sqlite3_column_text(getPlayerInCupStandingStmt, 2) != NULL ||
+            (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 4) != NULL)
+        {
+            playerStats.callsign = (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 2);
+            playerStats.score = (char*)sqlite3_column_text(getPlayerInCupStandingStmt, 4);
+            playerStats.bzid = sqlite3_column_int64(getPlayerInCupStandingStmt, 1);
+
+            sqlite3_reset(getPlayerInCupStandingStmt);
+            return playerStats;
+        }
+    }
+
+    sqlite3_reset(getPlayerInCupStandingStmt);
+    return playerStats;
+}
+
+std::vector<std::string> mofocup::getPlayerStandingFromBZID(std::string cup, uint64_t bzid)
+{
+    /*
+        Get the information for a player based on callsign
+    */
+
+    sqlite3_stmt *getPlayerStandingFromBZIDStmt = getStatement(eGetPlayerStandingFromBZID);
+    std::vector<std::string> playerStats(2);
+
+    //they don't have a place unless it's found
+    playerStats[1] = "-1";
+    playerStats[0] = "-1";
+
+    if (getPlayerStandingFromBZIDStmt == NULL)
+        return playerStats;
+
+    sqlite3_bind_int(getPlayerStandingFromBZIDStmt, 1, currentCupID);
+    sqlite3_bind_text(getPlayerStandingFromBZIDStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(getPlayerStandingFromBZIDStmt, 3, bzid);
+
+    if (stepStatement(eGetPlayerStandingFromBZID, getPlayerStandingFromBZIDStmt) == SQLITE_ROW)
+    {
+        if ((char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 0) != NULL ||
+            (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 4) != NULL)
+        {
+            playerStats[1] = (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 4);
+            playerStats[0] = (char*)sqlite3_column_text(getPlayerStandingFromBZIDStmt, 0);
+
+            sqlite3_reset(getPlayerStandingFromBZIDStmt);
+            return playerStats;
+        }
+    }
+
+    sqlite3_reset(getPlayerStandingFromBZIDStmt);
+    return playerStats;
+}
+
+std::vector<std::string> mofocup::getPlayerStandingFromCallsign(std::string cup, std::string callsign)
+{
+    /*
+        Get the information for a player based on callsign
+    */
+
+    sqlite3_stmt *getPlayerStandingFromCallsignStmt = getStatement(eGetPlayerStandingFromCallsign);
+    std::vector<std::string> playerStats(2);
+
+    //they don't have a place unless it's found
+    playerStats[1] = "-1";
+    playerStats[0] = "-1";
+
+    if (getPlayerStandingFromCallsignStmt == NULL)
+        return playerStats;
+
+    sqlite3_bind_int(getPlayerStandingFromCallsignStmt, 1, currentCupID);
+    sqlite3_bind_text(getPlayerStandingFromCallsignStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(getPlayerStandingFromCallsignStmt, 4, callsign.c_str(), -1, SQLITE_TRANSIENT);
+
+    if (stepStatement(eGetPlayerStandingFromCallsign, getPlayerStandingFromCallsignStmt) == SQLITE_ROW)
+    {
+        if ((char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 0) != NULL ||
+            (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 4) != NULL)
+        {
+            playerStats[1] = (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 4);
+            playerStats[0] = (char*)sqlite3_column_text(getPlayerStandingFromCallsignStmt, 0);
+
+            sqlite3_reset(getPlayerStandingFromCallsignStmt);
+            return playerStats;
+        }
+    }
+
+    sqlite3_reset(getPlayerStandingFromCallsignStmt);
+    return playerStats;
+}
+
+sqlite3_stmt* mofocup::getStatement(preparedStatement statement)
+{
+    /*
+        Get one of the statements in statementQueries, preparing it on its
+        connection the first time it's needed. They're kept until the
+        connection is closed, so SQLite is told not to take their memory
+        from the lookaside pool meant for short lived allocations.
+    */
+
+    if (statements[statement] != NULL)
+        return statements[statement];
+
+    sqlite3 *connection = (statementQueries[statement].readOnly ? readDb : db);
+
+    if (sqlite3_prepare_v3(connection, statementQueries[statement].sql, -1, SQLITE_PREPARE_PERSISTENT, &statements[statement], 0) != SQLITE_OK)
+    {
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: SQLite :: Failed to generate prepared statement for '%s' :: Error #%i: %s", statementQueries[statement].sql, sqlite3_errcode(connection), sqlite3_errmsg(connection));
+        statements[statement] = NULL;
+    }
+
+    return statements[statement];
+}
+
+void mofocup::incrementPoints(uint64_t bzid, std::string cup, std::string pointsToIncrement)
+{
+    /*
+        Increment a player's points in the respective table by the
+        specified value
+    */
+
+    bz_debugMessagef(4, "DEBUG :: MoFo Cup :: incrementPoints() receiving...");
+    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   BZID -> %llu", (unsigned long long)bzid);
+    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Cup -> %s", cup.c_str());
+    bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Points -> %s", pointsToIncrement.c_str());
+
+    sqlite3_stmt *incrementPointsStmt = getStatement(eIncrementPoints);
+
+    if (incrementPointsStmt == NULL)
+        return;
+
+    //build the query
+    sqlite3_bind_text(incrementPointsStmt, 1, pointsToIncrement.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(incrementPointsStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(incrementPointsStmt, 3, bzid);
+    sqlite3_bind_int(incrementPointsStmt, 4, currentCupID);
+
+    //execute
+    stepStatement(eIncrementPoints, incrementPointsStmt);
+    sqlite3_reset(incrementPointsStmt);
+
+    //add the points to today's total as well so the daily and weekly standings never need to be recalculated
+    sqlite3_stmt *addDailyPointsStmt = getStatement(eAddDailyPoints);
+
+    if (addDailyPointsStmt == NULL)
+        return;
+
+    sqlite3_bind_int(addDailyPointsStmt, 1, currentCupID);
+    sqlite3_bind_text(addDailyPointsStmt, 2, cup.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(addDailyPointsStmt, 3, bzid);
+    sqlite3_bind_text(addDailyPointsStmt, 4, pointsToIncrement.c_str(), -1, SQLITE_TRANSIENT);
+
+    stepStatement(eAddDailyPoints, addDailyPointsStmt);
+    sqlite3_reset(addDailyPointsStmt);
+}
+
+bool mofocup::isDigit(std::string myString)
+{
+    /*
+        Check to see if a string is a digit
+    */
+
+    for (int i = 0; i < myString.size(); i++) //Go through entire string
+    {
+        if (!isdigit(myString[i])) //If one character is not a digit, then the string is not a digit
+            return false;
+    }
+    return true; //All characters are digits
+}
+
+bool mofocup::isFarmedKill(bz_PlayerDieEventData_V1 *diedata)
+{
+    /*
+        Remember a kill and check if the killer has killed the same
+        player more than the farming limit allows within the farming
+        window. The oldest kills are forgotten as new ones come in, so
+        this takes the same time and memory no matter how many players
+        come and go.
+    */
+
+    int killerID = diedata->killerID, victimID = diedata->playerID;
+
+    if (farmingLimit <= 0 || killerID == victimID || killerID < 0 || killerID > 255 || victimID < 0 || victimID > 255)
+        return false;
+
+    double now = bz_getCurrentTime();
+
+    //forget the kills that are too old, or the oldest one if there's no room left
+    while (recentKillsCount > 0 && (recentKillsCount == KILL_PAIR_HISTORY || recentKills[recentKillsStart].time + farmingWindow < now))
+    {
+        killPairEntry &oldest = recentKills[recentKillsStart];
+
+        if (oldest.killerGeneration == slotGenerations[oldest.killerID] && oldest.victimGeneration == slotGenerations[oldest.victimID] &&
+            killPairCounts[oldest.killerID][oldest.victimID] > 0)
+            killPairCounts[oldest.killerID][oldest.victimID]--;
+
+        recentKillsStart = (recentKillsStart + 1) % KILL_PAIR_HISTORY;
+        recentKillsCount--;
+    }
+
+    killPairEntry &newest = recentKills[(recentKillsStart + recentKillsCount) % KILL_PAIR_HISTORY];
+
+    newest.killerID = killerID;
+    newest.victimID = victimID;
+    newest.killerGeneration = slotGenerations[killerID];
+    newest.victimGeneration = slotGenerations[victimID];
+    newest.time = now;
+    recentKillsCount++;
+
+    return (++killPairCounts[killerID][victimID] > farmingLimit);
+}
+
+bool mofocup::isFirstTime(uint64_t bzid)
+{
+    /*
+        Check if it's the player's first time as part of the current cup
+    */
+
+    sqlite3_stmt *isFirstTimeStmt = getStatement(eIsFirstTime);
+
+    if (isFirstTimeStmt == NULL) //don't welcome them again when the database can't tell
+        return false;
+
+    sqlite3_bind_int64(isFirstTimeStmt, 1, bzid);
+    sqlite3_bind_int(isFirstTimeStmt, 2, currentCupID);
+
+    if (stepStatement(eIsFirstTime, isFirstTimeStmt) == SQLITE_ROW)
+    {
+        sqlite3_reset(isFirstTimeStmt);
+        return false;
+    }
+
+    sqlite3_reset(isFirstTimeStmt);
+    return true;
+}
+
+bool mofocup::isGenocideHit(bz_PlayerDieEventData_V1 *diedata)
+{
+    /*
+        Check if a player was killed by a genocide hit on another team
+    */
+
+    return ((diedata->flagKilledWith == "R*" && diedata->team != eRedTeam) ||
+        diedata->flagKilledWith == "G*" && diedata->team != eGreenTeam ||
+        diedata->flagKilledWith == "B*" && diedata->team != eBlueTeam ||
+        diedata->flagKilledWith == "P*" && diedata->team != ePurpleTeam) && //check if it's a geno hit
+        diedata->team != diedata->killerTeam && //check that it's not affecting the same team
+        diedata->playerID != diedata->killerID; //check that it's not a selfkill
+}
+
+bool mofocup::isPlayerAvailable(uint64_t bzid)
+{
+    /*
+        Check if a player is on the server based on the BZID
+    */
+
+    if (bzid == 0)
+        return false;
+
+    for (int i = 0; i < 256; i++) //Go through all the player slots
+    {
+        if (playerBZIDs[i] == bzid && bz_getPlayerTeam(i) != eObservers)
+            return true;
+    }
+
+    return false;
+}
+
+bool mofocup::isValidPlayerID(int playerID)
+{
+    bz_APIIntList *playerList = bz_newIntList();
+    bz_getPlayerIndexList(playerList);
+
+    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    {
+        if (playerList->get(i) == playerID)
+        {
+            bz_deleteIntList(playerList);
+            return true;
+        }
+    }
+
+    bz_deleteIntList(playerList);
+    return false;
+}
+
+void mofocup::loadConfig(std::string filename)
+{
+    /*
+        Read the configuration file, see mofocupConfig::load()
+    */
+
+    std::vector<std::string> ignoredLines;
+
+    if (!config.load(filename, ignoredLines))
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not read the configuration file: %s", filename.c_str());
+
+    for (unsigned int i = 0; i < ignoredLines.size(); i++)
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring %s", ignoredLines[i].c_str());
+}
+
+void mofocup::loadCupRegistry(void)
+{
+    /*
+        Register every cup in the configuration file, or the original
+        four cups and the Rating cup if there aren't any. See
+        mofocupConfig::getCups() for the settings of a cup.
+    */
+
+    cups.clear();
+
+    for (int i = 0; i < bz_eLastEvent; i++)
+        eventSubscribers[i].clear();
+
+    std::vector<cupSettings> settings = config.getCups();
+
+    for (unsigned int i = 0; i < settings.size(); i++)
+        registerCup(settings[i].name, settings[i].alias, settings[i].hookName, settings[i].flushPolicy, settings[i].topN, settings[i].formula);
+}
+
+bool mofocup::loadCurrentCup(void)
+{
+    /*
+        Find the cup being played on this server right now
+    */
+
+    sqlite3_stmt *getCurrentCupStmt = getStatement(eGetCurrentCup);
+
+    currentCupID = -1;
+    currentCupEndTime = 0;
+
+    if (getCurrentCupStmt == NULL)
+        return false;
+
+    sqlite3_bind_text(getCurrentCupStmt, 1, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(getCurrentCupStmt, 2, time(NULL));
+
+    if (stepStatement(eGetCurrentCup, getCurrentCupStmt) == SQLITE_ROW)
+    {
+        currentCupID = sqlite3_column_int(getCurrentCupStmt, 0);
+        currentCupEndTime = sqlite3_column_double(getCurrentCupStmt, 1);
+
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Cup #%i is being played on this server.", currentCupID);
+    }
+
+    sqlite3_reset(getCurrentCupStmt);
+    return (currentCupID > 0);
+}
+
+void mofocup::loadPlayerTotals(int playerID, uint64_t bzid)
+{
+    /*
+        Keep a player's points, playing time and skill ratings in memory
+        while they play, so a kill never has to wait on the database to
+        update a rating and their live score can be worked out without
+        asking the database
+    */
+
+    sqlite3_stmt *getPointsStmt = getStatement(eGetPoints);
+    sqlite3_stmt *getPlayingTimeStmt = getStatement(eGetPlayingTime);
+
+    if (getPointsStmt == NULL || getPlayingTimeStmt == NULL)
+        return;
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        cups[i].recordedPoints[playerID] = 0;
+
+        if (cups[i].rated)
+            cups[i].ratings[playerID] = STARTING_RATING;
+
+        sqlite3_bind_text(getPointsStmt, 1, cups[i].name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(getPointsStmt, 2, bzid);
+        sqlite3_bind_int(getPointsStmt, 3, currentCupID);
+
+        if (stepStatement(eGetPoints, getPointsStmt) == SQLITE_ROW)
+        {
+            cups[i].recordedPoints[playerID] = sqlite3_column_int(getPointsStmt, 0);
+
+            if (cups[i].rated) //a rating is stored as the points
+                cups[i].ratings[playerID] = sqlite3_column_double(getPointsStmt, 0);
+        }
+
+        sqlite3_reset(getPointsStmt);
+    }
+
+    ratedPlayers.set(playerID);
+    recordedPlayingTime[playerID] = 0;
+
+    sqlite3_bind_int64(getPlayingTimeStmt, 1, bzid);
+    sqlite3_bind_int(getPlayingTimeStmt, 2, currentCupID);
+
+    if (stepStatement(eGetPlayingTime, getPlayingTimeStmt) == SQLITE_ROW)
+        recordedPlayingTime[playerID] = sqlite3_column_int(getPlayingTimeStmt, 0);
+
+    sqlite3_reset(getPlayingTimeStmt);
+}
+
+void mofocup::loadSnapshot(void)
+{
+    /*
+        Pick up the snapshot read by readSnapshot(). If it was saved
+        recently during the cup that is still being played, everyone who
+        is still in the same slot carries on as if the plugin had never
+        been unloaded. Whatever can't be picked up, because the snapshot
+        is too old, the player has left or the cup has ended, is written
+        to the cup it was saved during so nothing is lost.
+    */
+
+    if (savedSnapshot == NULL)
+        return;
+
+    snapshotContents *snapshot = savedSnapshot;
+    savedSnapshot = NULL;
+
+    snapshotHeader &header = snapshot->header;
+    std::vector<snapshotPlayer> &savedPlayers = snapshot->players;
+    std::vector<snapshotCup> &savedCups = snapshot->cups;
+    std::vector<std::vector<snapshotStanding> > &savedStandings = snapshot->standings;
+    std::vector<snapshotSession> &savedSessions = snapshot->sessions;
+    std::vector<killPairEntry> &savedKills = snapshot->kills;
+
+    if (header.cupID != currentCupID) //there's nowhere to write it, keep it so it isn't overwritten by the next snapshot
+    {
+        std::string keptFile = snapshotfilename + ".unapplied";
+        rename(snapshotfilename.c_str(), keptFile.c_str());
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: The snapshot saved during cup #%i could not be picked up, it has been kept as %s.", header.cupID, keptFile.c_str());
+
+        delete snapshot;
+        return;
+    }
+
+    double now = bz_getCurrentTime();
+    double unloadedTime = std::max(0.0, difftime(time(NULL), (time_t)header.savedAt)); //how long the plugin wasn't loaded
+    bool cupRunning = (time(NULL) < currentCupEndTime);
+    bool fresh = (unloadedTime <= snapshotAge && cupRunning); //nobody carries on in a cup that has ended
+    bool samePlayer[256]; //the player in the slot is the one who was in it when the snapshot was saved
+    std::vector<uint64_t> changedPlayers; //the players whose ratio needs to be updated
+
+    for (int playerID = 0; playerID < 256; playerID++)
+    {
+        savedPlayers[playerID].callsign[sizeof(savedPlayers[playerID].callsign) - 1] = 0;
+        samePlayer[playerID] = (fresh && savedPlayers[playerID].bzid != 0 && savedPlayers[playerID].bzid == playerBZIDs[playerID] &&
+                                playerCallsigns[playerID] == savedPlayers[playerID].callsign);
+
+        if (samePlayer[playerID])
+        {
+            numberOfKills[playerID] = savedPlayers[playerID].bounty;
+
+            if (savedPlayers[playerID].dirty)
+                dirtyPlayers.set(playerID);
+        }
+        else if (savedPlayers[playerID].bzid != 0 && savedPlayers[playerID].dirty)
+            changedPlayers.push_back(savedPlayers[playerID].bzid);
+    }
+
+    doQuery("SAVEPOINT loadSnapshot"); //write whatever can't be picked up in one go
+
+    for (int i = 0; i < header.cupCount; i++)
+    {
+        savedCups[i].name[sizeof(savedCups[i].name) - 1] = 0;
+        cupDescriptor *cup = NULL;
+
+        for (unsigned int j = 0; j < cups.size() && cup == NULL; j++)
+        {
+            if (cups[j].name == savedCups[i].name)
+                cup = &cups[j];
+        }
+
+        if (cup == NULL) //the cup has been removed from the configuration
+            continue;
+
+        for (int playerID = 0; playerID < 256; playerID++)
+        {
+            uint64_t bzid = savedPlayers[playerID].bzid;
+
+            if (bzid == 0)
+                continue;
+
+            if (samePlayer[playerID])
+            {
+                cup->pendingPoints[playerID] += savedCups[i].pendingPoints[playerID];
+                cup->standingPlaces[playerID] = savedCups[i].standingPlaces[playerID];
+                cup->standingScores[playerID] = savedCups[i].standingScores[playerID];
+
+                if (cup->rated && savedPlayers[playerID].rated)
+                    cup->ratings[playerID] = savedCups[i].ratings[playerID];
+
+                continue;
+            }
+
+            if (savedCups[i].pendingPoints[playerID] != 0)
+                incrementPoints(bzid, cup->name, convertToString(savedCups[i].pendingPoints[playerID]));
+
+            if (cup->rated && savedPlayers[playerID].rated && savedPlayers[playerID].dirty)
+                saveRating(*cup, bzid, savedCups[i].ratings[playerID]);
+        }
+
+        for (unsigned int j = 0; cupRunning && j < savedStandings[i].size() && j < cup->topPlayers.size(); j++) //so nobody is congratulated again for a place they already had
+        {
+            savedStandings[i][j].callsign[sizeof(savedStandings[i][j].callsign) - 1] = 0;
+
+            cup->topPlayers[j].bzid = savedStandings[i][j].bzid;
+            cup->topPlayers[j].callsign = savedStandings[i][j].callsign;
+            cup->topPlayers[j].score = convertToString((int)savedStandings[i][j].score);
+        }
+    }
+
+    for (unsigned int i = 0; i < savedSessions.size(); i++)
+    {
+        savedSessions[i].callsign[sizeof(savedSessions[i].callsign) - 1] = 0;
+        bool resumed = false;
+
+        for (unsigned int j = 0; j < playingTime.size() && fresh && !resumed; j++) //the player's session was started again by startCup()
+        {
+            if (playingTime[j].bzid == savedSessions[i].bzid)
+            {
+                playingTime[j].joinTime -= savedSessions[i].unrecordedTime + unloadedTime;
+                resumed = true;
+            }
+        }
+
+        if (!resumed)
+        {
+            recordPlayingTime(savedSessions[i].bzid, savedSessions[i].callsign, savedSessions[i].unrecordedTime);
+
+            if (std::find(changedPlayers.begin(), changedPlayers.end(), savedSessions[i].bzid) == changedPlayers.end())
+                changedPlayers.push_back(savedSessions[i].bzid);
+        }
+    }
+
+    for (unsigned int i = 0; i < changedPlayers.size(); i++)
+        updatePlayerRatio(changedPlayers[i]);
+
+    doQuery("RELEASE loadSnapshot");
+
+    if (fresh)
+    {
+        lastDatabaseUpdate = now - header.lastDatabaseUpdate - unloadedTime;
+        timeDropped = now - header.flagDropped - unloadedTime;
+        flagID = header.flagID;
+        lastPlayerDied = (header.lastPlayerDied >= 0 && header.lastPlayerDied < 256 && samePlayer[header.lastPlayerDied]) ? header.lastPlayerDied : -1;
+
+        for (unsigned int i = 0; i < savedKills.size(); i++) //the recent kills between players who are both still here
+        {
+            killPairEntry kill = savedKills[i];
+
+            if (!samePlayer[kill.killerID] || !samePlayer[kill.victimID] ||
+                kill.killerGeneration != savedPlayers[kill.killerID].generation || kill.victimGeneration != savedPlayers[kill.victimID].generation)
+                continue;
+
+            kill.killerGeneration = slotGenerations[kill.killerID];
+            kill.victimGeneration = slotGenerations[kill.victimID];
+            kill.time = now - kill.time - unloadedTime;
+
+            if (kill.time + farmingWindow <= now)
+                continue;
+
+            recentKills[(recentKillsStart + recentKillsCount) % KILL_PAIR_HISTORY] = kill;
+            recentKillsCount++;
+            killPairCounts[kill.killerID][kill.victimID]++;
+        }
+    }
+
+    remove(snapshotfilename.c_str()); //never pick up the same snapshot twice
+    delete snapshot;
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Picked up the snapshot saved %i seconds ago%s.", (int)unloadedTime, fresh ? "" : ", it couldn't be carried on from so it was written to the database");
+}
+
+void mofocup::logEvent(bz_EventData *eventData, uint64_t bzid, const int *variables, const int *points, bool farmed)
+{
+    /*
+        Queue a kill or a capture for the event log, the event writer
+        takes care of the database so this never waits on the disk
+    */
+
+    eventRecord event;
+
+    event.eventType = eventData->eventType;
+    event.cupID = currentCupID;
+    event.timestamp = time(NULL);
+    event.bzid = bzid;
+    event.victimBZID = 0;
+    event.farmed = farmed;
+
+    if (eventData->eventType == bz_ePlayerDieEvent)
+    {
+        bz_PlayerDieEventData_V1* diedata = (bz_PlayerDieEventData_V1*)eventData;
+        event.victimBZID = playerBZIDs[diedata->playerID];
+        event.flag = diedata->flagKilledWith.c_str();
+        event.team = diedata->killerTeam;
+        event.victimTeam = diedata->team;
+    }
+    else
+    {
+        bz_CTFCaptureEventData_V1* ctfdata = (bz_CTFCaptureEventData_V1*)eventData;
+
+        switch (ctfdata->teamCapped) //the team flag that was captured
+        {
+            case eRedTeam: event.flag = "R*"; break;
+            case eGreenTeam: event.flag = "G*"; break;
+            case eBlueTeam: event.flag = "B*"; break;
+            case ePurpleTeam: event.flag = "P*"; break;
+            default: break;
+        }
+
+        event.team = ctfdata->teamCapping;
+        event.victimTeam = ctfdata->teamCapped;
+    }
+
+    std::copy(variables, variables + eFormulaVariableCount, event.variables);
+    std::copy(points, points + MAX_CUPS, event.points);
+
+    bool batchReady;
+
+    {
+        std::lock_guard<std::mutex> lock(eventQueueMutex);
+
+        if (eventQueue.size() >= EVENT_QUEUE_LIMIT) //the event writer has fallen behind, don't let the queue grow forever
+            droppedEvents++;
+        else
+            eventQueue.push_back(event);
+
+        batchReady = (eventQueue.size() >= EVENT_BATCH_SIZE);
+    }
+
+    if (batchReady)
+        eventQueueReady.notify_one();
+}
+
+void mofocup::logStatementProfiles(void)
+{
+    /*
+        Show where the database time went, the statements that took the
+        longest in total first
+    */
+
+    if (!profileStatements)
+        return;
+
+    std::vector<std::pair<double, int> > byTime;
+
+    for (int i = 0; i < eStatementCount; i++)
+    {
+        if (statementProfiles[i].runs > 0)
+            byTime.push_back(std::make_pair(statementProfiles[i].seconds, i));
+    }
+
+    std::sort(byTime.rbegin(), byTime.rend());
+
+    for (unsigned int i = 0; i < byTime.size() && i < 10; i++)
+    {
+        statementProfile &profile = statementProfiles[byTime[i].second];
+
+        bz_debugMessagef(1, "DEBUG :: MoFo Cup :: Profile :: %.3f s, %llu runs, %llu rows scanned, %llu sorts :: %s%s", profile.seconds, (unsigned long long)profile.runs,
+                         (unsigned long long)profile.rowsScanned, (unsigned long long)profile.sorts, statementQueries[byTime[i].second].sql,
+                         statementQueries[byTime[i].second].readOnly ? " (read-only connection)" : "");
+    }
+}
+
+void mofocup::observeLatency(latencyHistogram &histogram, double seconds)
+{
+    /*
+        Count how long something took in the bucket it falls in, anything
+        slower than the last bucket is only counted in the total
+    */
+
+    for (int i = 0; i < METRIC_BUCKET_COUNT; i++)
+    {
+        if (seconds <= metricBuckets[i])
+        {
+            histogram.buckets[i]++;
+            break;
+        }
+    }
+
+    histogram.count++;
+    histogram.sum += seconds;
+}
+
+void mofocup::openLiveStats(void)
+{
+    /*
+        Create the shared memory segment the live stats are published to,
+        if one has been configured
+    */
+
+    liveStats = NULL;
+    lastLiveStatsUpdate = 0;
+
+    if (liveStatsName.empty() && statsSocketName.empty())
+        return;
+
+    if (liveStatsName.empty()) //only the stats server reads the stats, so they don't need to be shared with anyone else
+    {
+        liveStats = new mofocupLiveStats();
+        liveStats->magic = MOFOCUP_LIVE_MAGIC;
+        liveStats->version = MOFOCUP_LIVE_VERSION;
+        return;
+    }
+
+    int segmentFile = shm_open(liveStatsName.c_str(), O_CREAT | O_RDWR, 0644);
+
+    if (segmentFile < 0)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not create the live stats segment %s :: %s", liveStatsName.c_str(), strerror(errno));
+        return;
+    }
+
+    void *segment = MAP_FAILED;
+
+    if (ftruncate(segmentFile, sizeof(mofocupLiveStats)) == 0)
+        segment = mmap(NULL, sizeof(mofocupLiveStats), PROT_READ | PROT_WRITE, MAP_SHARED, segmentFile, 0);
+
+    if (segment == MAP_FAILED)
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not map the live stats segment %s :: %s", liveStatsName.c_str(), strerror(errno));
+
+    close(segmentFile);
+
+    if (segment == MAP_FAILED)
+        return;
+
+    liveStats = (mofocupLiveStats*)segment;
+
+    //a segment left behind by a previous run may still have readers, so it's marked as being written while it's reset
+    uint32_t sequence = liveStats->sequence | 1;
+    __atomic_store_n(&liveStats->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    liveStats->magic = MOFOCUP_LIVE_MAGIC;
+    liveStats->version = MOFOCUP_LIVE_VERSION;
+    liveStats->cupCount = 0;
+    liveStats->cupID = 0;
+    liveStats->updated = 0;
+    memset(liveStats->cups, 0, sizeof(liveStats->cups));
+    memset(liveStats->players, 0, sizeof(liveStats->players));
+
+    __atomic_store_n(&liveStats->sequence, sequence + 1, __ATOMIC_RELEASE);
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Publishing live stats to the shared memory segment %s", liveStatsName.c_str());
+}
+
+bool mofocup::openNextCup(double previousEndTime)
+{
+    /*
+        Start a new cup on this server. The new cup picks up where the
+        previous one ended, or at the start of this month if the server
+        hasn't had a cup in a while, and ends at the start of next month.
+    */
+
+    sqlite3_stmt *openNextCupStmt = getStatement(eOpenNextCup);
+
+    if (openNextCupStmt == NULL)
+        return false;
+
+    sqlite3_bind_text(openNextCupStmt, 1, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_double(openNextCupStmt, 2, previousEndTime);
+
+    bool success = (stepStatement(eOpenNextCup, openNextCupStmt) == SQLITE_DONE);
+    sqlite3_reset(openNextCupStmt);
+
+    if (!success)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not start a new cup :: %s", sqlite3_errmsg(db));
+        return false;
+    }
+
+    bz_debugMessage(2, "DEBUG :: MoFo Cup :: A new cup has been started on this server.");
+    return loadCurrentCup();
+}
+
+uint64_t mofocup::parseBZID(std::string bzid)
+{
+    /*
+        Turn the BZID given by BZFS into a number, 0 if the player
+        isn't registered
+    */
+
+    if (bzid.empty() || !isDigit(bzid))
+        return 0;
+
+    return strtoull(bzid.c_str(), NULL, 10);
+}
+
+int mofocup::playersKilledByGenocide(bz_eTeamType killerTeam)
+{
+    /*
+        Get the amount of players that have been ideally killed
+        by a genocide hit because not all players on a team will
+        be spawned at the time of the hit
+    */
+
+    int playerCount = 0; //the value we'll return
+    bz_APIIntList *playerList = bz_newIntList();
+    bz_getPlayerIndexList(playerList);
+
+    for (unsigned int i = 0; i < playerList->size(); i++) //go through all the players
+    {
+        bz_BasePlayerRecord *player = bz_getPlayerByIndex(playerList->get(i));
+
+        //check a player is part of the team affected, not an observer, and is spawned
+        if (player != NULL &&
+            player->team != killerTeam &&
+            player->team != eObservers &&
+            player->spawned)
+            playerCount++;
+
+        bz_freePlayerRecord(player);
+    }
+
+    bz_deleteIntList(playerList);
+    return playerCount;
+}
+
+void mofocup::publishLiveStats(void)
+{
+    /*
+        Copy every player's live counters and the top of every cup into
+        the shared memory segment. The sequence is odd while we write so
+        scoreboards know to read the segment again.
+    */
+
+    uint32_t sequence = liveStats->sequence;
+    __atomic_store_n(&liveStats->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    liveStats->cupCount = cups.size();
+    liveStats->cupID = currentCupID;
+    liveStats->updated = time(NULL);
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        mofocupLiveCup &liveCup = liveStats->cups[i];
+
+        snprintf(liveCup.name, sizeof(liveCup.name), "%s", cups[i].name.c_str());
+        snprintf(liveCup.alias, sizeof(liveCup.alias), "%s", cups[i].alias.c_str());
+        liveCup.rated = cups[i].rated;
+        liveCup.topCount = 0;
+
+        for (int j = 0; j < (int)cups[i].topPlayers.size() && j < MOFOCUP_LIVE_MAX_TOP && cups[i].topPlayers[j].bzid != 0; j++, liveCup.topCount++) //stop at the first place nobody holds yet
+        {
+            liveCup.top[j].bzid = cups[i].topPlayers[j].bzid;
+            liveCup.top[j].score = atoi(cups[i].topPlayers[j].score.c_str());
+            snprintf(liveCup.top[j].callsign, sizeof(liveCup.top[j].callsign), "%s", cups[i].topPlayers[j].callsign.c_str());
+        }
+    }
+
+    for (int playerID = 0; playerID < MOFOCUP_LIVE_MAX_PLAYERS; playerID++)
+    {
+        mofocupLivePlayer &livePlayer = liveStats->players[playerID];
+
+        livePlayer.bzid = playerBZIDs[playerID];
+        livePlayer.team = (playerCallsigns[playerID].empty() ? eNoTeam : bz_getPlayerTeam(playerID));
+        livePlayer.bounty = numberOfKills[playerID];
+        snprintf(livePlayer.callsign, sizeof(livePlayer.callsign), "%s", playerCallsigns[playerID].c_str());
+
+        for (unsigned int i = 0; i < MOFOCUP_LIVE_MAX_CUPS; i++)
+        {
+            bool hasCup = (i < cups.size());
+
+            livePlayer.pendingPoints[i] = (hasCup ? cups[i].pendingPoints[playerID] : 0);
+            livePlayer.ratings[i] = ((hasCup && cups[i].rated && ratedPlayers.test(playerID)) ? (int)floor(cups[i].ratings[playerID] + 0.5) : 0);
+            livePlayer.places[i] = (hasCup ? cups[i].standingPlaces[playerID] : 0);
+            livePlayer.scores[i] = (hasCup && livePlayer.places[i] > 0 ? cups[i].standingScores[playerID] : 0);
+        }
+    }
+
+    __atomic_store_n(&liveStats->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void mofocup::readSnapshot(void)
+{
+    /*
+        Read the snapshot saved when the plugin was last unloaded, before
+        anything in the database changes. It's picked up by loadSnapshot()
+        once the cup has been started, unless the cup it was saved during
+        has ended in the meantime. Then it's written to that cup straight
+        away, so the points are in the standings when the cup is archived.
+        A snapshot that can't be read is kept under another name.
+    */
+
+    FILE *snapshotFile = fopen(snapshotfilename.c_str(), "rb");
+
+    if (snapshotFile == NULL)
+        return;
+
+    snapshotContents *snapshot = new snapshotContents();
+    snapshotHeader &header = snapshot->header;
+    snapshot->players.resize(256);
+
+    bool success = (fread(&header, sizeof(header), 1, snapshotFile) == 1 && header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION &&
+                    header.cupCount >= 0 && header.cupCount <= MAX_CUPS && header.killCount <= KILL_PAIR_HISTORY && header.sessionCount <= 256 &&
+                    fread(&snapshot->players[0], sizeof(snapshotPlayer), 256, snapshotFile) == 256);
+
+    if (success)
+    {
+        snapshot->cups.resize(header.cupCount);
+        snapshot->standings.resize(header.cupCount);
+
+        for (int i = 0; i < header.cupCount && success; i++)
+        {
+            success = (fread(&snapshot->cups[i], sizeof(snapshotCup), 1, snapshotFile) == 1 && snapshot->cups[i].topCount <= 1024);
+
+            if (success && snapshot->cups[i].topCount > 0)
+            {
+                snapshot->standings[i].resize(snapshot->cups[i].topCount);
+                success = (fread(&snapshot->standings[i][0], sizeof(snapshotStanding), snapshot->cups[i].topCount, snapshotFile) == snapshot->cups[i].topCount);
+            }
+        }
+
+        snapshot->sessions.resize(header.sessionCount);
+        snapshot->kills.resize(header.killCount);
+
+        success = success && (header.sessionCount == 0 || fread(&snapshot->sessions[0], sizeof(snapshotSession), header.sessionCount, snapshotFile) == header.sessionCount) &&
+                  (header.killCount == 0 || fread(&snapshot->kills[0], sizeof(killPairEntry), header.killCount, snapshotFile) == header.killCount);
+    }
+
+    fclose(snapshotFile);
+
+    if (!success) //keep it for someone to look at, and so it isn't overwritten by the next snapshot
+    {
+        std::string keptFile = snapshotfilename + ".unreadable";
+        rename(snapshotfilename.c_str(), keptFile.c_str());
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: The snapshot %s could not be read, it has been kept as %s.", snapshotfilename.c_str(), keptFile.c_str());
+
+        delete snapshot;
+        return;
+    }
+
+    savedSnapshot = snapshot;
+
+    if (loadCurrentCup() && currentCupID == header.cupID) //picked up once the cup has been started
+        return;
+
+    std::vector<int> finishedCups = cupDatabase.getFinishedCups(bz_getPublicAddr().c_str());
+
+    if (std::find(finishedCups.begin(), finishedCups.end(), header.cupID) == finishedCups.end()) //it has been archived already, loadSnapshot() keeps it
+        return;
+
+    //the cup ended while the plugin wasn't running, so nobody carries on from the snapshot and everything in it is written to that cup
+    currentCupID = header.cupID;
+    currentCupEndTime = 0;
+    loadSnapshot();
+
+    currentCupID = -1; //startCup() finds the cup being played now
+}
+
+void mofocup::recordPlayingTime(uint64_t bzid, std::string callsign, int timePlayed)
+{
+    /*
+        Add seconds played to a player's total playing time
+    */
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) has played for %i seconds. Updating the database...", callsign.c_str(), (unsigned long long)bzid, timePlayed);
+
+    sqlite3_stmt *addCurrentPlayingTimeStmt = getStatement(eAddCurrentPlayingTime);
+
+    if (addCurrentPlayingTimeStmt == NULL)
+        return;
+
+    //build the query
+    sqlite3_bind_text(addCurrentPlayingTimeStmt, 1, convertToString(timePlayed).c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(addCurrentPlayingTimeStmt, 2, bzid);
+    sqlite3_bind_int(addCurrentPlayingTimeStmt, 3, currentCupID);
+
+    //prepare to execute and execute the query
+    stepStatement(eAddCurrentPlayingTime, addCurrentPlayingTimeStmt);
+    sqlite3_reset(addCurrentPlayingTimeStmt);
+
+    for (int playerID = 0; playerID < 256; playerID++) //keep the live score in step
+    {
+        if (playerBZIDs[playerID] == bzid)
+            recordedPlayingTime[playerID] += timePlayed;
+    }
+}
+
+void mofocup::recordStatementProfile(preparedStatement index, sqlite3_stmt *statement, bool started, double seconds)
+{
+    /*
+        Add a step of one of the statements in statementQueries to its
+        profile, counting a run for every step that started it again
+    */
+
+    statementProfile &profile = statementProfiles[index];
+
+    if (!started)
+        profile.runs++;
+
+    profile.seconds += seconds;
+    profile.rowsScanned += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    profile.sorts += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_SORT, 1);
+}
+
+bool mofocup::registerCup(std::string name, std::string alias, std::string hookName, std::string flushPolicy, int topN, std::string formula)
+{
+    /*
+        Add a cup to the registry and subscribe it to the event its
+        scoring hook needs
+    */
+
+    if (cups.size() >= MAX_CUPS)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, only %i cups can be registered.", name.c_str(), MAX_CUPS);
+        return false;
+    }
+
+    if (findCupByAlias(alias) != NULL)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, the alias '%s' is already being used.", name.c_str(), alias.c_str());
+        return false;
+    }
+
+    if (flushPolicy != "deferred" && flushPolicy != "immediate")
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, unknown flush policy '%s'.", name.c_str(), flushPolicy.c_str());
+        return false;
+    }
+
+    if (topN < 1)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, it needs to show at least one player.", name.c_str());
+        return false;
+    }
+
+    for (unsigned int i = 0; i < sizeof(scoringHooks)/sizeof(scoringHookEntry); i++)
+    {
+        if (hookName != scoringHooks[i].name)
+            continue;
+
+        cupDescriptor newCup;
+        std::string formulaError;
+
+        if (!newCup.formula.compile(formula.empty() ? getDefaultFormula(hookName) : formula, formulaError))
+        {
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, its formula could not be compiled: %s", name.c_str(), formulaError.c_str());
+            return false;
+        }
+
+        newCup.name = name;
+        newCup.alias = alias;
+        newCup.hookName = hookName;
+        newCup.hook = scoringHooks[i].hook;
+        newCup.flushPolicy = (flushPolicy == "immediate") ? eImmediateFlush : eDeferredFlush;
+        newCup.topN = topN;
+        newCup.topPlayers.assign(topN, cupStanding());
+        newCup.rated = (newCup.hook == &mofocup::scoreRating);
+        memset(newCup.pendingPoints, 0, sizeof(newCup.pendingPoints));
+        memset(newCup.standingPlaces, 0, sizeof(newCup.standingPlaces));
+        memset(newCup.recordedPoints, 0, sizeof(newCup.recordedPoints));
+        memset(newCup.standingScores, 0, sizeof(newCup.standingScores));
+        newCup.pointsAwarded = 0;
+        std::fill(newCup.ratings, newCup.ratings + 256, (double)STARTING_RATING);
+
+        cups.push_back(newCup);
+        eventSubscribers[scoringHooks[i].eventType].push_back(cups.size() - 1);
+
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Registered the %s Cup (/cup %s) using the '%s' scoring hook: %s", name.c_str(), alias.c_str(), hookName.c_str(), newCup.formula.source.c_str());
+        return true;
+    }
+
+    bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Ignoring the %s Cup, unknown scoring hook '%s'.", name.c_str(), hookName.c_str());
+    return false;
+}
+
+void mofocup::reportEventWriterErrors(void)
+{
+    /*
+        The event writer can't use the BZFS API from its own thread, so the
+        game thread reports its problems for it
+    */
+
+    std::lock_guard<std::mutex> lock(eventQueueMutex);
+
+    if (droppedEvents > 0)
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: The event log fell behind, %u events were not recorded.", droppedEvents);
+
+    if (!eventWriterError.empty())
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not write to the event log %s :: %s", eventsfilename.c_str(), eventWriterError.c_str());
+
+    droppedEvents = 0;
+    eventWriterError.clear();
+}
+
+void mofocup::reportStatsServerErrors(void)
+{
+    /*
+        The stats server can't use the BZFS API from its own thread either,
+        so the game thread reports why it stopped
+    */
+
+    std::lock_guard<std::mutex> lock(statsServerMutex);
+
+    if (!statsServerError.empty())
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: The stats server stopped :: %s", statsServerError.c_str());
+
+    statsServerError.clear();
+}
+
+void mofocup::rolloverCup(void)
+{
+    /*
+        MoFo Cup :: Rollover
+        --------------------
+
+        The current cup has ended. In one transaction, everyone's points
+        and playing time are written to the finished cup, the next cup is
+        started, the finished cup's final standings are archived and
+        everyone playing is entered into the next cup. The finished cup
+        is only archived once there's a next cup to play, and if either
+        step fails both are rolled back so the finished cup keeps being
+        played until the next try.
+    */
+
+    int finishedCupID = currentCupID;
+    double finishedCupEndTime = currentCupEndTime;
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Cup #%i has ended, starting the next cup...", finishedCupID);
+
+    doQuery("BEGIN TRANSACTION");
+
+    flushAllPlayers(); //kept even if the rollover fails, the points have left memory
+    doQuery("SAVEPOINT rolloverCup");
+
+    bool nextCupStarted = (loadCurrentCup() || openNextCup(finishedCupEndTime)); //use the next cup if one has already been set up
+
+    if (!nextCupStarted || !archiveCup(finishedCupID))
+    {
+        doQuery("ROLLBACK TO rolloverCup");
+        doQuery("RELEASE rolloverCup");
+        doQuery("COMMIT TRANSACTION");
+
+        //try again in 5 minutes
+        if (nextCupStarted)
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Cup #%i has ended but could not be archived, so the next cup was not started.", finishedCupID);
+        else
+            bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Cup #%i has ended but the next cup could not be started.", finishedCupID);
+        currentCupID = finishedCupID;
+        currentCupEndTime = time(NULL) + 300;
+        return;
+    }
+
+    doQuery("RELEASE rolloverCup");
+
+    bz_APIIntList *playerList = bz_newIntList();
+    bz_getPlayerIndexList(playerList);
+    std::vector<int> playingPlayers;
+
+    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    {
+        int playerID = playerList->get(i);
+
+        if (playerBZIDs[playerID] != 0 && bz_getPlayerTeam(playerID) != eObservers) //don't do anything if the player is an observer or is not registered
+            playingPlayers.push_back(playerID);
+    }
+
+    bz_deleteIntList(playerList);
+    enrollPlayers(playingPlayers);
+
+    for (unsigned int i = 0; i < playingPlayers.size(); i++)
+        loadPlayerTotals(playingPlayers[i], playerBZIDs[playingPlayers[i]]);
+
+    doQuery("COMMIT TRANSACTION");
+
+    for (unsigned int i = 0; i < cups.size(); i++) //nobody is in the top of the new cup yet
+    {
+        cups[i].topPlayers.assign(cups[i].topN, cupStanding());
+        memset(cups[i].standingPlaces, 0, sizeof(cups[i].standingPlaces));
+    }
+
+    bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, "This month's MoFo Cup has ended! Everyone playing has been entered into the next MoFo Cup, good luck!");
+}
+
+void mofocup::saveRating(cupDescriptor &cup, uint64_t bzid, double rating)
+{
+    /*
+        Write a player's skill rating as both their points and their ratio
+    */
+
+    sqlite3_stmt *saveRatingStmt = getStatement(eSaveRating);
+    sqlite3_stmt *addRatingStmt = getStatement(eAddRating);
+
+    if (saveRatingStmt == NULL || addRatingStmt == NULL)
+        return;
+
+    int roundedRating = (int)floor(rating + 0.5);
+
+    bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s rating for BZID %llu -> %i", cup.name.c_str(), (unsigned long long)bzid, roundedRating);
+
+    sqlite3_bind_int(saveRatingStmt, 1, roundedRating);
+    sqlite3_bind_text(saveRatingStmt, 2, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(saveRatingStmt, 3, bzid);
+    sqlite3_bind_int(saveRatingStmt, 4, currentCupID);
+
+    stepStatement(eSaveRating, saveRatingStmt);
+    sqlite3_reset(saveRatingStmt);
+
+    if (sqlite3_changes(db) > 0)
+        return;
+
+    //players who were entered into the cup before it was added don't have a row yet
+    sqlite3_bind_int(addRatingStmt, 1, roundedRating);
+    sqlite3_bind_text(addRatingStmt, 2, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(addRatingStmt, 3, bzid);
+    sqlite3_bind_int(addRatingStmt, 4, currentCupID);
+
+    stepStatement(eAddRating, addRatingStmt);
+    sqlite3_reset(addRatingStmt);
+}
+
+bool mofocup::saveSnapshot(void)
+{
+    /*
+        Save everything that hasn't been written to the database, along
+        with the rest of what is kept in memory, so the plugin can be
+        reloaded without losing anything or writing it all out first.
+        The snapshot is written next to the real file and renamed over it
+        so a half written snapshot is never picked up.
+    */
+
+    if (snapshotfilename.empty() || currentCupID <= 0)
+        return false;
+
+    std::string temporaryFile = snapshotfilename + ".tmp";
+    FILE *snapshot = fopen(temporaryFile.c_str(), "wb");
+
+    if (snapshot == NULL)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not save the snapshot %s :: %s", temporaryFile.c_str(), strerror(errno));
+        return false;
+    }
+
+    double now = bz_getCurrentTime();
+    snapshotHeader header;
+    memset(&header, 0, sizeof(header));
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.cupID = currentCupID;
+    header.cupCount = cups.size();
+    header.savedAt = time(NULL);
+    header.lastDatabaseUpdate = now - lastDatabaseUpdate;
+    header.flagDropped = now - timeDropped;
+    header.flagID = flagID;
+    header.lastPlayerDied = lastPlayerDied;
+    header.sessionCount = playingTime.size();
+    header.killCount = recentKillsCount;
+
+    bool success = (fwrite(&header, sizeof(header), 1, snapshot) == 1);
+
+    for (int playerID = 0; playerID < 256 && success; playerID++)
+    {
+        snapshotPlayer savedPlayer;
+        memset(&savedPlayer, 0, sizeof(savedPlayer));
+
+        savedPlayer.bzid = playerBZIDs[playerID];
+        snprintf(savedPlayer.callsign, sizeof(savedPlayer.callsign), "%s", playerCallsigns[playerID].c_str());
+        savedPlayer.bounty = numberOfKills[playerID];
+        savedPlayer.dirty = dirtyPlayers.test(playerID);
+        savedPlayer.rated = ratedPlayers.test(playerID);
+        savedPlayer.generation = slotGenerations[playerID];
+
+        success = (fwrite(&savedPlayer, sizeof(savedPlayer), 1, snapshot) == 1);
+    }
+
+    for (unsigned int i = 0; i < cups.size() && success; i++)
+    {
+        snapshotCup *savedCup = new snapshotCup();
+
+        snprintf(savedCup->name, sizeof(savedCup->name), "%s", cups[i].name.c_str());
+        memcpy(savedCup->pendingPoints, cups[i].pendingPoints, sizeof(savedCup->pendingPoints));
+        memcpy(savedCup->ratings, cups[i].ratings, sizeof(savedCup->ratings));
+        memcpy(savedCup->standingPlaces, cups[i].standingPlaces, sizeof(savedCup->standingPlaces));
+        memcpy(savedCup->standingScores, cups[i].standingScores, sizeof(savedCup->standingScores));
+        savedCup->topCount = cups[i].topPlayers.size();
+
+        success = (fwrite(savedCup, sizeof(snapshotCup), 1, snapshot) == 1);
+        delete savedCup;
+
+        for (unsigned int j = 0; j < cups[i].topPlayers.size() && success; j++)
+        {
+            snapshotStanding savedStanding;
+            memset(&savedStanding, 0, sizeof(savedStanding));
+
+            savedStanding.bzid = cups[i].topPlayers[j].bzid;
+            snprintf(savedStanding.callsign, sizeof(savedStanding.callsign), "%s", cups[i].topPlayers[j].callsign.c_str());
+            savedStanding.score = atoi(cups[i].topPlayers[j].score.c_str());
+
+            success = (fwrite(&savedStanding, sizeof(savedStanding), 1, snapshot) == 1);
+        }
+    }
+
+    for (unsigned int i = 0; i < playingTime.size() && success; i++)
+    {
+        snapshotSession savedSession;
+        memset(&savedSession, 0, sizeof(savedSession));
+
+        savedSession.bzid = playingTime[i].bzid;
+        snprintf(savedSession.callsign, sizeof(savedSession.callsign), "%s", playingTime[i].callsign.c_str());
+        savedSession.unrecordedTime = now - playingTime[i].joinTime;
+
+        success = (fwrite(&savedSession, sizeof(savedSession), 1, snapshot) == 1);
+    }
+
+    for (unsigned int i = 0; i < recentKillsCount && success; i++)
+    {
+        killPairEntry savedKill = recentKills[(recentKillsStart + i) % KILL_PAIR_HISTORY];
+        savedKill.time = now - savedKill.time; //kept as how long ago the kill was made
+
+        success = (fwrite(&savedKill, sizeof(savedKill), 1, snapshot) == 1);
+    }
+
+    success = (fclose(snapshot) == 0 && success && rename(temporaryFile.c_str(), snapshotfilename.c_str()) == 0);
+
+    if (!success)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not save the snapshot %s :: %s", snapshotfilename.c_str(), strerror(errno));
+        remove(temporaryFile.c_str());
+        return false;
+    }
+
+    //everything that would have been written when the plugin is cleaned up is in the snapshot instead
+    playingTime.clear();
+    dirtyPlayers.reset();
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+        memset(cups[i].pendingPoints, 0, sizeof(cups[i].pendingPoints));
+
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Saved a snapshot to %s", snapshotfilename.c_str());
+    return true;
+}
+
+int mofocup::scoreBounty(cupDescriptor &cup, bz_EventData *, const int *variables)
+{
+    /*
+        MoFo Cup :: Bounty Cup
+        ----------------------
+
+        Points are earned by killing a player with a bounty on their
+        turret or by killing a team flag carrier
+    */
+
+    if (variables[eSelfKill]) //no bounty for killing yourself
+        return 0;
+
+    return cup.formula.evaluate(variables);
+}
+
+int mofocup::scoreCapture(cupDescriptor &cup, bz_EventData *, const int *variables)
+{
+    /*
+        MoFo Cup :: Capping Tournament
+        ------------------------------
+
+        Points are earned for capturing a flag, by default with L4m3r's
+        formula
+
+            8 * (numberOfPlayersOnCappedTeam - numberOfPlayersOnCappingTeam) + 3 * (numberOfPlayersOnCappedTeam)
+    */
+
+    return cup.formula.evaluate(variables);
+}
+
+int mofocup::scoreGeno(cupDescriptor &cup, bz_EventData *eventData, const int *variables)
+{
+    /*
+        MoFo Cup :: Geno Cup
+        --------------------
+
+        Points are earned for every player killed with a genocide hit
+    */
+
+    if (isGenocideHit((bz_PlayerDieEventData_V1*)eventData))
+        return cup.formula.evaluate(variables);
+
+    return 0;
+}
+
+int mofocup::scoreKill(cupDescriptor &cup, bz_EventData *, const int *variables)
+{
+    /*
+        MoFo Cup :: Kills Cup
+        ---------------------
+
+        Points are earned for every kill a player makes
+    */
+
+    return cup.formula.evaluate(variables);
+}
+
+int mofocup::scoreRating(cupDescriptor &cup, bz_EventData *eventData, const int *variables)
+{
+    /*
+        MoFo Cup :: Rating Cup
+        ----------------------
+
+        Every kill moves the killer's and the victim's skill ratings
+        using the Elo formula, so beating a better player is worth more
+        than farming a weaker one. The formula is the K-factor, the most
+        a single kill can move a rating by.
+
+        The ratings are only changed in memory and written with the next
+        database update, so no points are returned.
+    */
+
+    bz_PlayerDieEventData_V1* diedata = (bz_PlayerDieEventData_V1*)eventData;
+    int killerID = diedata->killerID, victimID = diedata->playerID;
+
+    if (variables[eSelfKill] || !ratedPlayers.test(killerID) || !ratedPlayers.test(victimID)) //both players need a rating
+        return 0;
+
+    double change = calculateRatingChange(cup.ratings[killerID], cup.ratings[victimID], cup.formula.evaluate(variables));
+
+    cup.ratings[killerID] += change;
+    cup.ratings[victimID] -= change;
+
+    dirtyPlayers.set(killerID);
+    dirtyPlayers.set(victimID);
+
+    return 0;
+}
+
+void mofocup::serveStats(void)
+{
+    /*
+        Runs on its own thread and answers the queries sent to the stats
+        socket, one query per line. The answers come from a copy of the
+        live stats that is only taken again once the game thread has
+        published newer ones, so the game thread is never waited on.
+    */
+
+    struct statsClient
+    {
+        std::string input; //what has been received but isn't a whole line yet
+        std::string output; //answers that haven't been sent yet
+        bool finished; //the client won't send anything else, close it once the answers are sent
+    };
+
+    std::map<int, statsClient> clients;
+    mofocupLiveStats *stats = new mofocupLiveStats();
+    uint32_t statsSequence = 1; //odd, so the first query takes a copy
+    epoll_event events[64];
+    bool stopping = false;
+
+    while (!stopping)
+    {
+        int eventCount = epoll_wait(statsEpoll, events, 64, -1);
+
+        if (eventCount < 0 && errno != EINTR)
+        {
+            std::string error = strerror(errno);
+            std::lock_guard<std::mutex> lock(statsServerMutex);
+            statsServerError = error;
+            break;
+        }
+
+        for (int i = 0; i < eventCount; i++)
+        {
+            int eventSocket = events[i].data.fd;
+
+            if (eventSocket == statsWakeup) //the plugin is being unloaded
+            {
+                stopping = true;
+                continue;
+            }
+
+            if (eventSocket == statsListener) //accept everyone who is waiting
+            {
+                int newClient;
+
+                while ((newClient = accept4(statsListener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    epoll_event clientEvent;
+                    clientEvent.events = EPOLLIN;
+                    clientEvent.data.fd = newClient;
+
+                    if (epoll_ctl(statsEpoll, EPOLL_CTL_ADD, newClient, &clientEvent) != 0)
+                    {
+                        close(newClient);
+                        continue;
+                    }
+
+                    clients[newClient].finished = false;
+                }
+
+                continue;
+            }
+
+            statsClient &client = clients[eventSocket];
+            bool failed = (events[i].events & EPOLLERR) != 0;
+            bool wasWriting = !client.output.empty();
+
+            if ((events[i].events & (EPOLLIN | EPOLLHUP)) && !client.finished)
+            {
+                char buffer[4096];
+                ssize_t received;
+
+                while ((received = read(eventSocket, buffer, sizeof(buffer))) > 0 || (received < 0 && errno == EINTR)) //a signal isn't the end of what they sent
+                {
+                    if (received > 0)
+                        client.input.append(buffer, received);
+                }
+
+                if (received == 0)
+                    client.finished = true;
+                else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    failed = true;
+
+                for (size_t lineEnd = client.input.find("\n"); lineEnd != std::string::npos; lineEnd = client.input.find("\n"))
+                {
+                    std::string query = trimWhitespace(client.input.substr(0, lineEnd));
+                    client.input.erase(0, lineEnd + 1);
+
+                    if (__atomic_load_n(&liveStats->sequence, __ATOMIC_ACQUIRE) != statsSequence) //the game thread has published newer stats
+                    {
+                        mofocupReadLiveStats(liveStats, stats);
+                        statsSequence = stats->sequence;
+                    }
+
+                    client.output += answerStatsQuery(*stats, query);
+                }
+
+                if (client.input.size() > 4096) //nobody sends queries this long
+                    failed = true;
+            }
+
+            if (!client.output.empty() && !failed)
+            {
+                ssize_t sent = send(eventSocket, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+
+                if (sent > 0)
+                    client.output.erase(0, sent);
+                else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    failed = true;
+            }
+
+            if (client.output.size() > STATS_OUTPUT_LIMIT) //they keep asking but never read the answers
+                failed = true;
+
+            if (failed || (client.finished && client.output.empty()))
+            {
+                epoll_ctl(statsEpoll, EPOLL_CTL_DEL, eventSocket, NULL);
+                close(eventSocket);
+                clients.erase(eventSocket);
+            }
+            else if (client.finished || wasWriting != !client.output.empty()) //only wait for the socket to be writable while there's something to send
+            {
+                epoll_event clientEvent;
+                clientEvent.events = 0;
+                clientEvent.data.fd = eventSocket;
+
+                if (!client.finished)
+                    clientEvent.events |= EPOLLIN;
+
+                if (!client.output.empty())
+                    clientEvent.events |= EPOLLOUT;
+
+                epoll_ctl(statsEpoll, EPOLL_CTL_MOD, eventSocket, &clientEvent);
+            }
+        }
+    }
+
+    for (std::map<int, statsClient>::iterator itr = clients.begin(); itr != clients.end(); ++itr)
+        close(itr->first);
+
+    delete stats;
+}
+
+void mofocup::showArchivedCup(int playerID, cupDescriptor *cup, std::string month)
+{
+    /*
+        Show the final standings of a cup that was played on this server
+        during a month written as YYYY-MM
+    */
+
+    sqlite3_stmt *getArchivedCupStmt = getStatement(eGetArchivedCup);
+    sqlite3_stmt *getArchivedStandingsStmt = getStatement(eGetArchivedStandings);
+    sqlite3_stmt *getArchivedPlayerStmt = getStatement(eGetArchivedPlayer);
+
+    if (getArchivedCupStmt == NULL || getArchivedStandingsStmt == NULL || getArchivedPlayerStmt == NULL)
+        return;
+
+    int cupID = -1;
+
+    sqlite3_bind_text(getArchivedCupStmt, 1, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(getArchivedCupStmt, 2, month.c_str(), -1, SQLITE_TRANSIENT);
+
+    if (stepStatement(eGetArchivedCup, getArchivedCupStmt) == SQLITE_ROW)
+        cupID = sqlite3_column_int(getArchivedCupStmt, 0);
+
+    sqlite3_reset(getArchivedCupStmt);
+
+    if (cupID < 0)
+    {
+        bz_sendTextMessagef(BZ_SERVER, playerID, "There is no finished MoFo Cup for %s. Months are written as YYYY-MM.", month.c_str());
+        return;
+    }
+
+    bz_sendTextMessagef(BZ_SERVER, playerID, "Planet MoFo %s Cup (%s)", cup->name.c_str(), month.c_str());
+    bz_sendTextMessage(BZ_SERVER, playerID, "--------------------");
+    bz_sendTextMessage(BZ_SERVER, playerID, "        Callsign                    Points");
+
+    sqlite3_bind_int(getArchivedStandingsStmt, 1, cupID);
+    sqlite3_bind_text(getArchivedStandingsStmt, 2, cup->name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getArchivedStandingsStmt, 3, cup->topN);
+
+    while (stepStatement(eGetArchivedStandings, getArchivedStandingsStmt) == SQLITE_ROW) //the final top players
+    {
+        bz_sendTextMessage(BZ_SERVER, playerID, formatScore((char*)sqlite3_column_text(getArchivedStandingsStmt, 0),
+                                                            (char*)sqlite3_column_text(getArchivedStandingsStmt, 1),
+                                                            (char*)sqlite3_column_text(getArchivedStandingsStmt, 2)).c_str());
+    }
+
+    sqlite3_reset(getArchivedStandingsStmt);
+
+    if (playerBZIDs[playerID] == 0) //check if player is registered to display their stats
+        return;
+
+    sqlite3_bind_int(getArchivedPlayerStmt, 1, cupID);
+    sqlite3_bind_text(getArchivedPlayerStmt, 2, cup->name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(getArchivedPlayerStmt, 3, playerBZIDs[playerID]);
+
+    if (stepStatement(eGetArchivedPlayer, getArchivedPlayerStmt) == SQLITE_ROW)
+    {
+        bz_sendTextMessage(BZ_SERVER, playerID, " "); //nice little space
+        bz_sendTextMessage(BZ_SERVER, playerID, formatScore((char*)sqlite3_column_text(getArchivedPlayerStmt, 0),
+                                                            (char*)sqlite3_column_text(getArchivedPlayerStmt, 1),
+                                                            (char*)sqlite3_column_text(getArchivedPlayerStmt, 2)).c_str());
+    }
+
+    sqlite3_reset(getArchivedPlayerStmt);
+}
+
+void mofocup::showRecentStandings(int playerID, cupDescriptor *cup, std::string period, int days)
+{
+    /*
+        Show who has earned the most points in the current cup over the
+        last few days, counting today, from the daily totals
+    */
+
+    std::string firstDay = "-" + convertToString(days - 1) + " days";
+
+    sqlite3_stmt *getRecentStandingsStmt = getStatement(eGetRecentStandings);
+    sqlite3_stmt *getRecentPlayerStmt = getStatement(eGetRecentPlayer);
+
+    if (getRecentStandingsStmt == NULL || getRecentPlayerStmt == NULL)
+        return;
+
+    bz_sendTextMessagef(BZ_SERVER, playerID, "Planet MoFo %s Cup (%s)", cup->name.c_str(), period.c_str());
+    bz_sendTextMessage(BZ_SERVER, playerID, "--------------------");
+    bz_sendTextMessage(BZ_SERVER, playerID, "        Callsign                    Points");
+
+    sqlite3_bind_int(getRecentStandingsStmt, 1, currentCupID);
+    sqlite3_bind_text(getRecentStandingsStmt, 2, cup->name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(getRecentStandingsStmt, 3, firstDay.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getRecentStandingsStmt, 4, cup->topN);
+
+    for (int place = 1; stepStatement(eGetRecentStandings, getRecentStandingsStmt) == SQLITE_ROW; place++) //the top players of the period
+    {
+        bz_sendTextMessage(BZ_SERVER, playerID, formatScore(convertToString(place),
+                                                            (char*)sqlite3_column_text(getRecentStandingsStmt, 0),
+                                                            (char*)sqlite3_column_text(getRecentStandingsStmt, 1)).c_str());
+    }
+
+    sqlite3_reset(getRecentStandingsStmt);
+
+    if (playerBZIDs[playerID] == 0) //check if player is registered to display their stats
+        return;
+
+    sqlite3_bind_int(getRecentPlayerStmt, 1, currentCupID);
+    sqlite3_bind_text(getRecentPlayerStmt, 2, cup->name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(getRecentPlayerStmt, 3, firstDay.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(getRecentPlayerStmt, 4, playerBZIDs[playerID]);
+
+    if (stepStatement(eGetRecentPlayer, getRecentPlayerStmt) == SQLITE_ROW)
+    {
+        bz_sendTextMessage(BZ_SERVER, playerID, " "); //nice little space
+        bz_sendTextMessage(BZ_SERVER, playerID, formatScore((char*)sqlite3_column_text(getRecentPlayerStmt, 1),
+                                                            playerCallsigns[playerID],
+                                                            (char*)sqlite3_column_text(getRecentPlayerStmt, 0)).c_str());
+    }
+
+    sqlite3_reset(getRecentPlayerStmt);
+}
+
+void mofocup::startCup(void)
+{
+    cupDatabase.use(db); //cleanCup() let go of the connection when the cup was refreshed
+
+    if (!loadCurrentCup() && !openNextCup(0)) //there's no cup running on this server so start this month's cup
+        bz_debugMessage(0, "DEBUG :: MoFo Cup :: There is no cup running on this server and a new one could not be started.");
+
+    bz_APIIntList *playerList = bz_newIntList();
+    bz_getPlayerIndexList(playerList);
+    std::vector<int> playingPlayers; //players who joined before the plugin was loaded
+
+    for (unsigned int i = 0; i < playerList->size(); i++) //Go through all the players
+    {
+        bz_BasePlayerRecord *player = bz_getPlayerByIndex(playerList->get(i));
+
+        if (player == NULL)
+            continue;
+
+        playerBZIDs[playerList->get(i)] = parseBZID(player->bzID.c_str());
+        playerCallsigns[playerList->get(i)] = player->callsign.c_str();
+
+        if (playerBZIDs[playerList->get(i)] != 0 && player->team != eObservers) //don't do anything if the player is an observer or is not registered
+            playingPlayers.push_back(playerList->get(i));
+
+        bz_freePlayerRecord(player);
+    }
+
+    bz_deleteIntList(playerList);
+
+    std::vector<int> newPlayers = enrollPlayers(playingPlayers);
+
+    for (unsigned int i = 0; i < newPlayers.size(); i++) //introduce players into the MoFo Cup
+    {
+        bz_sendTextMessagef(BZ_SERVER, newPlayers[i], "Welcome %s! By playing on Apocalypse, you have been entered to this month's MoFo Cup.", playerCallsigns[newPlayers[i]].c_str());
+        bz_sendTextMessagef(BZ_SERVER, newPlayers[i], "The MoFo Cup is a monthly tournament that consists of the most Bounty, CTF, Geno hits, and kills a player has made.");
+        bz_sendTextMessagef(BZ_SERVER, newPlayers[i], "Type '/help cup' for more information about the MoFo Cup!");
+    }
+
+    for (unsigned int i = 0; i < playingPlayers.size(); i++)
+    {
+        uint64_t bzid = playerBZIDs[playingPlayers[i]];
+        std::string callsign = playerCallsigns[playingPlayers[i]];
+
+        loadPlayerTotals(playingPlayers[i], bzid);
+
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: %s (%llu) has started to play, now recording playing time.", callsign.c_str(), (unsigned long long)bzid);
+        trackNewPlayingTime(bzid, callsign);
+    }
+
+    for (unsigned int i = 0; i < sizeof(hotStatements) / sizeof(hotStatements[0]); i++)
+    {
+        if (getStatement(hotStatements[i]) == NULL)
+        {
+            bz_unloadPlugin(Name());
+            break;
+        }
+    }
+}
+
+void mofocup::startEventWriter(void)
+{
+    /*
+        Start the background thread that writes the event log
+    */
+
+    eventCupNames.clear();
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+        eventCupNames.push_back(cups[i].name);
+
+    eventQueue.reserve(EVENT_BATCH_SIZE);
+    eventWriterStopping = false;
+    droppedEvents = 0;
+
+    eventWriter = std::thread(&mofocup::writeEvents, this);
+}
+
+void mofocup::startStatsServer(void)
+{
+    /*
+        Listen on the stats socket, if one has been configured, and start
+        the background thread that answers whoever connects to it
+    */
+
+    statsListener = statsEpoll = statsWakeup = -1;
+
+    if (statsSocketName.empty() || liveStats == NULL)
+        return;
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (statsSocketName.size() >= sizeof(address.sun_path))
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: The stats socket path is too long: %s", statsSocketName.c_str());
+        return;
+    }
+
+    strcpy(address.sun_path, statsSocketName.c_str());
+
+    struct stat existingFile;
+
+    if (stat(statsSocketName.c_str(), &existingFile) == 0 && S_ISSOCK(existingFile.st_mode)) //a socket left behind by a previous run would stop us from listening
+        unlink(statsSocketName.c_str());
+
+    statsListener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    statsEpoll = epoll_create1(EPOLL_CLOEXEC);
+    statsWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    epoll_event listenerEvent, wakeupEvent;
+    listenerEvent.events = wakeupEvent.events = EPOLLIN;
+    listenerEvent.data.fd = statsListener;
+    wakeupEvent.data.fd = statsWakeup;
+
+    if (statsListener < 0 || statsEpoll < 0 || statsWakeup < 0 ||
+        bind(statsListener, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(statsListener, SOMAXCONN) != 0 ||
+        epoll_ctl(statsEpoll, EPOLL_CTL_ADD, statsListener, &listenerEvent) != 0 ||
+        epoll_ctl(statsEpoll, EPOLL_CTL_ADD, statsWakeup, &wakeupEvent) != 0)
+    {
+        bz_debugMessagef(0, "DEBUG :: MoFo Cup :: Could not serve the stats on %s :: %s", statsSocketName.c_str(), strerror(errno));
+        finishStatsServer();
+        return;
+    }
+
+    statsServer = std::thread(&mofocup::serveStats, this);
+    bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Serving the stats on %s", statsSocketName.c_str());
+}
+
+int mofocup::stepStatement(preparedStatement index, sqlite3_stmt *&statement)
+{
+    /*
+        Step one of the statements in statementQueries, the one index was
+        given by getStatement(). SQLite prepares a statement again by
+        itself when the schema changes, but gives up with SQLITE_SCHEMA if
+        it keeps changing and a statement that was left in a bad state
+        fails with SQLITE_MISUSE. Either way the statement is replaced by
+        a fresh one with the same parameters and run again, as long as it
+        hadn't returned any rows yet.
+    */
+
+    if (statement == NULL)
+        return SQLITE_MISUSE;
+
+    bool started = sqlite3_stmt_busy(statement);
+    std::chrono::steady_clock::time_point stepStart;
+
+    if (profileStatements)
+        stepStart = std::chrono::steady_clock::now();
+
+    int result = sqlite3_step(statement);
+
+    if (!started && (result == SQLITE_SCHEMA || result == SQLITE_MISUSE) && statements[index] == statement)
+    {
+        statements[index] = NULL;
+
+        if (getStatement(index) == NULL) //keep the old one, it's still better than nothing
+        {
+            statements[index] = statement;
+            return result;
+        }
+
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: SQLite :: Prepared '%s' again :: Error #%i", statementQueries[index].sql, result);
+
+        sqlite3_transfer_bindings(statement, statements[index]);
+        sqlite3_finalize(statement);
+        statement = statements[index];
+
+        result = sqlite3_step(statement);
+    }
+
+    if (profileStatements)
+        recordStatementProfile(index, statement, started, std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count());
+
+    return result;
+}
+
+std::string mofocup::toLowerCase(std::string someString)
+{
+    /*
+        Convert a string to lowercase
+    */
+
+    for (unsigned int i = 0; i < someString.size(); i++)
+        someString[i] = tolower(someString[i]);
+
+    return someString;
+}
+
+void mofocup::trackNewPlayingTime(uint64_t bzid, std::string callsign)
+{
+    /*
+        Create a new slot in the structure in order to keep track
+        of a player's playing time
+    */
+
+    playingTimeStructure newPlayingTime;
+
+    newPlayingTime.bzid = bzid;
+    newPlayingTime.callsign = callsign;
+    newPlayingTime.joinTime = bz_getCurrentTime();
+
+    playingTime.push_back(newPlayingTime);
+}
+
+std::string mofocup::trimWhitespace(std::string someString)
+{
+    /*
+        Remove the whitespace surrounding a string
+    */
+
+    size_t start = someString.find_first_not_of(" \t\r\n"), end = someString.find_last_not_of(" \t\r\n");
+
+    if (start == std::string::npos)
+        return "";
+
+    return someString.substr(start, end - start + 1);
+}
+
+void mofocup::updatePlayerRatio(uint64_t bzid)
+{
+    /*
+        Go through all the cups, and update each player's ratio in the table
+        for the appropriate cup
+    */
+
+    sqlite3_stmt *getCurrentPlayerStatsStmt = getStatement(eGetCurrentPlayerStats);
+    sqlite3_stmt *updatePlayerRatioStmt = getStatement(eUpdatePlayerRatio);
+
+    if (getCurrentPlayerStatsStmt == NULL || updatePlayerRatioStmt == NULL)
+        return;
+
+    for (unsigned int i = 0; i < cups.size(); i++) //go through each cup
+    {
+        if (cups[i].rated) //the rating is the ratio, it's written with the player's points
+            continue;
+
+        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: Updating (%s) player stats for player BZID -> %llu", cups[i].name.c_str(), (unsigned long long)bzid);
+
         //initialize variables, and build a query for the respective table/cup to get the values to calculate a new ratio
-        float newRankDecimal;
         int points, playingTime, oldRank, newRank;
 
-        sqlite3_bind_text(getCurrentPlayerStatsStmt, 1, bzid.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(getCurrentPlayerStatsStmt, 2, cups[i].c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(getCurrentPlayerStatsStmt, 3, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(getCurrentPlayerStatsStmt, 1, bzid);
+        sqlite3_bind_text(getCurrentPlayerStatsStmt, 2, cups[i].name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(getCurrentPlayerStatsStmt, 3, currentCupID);
 
-        sqlite3_step(getCurrentPlayerStatsStmt);
+        stepStatement(eGetCurrentPlayerStats, getCurrentPlayerStatsStmt);
 
         if ((char*)sqlite3_column_text(getCurrentPlayerStatsStmt, 0) == NULL ||
             (char*)sqlite3_column_text(getCurrentPlayerStatsStmt, 1) == NULL ||
@@ -1084,7 +4093,7 @@ void mofocup::updatePlayerRatio(std::string bzid)
         playingTime = atoi((char*)sqlite3_column_text(getCurrentPlayerStatsStmt, 1));
         oldRank = atoi((char*)sqlite3_column_text(getCurrentPlayerStatsStmt, 2));
 
-        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s Stats for BZID %s", cups[i].c_str(), bzid.c_str());
+        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s Stats for BZID %llu", cups[i].name.c_str(), (unsigned long long)bzid);
         bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Points        -> %i", points);
         bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Playing Time  -> %i", playingTime);
         bz_debugMessagef(4, "DEBUG :: MoFo Cup ::   Old Ratio     -> %i", oldRank);
@@ -1092,21 +4101,320 @@ void mofocup::updatePlayerRatio(std::string bzid)
         sqlite3_reset(getCurrentPlayerStatsStmt);
 
         //calculate the new ratio
-        newRankDecimal = (float)points/(float)((float)playingTime/86400.0);
-        newRank = int(newRankDecimal);
+        newRank = calculateRatio(points, playingTime);
 
-        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: New ratio for BZID %s -> %i ~= %f", bzid.c_str(), newRank, newRankDecimal);
+        bz_debugMessagef(4, "DEBUG :: MoFo Cup :: New ratio for BZID %llu -> %i", (unsigned long long)bzid, newRank);
 
         sqlite3_bind_text(updatePlayerRatioStmt, 1, convertToString(newRank).c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(updatePlayerRatioStmt, 2, cups[i].c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(updatePlayerRatioStmt, 3, bzid.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(updatePlayerRatioStmt, 4, bz_getPublicAddr().c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(updatePlayerRatioStmt, 2, cups[i].name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(updatePlayerRatioStmt, 3, bzid);
+        sqlite3_bind_int(updatePlayerRatioStmt, 4, currentCupID);
 
-        if (sqlite3_step(updatePlayerRatioStmt) == SQLITE_DONE)
-            bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s ratio updated successfully for BZID %s", cups[i].c_str(), bzid.c_str());
+        if (stepStatement(eUpdatePlayerRatio, updatePlayerRatioStmt) == SQLITE_DONE)
+            bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s ratio updated successfully for BZID %llu", cups[i].name.c_str(), (unsigned long long)bzid);
         else
-            bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s ratio updated failed for BZID %s", cups[i].c_str(), bzid.c_str());
+            bz_debugMessagef(4, "DEBUG :: MoFo Cup :: %s ratio updated failed for BZID %llu", cups[i].name.c_str(), (unsigned long long)bzid);
 
         sqlite3_reset(updatePlayerRatioStmt);
     }
-}
\ No newline at end of file
+}
+
+void mofocup::updateStandingPlaces(cupDescriptor &cup)
+{
+    /*
+        Work out the place of everyone on the server in a cup from a single
+        walk down the cup's ratios, instead of counting the players ahead
+        of each one of them. The walk stops as soon as everyone on the
+        server has been found, so it only goes as far down the cup as the
+        lowest placed player on the server.
+    */
+
+    std::multimap<uint64_t, int> playersLeft; //the slots of the players on the server who haven't been found yet, by BZID
+
+    for (int playerID = 0; playerID < 256; playerID++)
+    {
+        cup.standingPlaces[playerID] = 0; //until they're found in the cup
+        cup.standingScores[playerID] = 0;
+
+        if (playerBZIDs[playerID] != 0)
+            playersLeft.insert(std::make_pair(playerBZIDs[playerID], playerID));
+    }
+
+    sqlite3_stmt *getCupRatiosStmt = getStatement(eGetCupRatios);
+
+    if (getCupRatiosStmt == NULL || playersLeft.empty())
+        return;
+
+    sqlite3_bind_text(getCupRatiosStmt, 1, cup.name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getCupRatiosStmt, 2, currentCupID);
+
+    int rowNumber = 0, place = 0, lastRatio = 0;
+
+    while (!playersLeft.empty() && stepStatement(eGetCupRatios, getCupRatiosStmt) == SQLITE_ROW)
+    {
+        uint64_t bzid = sqlite3_column_int64(getCupRatiosStmt, 0);
+        int ratio = sqlite3_column_int(getCupRatiosStmt, 1);
+
+        rowNumber++;
+
+        if (rowNumber == 1 || ratio != lastRatio) //ties share the place of the first of them, like getPlayerStandingFromBZID()
+        {
+            place = rowNumber;
+            lastRatio = ratio;
+        }
+
+        std::pair<std::multimap<uint64_t, int>::iterator, std::multimap<uint64_t, int>::iterator> found = playersLeft.equal_range(bzid);
+
+        for (std::multimap<uint64_t, int>::iterator it = found.first; it != found.second; ++it)
+        {
+            cup.standingPlaces[it->second] = place;
+            cup.standingScores[it->second] = ratio;
+        }
+
+        playersLeft.erase(found.first, found.second);
+    }
+
+    sqlite3_reset(getCupRatiosStmt);
+}
+
+void mofocup::writeEvents(void)
+{
+    /*
+        Runs on its own thread and writes the queued events to the event
+        log, several hundred at a time in a single transaction
+    */
+
+    sqlite3 *eventsDb = NULL;
+    sqlite3_stmt *insertEventStmt = NULL, *insertEventPointsStmt = NULL;
+    std::string error;
+
+    if (sqlite3_open(eventsfilename.c_str(), &eventsDb) == SQLITE_OK)
+    {
+        sqlite3_busy_timeout(eventsDb, 5000); //an outside reader checkpointing the log shouldn't cost us a batch
+        sqlite3_exec(eventsDb, "PRAGMA journal_mode = WAL;", NULL, 0, NULL);
+        sqlite3_exec(eventsDb, "CREATE TABLE IF NOT EXISTS \"Events\" (\"EventID\" INTEGER PRIMARY KEY, \"CupID\" INTEGER NOT NULL, \"Timestamp\" REAL NOT NULL, \"Type\" TEXT NOT NULL, \"BZID\" INTEGER NOT NULL, \"VictimBZID\" INTEGER, \"Flag\" TEXT NOT NULL, \"Team\" INTEGER NOT NULL, \"VictimTeam\" INTEGER NOT NULL, "
+                               "\"Capped\" INTEGER NOT NULL, \"Capping\" INTEGER NOT NULL, \"Bounty\" INTEGER NOT NULL, \"Carrier\" INTEGER NOT NULL, \"Victims\" INTEGER NOT NULL, \"SelfKill\" INTEGER NOT NULL, \"Farmed\" INTEGER NOT NULL DEFAULT (0));", NULL, 0, NULL);
+        sqlite3_exec(eventsDb, "ALTER TABLE \"Events\" ADD COLUMN \"Farmed\" INTEGER NOT NULL DEFAULT (0);", NULL, 0, NULL); //fails harmlessly once the log has it
+        sqlite3_exec(eventsDb, "CREATE TABLE IF NOT EXISTS \"EventPoints\" (\"EventID\" INTEGER NOT NULL, \"CupType\" TEXT NOT NULL, \"Points\" INTEGER NOT NULL, PRIMARY KEY (\"EventID\", \"CupType\")) WITHOUT ROWID;", NULL, 0, NULL);
+
+        sqlite3_prepare_v2(eventsDb, "INSERT INTO `Events` (`CupID`, `Timestamp`, `Type`, `BZID`, `VictimBZID`, `Flag`, `Team`, `VictimTeam`, `Capped`, `Capping`, `Bounty`, `Carrier`, `Victims`, `SelfKill`, `Farmed`) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", -1, &insertEventStmt, 0);
+        sqlite3_prepare_v2(eventsDb, "INSERT INTO `EventPoints` (`EventID`, `CupType`, `Points`) VALUES (?, ?, ?)", -1, &insertEventPointsStmt, 0);
+    }
+
+    if (insertEventStmt == NULL || insertEventPointsStmt == NULL)
+        error = sqlite3_errmsg(eventsDb);
+
+    std::vector<eventRecord> batch;
+    std::unique_lock<std::mutex> lock(eventQueueMutex);
+
+    eventWriterError = error;
+
+    while (true)
+    {
+        eventQueueReady.wait_for(lock, std::chrono::seconds(EVENT_WRITE_INTERVAL), [this] { return eventWriterStopping || eventQueue.size() >= EVENT_BATCH_SIZE; });
+
+        bool stopping = eventWriterStopping;
+        batch.swap(eventQueue);
+        lock.unlock();
+
+        for (unsigned int start = 0; insertEventPointsStmt != NULL && start < batch.size(); start += EVENT_BATCH_SIZE)
+        {
+            unsigned int end = std::min<unsigned int>(start + EVENT_BATCH_SIZE, batch.size());
+
+            sqlite3_exec(eventsDb, "BEGIN;", NULL, 0, NULL);
+
+            for (unsigned int i = start; i < end; i++)
+            {
+                eventRecord &event = batch[i];
+
+                sqlite3_bind_int(insertEventStmt, 1, event.cupID);
+                sqlite3_bind_double(insertEventStmt, 2, event.timestamp);
+                sqlite3_bind_text(insertEventStmt, 3, (event.eventType == bz_eCaptureEvent) ? "Capture" : "Kill", -1, SQLITE_STATIC);
+                sqlite3_bind_int64(insertEventStmt, 4, event.bzid);
+
+                if (event.victimBZID == 0)
+                    sqlite3_bind_null(insertEventStmt, 5);
+                else
+                    sqlite3_bind_int64(insertEventStmt, 5, event.victimBZID);
+
+                sqlite3_bind_text(insertEventStmt, 6, event.flag.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int(insertEventStmt, 7, event.team);
+                sqlite3_bind_int(insertEventStmt, 8, event.victimTeam);
+
+                for (int j = 0; j < eFormulaVariableCount; j++)
+                    sqlite3_bind_int(insertEventStmt, 9 + j, event.variables[j]);
+
+                sqlite3_bind_int(insertEventStmt, 9 + eFormulaVariableCount, event.farmed ? 1 : 0);
+
+                if (sqlite3_step(insertEventStmt) != SQLITE_DONE)
+                    error = sqlite3_errmsg(eventsDb);
+
+                sqlite3_reset(insertEventStmt);
+
+                sqlite3_int64 eventID = sqlite3_last_insert_rowid(eventsDb);
+
+                for (unsigned int cup = 0; cup < eventCupNames.size(); cup++) //only the cups that awarded points
+                {
+                    if (event.points[cup] <= 0)
+                        continue;
+
+                    sqlite3_bind_int64(insertEventPointsStmt, 1, eventID);
+                    sqlite3_bind_text(insertEventPointsStmt, 2, eventCupNames[cup].c_str(), -1, SQLITE_STATIC);
+                    sqlite3_bind_int(insertEventPointsStmt, 3, event.points[cup]);
+
+                    if (sqlite3_step(insertEventPointsStmt) != SQLITE_DONE)
+                        error = sqlite3_errmsg(eventsDb);
+
+                    sqlite3_reset(insertEventPointsStmt);
+                }
+            }
+
+            if (sqlite3_exec(eventsDb, "COMMIT;", NULL, 0, NULL) != SQLITE_OK)
+            {
+                error = sqlite3_errmsg(eventsDb);
+                sqlite3_exec(eventsDb, "ROLLBACK;", NULL, 0, NULL);
+            }
+        }
+
+        batch.clear();
+        lock.lock();
+
+        if (!error.empty()) //let the game thread report it and try again with the next batch
+        {
+            eventWriterError = error;
+            error.clear();
+        }
+
+        if (stopping && eventQueue.empty())
+            break;
+    }
+
+    lock.unlock();
+
+    sqlite3_finalize(insertEventStmt);
+    sqlite3_finalize(insertEventPointsStmt);
+    sqlite3_close(eventsDb);
+}
+
+void mofocup::writeMetrics(void)
+{
+    /*
+        Write the metrics file in the Prometheus text format. It's written
+        next to the real file and renamed over it so whatever scrapes it
+        never sees half of it.
+    */
+
+    std::ostringstream metrics;
+    int playersOnline = 0;
+    size_t queueDepth;
+
+    for (int playerID = 0; playerID < 256; playerID++)
+    {
+        if (!playerCallsigns[playerID].empty())
+            playersOnline++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(eventQueueMutex);
+        queueDepth = eventQueue.size();
+    }
+
+    metrics << "# HELP mofocup_events_total Events handled by the plugin.\n";
+    metrics << "# TYPE mofocup_events_total counter\n";
+
+    for (unsigned int i = 0; i < sizeof(metricEvents) / sizeof(metricEvents[0]); i++)
+        metrics << "mofocup_events_total{type=\"" << metricEvents[i].name << "\"} " << eventsHandled[metricEvents[i].eventType] << "\n";
+
+    metrics << "# HELP mofocup_farmed_kills_total Kills that earned no points because the same players kept killing each other.\n";
+    metrics << "# TYPE mofocup_farmed_kills_total counter\n";
+    metrics << "mofocup_farmed_kills_total " << farmedKills << "\n";
+
+    metrics << "# HELP mofocup_points_total Points awarded by each cup.\n";
+    metrics << "# TYPE mofocup_points_total counter\n";
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+        metrics << "mofocup_points_total{cup=\"" << cups[i].name << "\"} " << cups[i].pointsAwarded << "\n";
+
+    const char* histogramNames[] = {"mofocup_statement_seconds", "mofocup_flush_seconds"};
+    const char* histogramHelp[] = {"Time taken by each database statement run on the game thread.", "Time taken by each database update."};
+    const latencyHistogram* histograms[] = {&statementLatency, &flushLatency};
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint64_t cumulative = 0;
+
+        metrics << "# HELP " << histogramNames[i] << " " << histogramHelp[i] << "\n";
+        metrics << "# TYPE " << histogramNames[i] << " histogram\n";
+
+        for (int j = 0; j < METRIC_BUCKET_COUNT; j++)
+        {
+            cumulative += histograms[i]->buckets[j];
+            metrics << histogramNames[i] << "_bucket{le=\"" << metricBuckets[j] << "\"} " << cumulative << "\n";
+        }
+
+        metrics << histogramNames[i] << "_bucket{le=\"+Inf\"} " << histograms[i]->count << "\n";
+        metrics << histogramNames[i] << "_sum " << histograms[i]->sum << "\n";
+        metrics << histogramNames[i] << "_count " << histograms[i]->count << "\n";
+    }
+
+    if (profileStatements)
+    {
+        const char* profileNames[] = {"mofocup_statement_runs_total", "mofocup_statement_seconds_total", "mofocup_statement_rows_scanned_total", "mofocup_statement_sorts_total"};
+        const char* profileHelp[] = {"Times each prepared statement was run.", "Time taken by each prepared statement.",
+                                     "Rows each prepared statement stepped through in full table scans.", "Sorts each prepared statement had to do."};
+
+        for (int i = 0; i < 4; i++)
+        {
+            metrics << "# HELP " << profileNames[i] << " " << profileHelp[i] << "\n";
+            metrics << "# TYPE " << profileNames[i] << " counter\n";
+
+            for (int statement = 0; statement < eStatementCount; statement++)
+            {
+                const statementProfile &profile = statementProfiles[statement];
+                std::string sql;
+
+                if (profile.runs == 0)
+                    continue;
+
+                for (const char *c = statementQueries[statement].sql; *c != '\0'; c++) //label values escape backslashes, quotes and new lines
+                {
+                    if (*c == '\\' || *c == '"')
+                        sql += '\\';
+
+                    sql += (*c == '\n') ? ' ' : *c;
+                }
+
+                metrics << profileNames[i] << "{sql=\"" << sql << "\",connection=\"" << (statementQueries[statement].readOnly ? "read" : "write") << "\"} ";
+
+                if (i == 0)
+                    metrics << profile.runs << "\n";
+                else if (i == 1)
+                    metrics << profile.seconds << "\n";
+                else if (i == 2)
+                    metrics << profile.rowsScanned << "\n";
+                else
+                    metrics << profile.sorts << "\n";
+            }
+        }
+    }
+
+    metrics << "# HELP mofocup_event_queue_depth Events waiting to be written to the event log.\n";
+    metrics << "# TYPE mofocup_event_queue_depth gauge\n";
+    metrics << "mofocup_event_queue_depth " << queueDepth << "\n";
+
+    metrics << "# HELP mofocup_players_online Players on the server.\n";
+    metrics << "# TYPE mofocup_players_online gauge\n";
+    metrics << "mofocup_players_online " << playersOnline << "\n";
+
+    metrics << "# HELP mofocup_players_tracked Players whose playing time is being counted.\n";
+    metrics << "# TYPE mofocup_players_tracked gauge\n";
+    metrics << "mofocup_players_tracked " << playingTime.size() << "\n";
+
+    std::string temporaryFile = metricsfilename + ".tmp";
+    std::ofstream metricsFile(temporaryFile.c_str());
+    metricsFile << metrics.str();
+    metricsFile.close();
+
+    if (!metricsFile || rename(temporaryFile.c_str(), metricsfilename.c_str()) != 0)
+        bz_debugMessagef(2, "DEBUG :: MoFo Cup :: Could not write the metrics to %s", metricsfilename.c_str());
+}
@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+The requests other plug-ins on the same server can make to the MoFo Cup
+plugin through bz_Plugin::GeneralCallback(). They are answered on the
+game thread from what the plugin keeps in memory, so they never wait on
+the database. The plugin's name starts with "MoFo Cup" and is followed by
+its release, so look for it in the list bz_getLoadedPlugins() gives.
+
+    bz_Plugin *cupPlugin = ...;
+    struct mofocupRankRequest request;
+
+    memset(&request, 0, sizeof(request));
+    request.version = MOFOCUP_API_VERSION;
+    request.playerID = playerID;
+    strncpy(request.cup, "ctf", sizeof(request.cup) - 1);
+
+    if (cupPlugin->GeneralCallback(MOFOCUP_API_RANK, &request) == MOFOCUP_API_OK)
+        ...
+
+Every request starts with the version of this header it was built with and
+is filled in by the plugin. Cups are named by their name or /cup alias and
+players by their slot; only players on the server can be looked up.
+
+This header is plain C so it can be used from anything that can include a
+C header.
+*/
+
+#ifndef MOFOCUP_API_H
+#define MOFOCUP_API_H
+
+#include <stdint.h>
+
+#include "mofocup_live.h"
+
+#define MOFOCUP_API_VERSION 1 //changes whenever a request below changes
+
+//the names of the requests
+#define MOFOCUP_API_RANK "rank"
+#define MOFOCUP_API_TOP "topN"
+#define MOFOCUP_API_LIVE_SCORE "liveScore"
+
+//what GeneralCallback() returns
+#define MOFOCUP_API_UNKNOWN 0 //not a request we know or built for another version, what a plugin that doesn't answer requests returns too
+#define MOFOCUP_API_OK 1
+#define MOFOCUP_API_NO_CUP -1 //there is no such cup
+#define MOFOCUP_API_NO_PLAYER -2 //nobody registered is playing in that slot
+
+//"rank": a player's place in a cup as of the last database update, the same place the live stats show
+struct mofocupRankRequest
+{
+    uint32_t version;
+    int32_t playerID;
+    char cup[MOFOCUP_LIVE_NAME_LENGTH];
+
+    uint64_t bzid;
+    int32_t place; //0 if they don't have one yet
+    int32_t score; //the score the place was given for
+};
+
+//"topN": the top of a cup as of the last database update
+struct mofocupTopRequest
+{
+    uint32_t version;
+    int32_t count; //the most places wanted, set to the places filled in
+    char cup[MOFOCUP_LIVE_NAME_LENGTH];
+
+    struct mofocupLiveStanding top[MOFOCUP_LIVE_MAX_TOP];
+};
+
+//"liveScore": a player's score in a cup right now, counting what hasn't been written to the database yet
+struct mofocupLiveScoreRequest
+{
+    uint32_t version;
+    int32_t playerID;
+    char cup[MOFOCUP_LIVE_NAME_LENGTH];
+
+    uint64_t bzid;
+    int32_t score; //what they would be ranked by if the database was updated now
+    int32_t pendingPoints; //points that haven't been written to the database yet
+};
+
+#endif
@@ -0,0 +1,1713 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+Description:
+The parts of the MoFo Cup that don't need a BZFlag server, see
+mofocup_core.h
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <ctype.h>
+#include <fstream>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include "mofocup_core.h"
+
+//Native versions of the default formulas so the cups that use them score as quickly as they always have
+static int bountyFormula(const int *v) { return 2 * (v[eVictimBounty] / 6 < 6 ? v[eVictimBounty] / 6 : 6) + 2 * v[eFlagCarrierKill]; }
+static int captureFormula(const int *v) { return 8 * (v[eCappedTeamSize] - v[eCappingTeamSize]) + 3 * v[eCappedTeamSize]; }
+static int genoFormula(const int *v) { return v[eGenoVictims] + 1; }
+static int killFormula(const int *) { return 1; }
+
+struct builtinFormulaEntry
+{
+    const char* source;
+    scoringFormula::builtinFormula function;
+};
+
+static const builtinFormulaEntry builtinFormulas[] = {
+    {"2 * min(bounty / 6, 6) + 2 * carrier", &bountyFormula},
+    {"8 * (capped - capping) + 3 * capped",  &captureFormula},
+    {"victims + 1",                          &genoFormula},
+    {"1",                                    &killFormula}
+};
+
+//The names used for the formula variables in the configuration file
+static const char* formulaVariableNames[eFormulaVariableCount] = {"capped", "capping", "bounty", "carrier", "victims", "selfkill"};
+
+//The scoring hooks a cup can use and the formula each of them scores with unless the cup has its own
+enum scoringHookType
+{
+    eBountyHook,
+    eCaptureHook,
+    eGenoHook,
+    eKillHook,
+    eRatingHook,
+    eScoringHookCount
+};
+
+static const char* scoringHookNames[eScoringHookCount] = {"bounty", "ctf", "geno", "kill", "rating"};
+static const char* defaultFormulas[eScoringHookCount] = {"2 * min(bounty / 6, 6) + 2 * carrier", "8 * (capped - capping) + 3 * capped", "victims + 1", "1", "32"};
+
+//A cup being scored again from the event log
+struct replayedCup
+{
+    int hook; //a scoringHookType
+    scoringFormula formula;
+};
+
+//A kill or a capture read back from the event log, with only what the scoring hooks look at
+struct loggedEvent
+{
+    uint64_t bzid; //the player who made the kill or the capture
+    uint64_t victimBZID; //0 for captures and unregistered players
+    unsigned int cupIndex; //the position of the event's cup in the cups being replayed
+    bool capture;
+    bool genocide; //a kill made with a team flag on a player of another team
+    int variables[eFormulaVariableCount];
+};
+
+static std::string toLowerCase(std::string someString)
+{
+    for (unsigned int i = 0; i < someString.size(); i++)
+        someString[i] = tolower(someString[i]);
+
+    return someString;
+}
+
+static std::string trimWhitespace(std::string someString)
+{
+    size_t start = someString.find_first_not_of(" \t\r\n"), end = someString.find_last_not_of(" \t\r\n");
+
+    if (start == std::string::npos)
+        return "";
+
+    return someString.substr(start, end - start + 1);
+}
+
+static void appendVarint(std::string &block, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        block += (char)(value | 0x80);
+        value >>= 7;
+    }
+
+    block += (char)value;
+}
+
+static void appendUint32(std::string &block, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        block += (char)(value >> (8 * i));
+}
+
+static void rateKills(const std::vector<loggedEvent> &kills, const replayedCup &cup, std::unordered_map<uint64_t, double> &ratings)
+{
+    /*
+        Play a cup's kills back in order and move both players' ratings
+        the way the Rating Cup does. Everyone starts from the starting
+        rating, whether or not they're in the standings already.
+    */
+
+    for (unsigned int i = 0; i < kills.size(); i++)
+    {
+        double &killerRating = ratings.insert(std::make_pair(kills[i].bzid, (double)STARTING_RATING)).first->second;
+        double &victimRating = ratings.insert(std::make_pair(kills[i].victimBZID, (double)STARTING_RATING)).first->second;
+        double change = calculateRatingChange(killerRating, victimRating, cup.formula.evaluate(kills[i].variables));
+
+        killerRating += change;
+        victimRating -= change;
+    }
+}
+
+static int scoreLoggedEvent(const replayedCup &cup, const loggedEvent &event)
+{
+    /*
+        The points a cup awards for an event from the event log, by the
+        same rules as the scoring hooks in mofocup.cpp
+    */
+
+    switch (cup.hook)
+    {
+        case eBountyHook: return (event.capture || event.variables[eSelfKill]) ? 0 : cup.formula.evaluate(event.variables);
+        case eCaptureHook: return event.capture ? cup.formula.evaluate(event.variables) : 0;
+        case eGenoHook: return event.genocide ? cup.formula.evaluate(event.variables) : 0;
+        case eKillHook: return event.capture ? 0 : cup.formula.evaluate(event.variables);
+        default: return 0; //a rating is worked out by rateKills() instead
+    }
+}
+
+static void scorePartition(const std::vector<loggedEvent> &events, const std::vector<replayedCup> &cups, std::vector<std::unordered_map<uint64_t, int> > &points)
+{
+    /*
+        Add up the points of every player in a partition for every cup
+        that isn't rated. Each cup of each CupID has its own slot in
+        points.
+    */
+
+    for (unsigned int i = 0; i < events.size(); i++)
+    {
+        for (unsigned int j = 0; j < cups.size(); j++)
+        {
+            int awarded = scoreLoggedEvent(cups[j], events[i]);
+
+            if (awarded != 0) //the plug-in keeps negative scores too
+                points[events[i].cupIndex * cups.size() + j][events[i].bzid] += awarded;
+        }
+    }
+}
+
+//Lets SQL work out a ratio exactly the way the plug-in does
+static void ratioFunction(sqlite3_context *context, int, sqlite3_value **argv)
+{
+    sqlite3_result_int(context, calculateRatio(sqlite3_value_int(argv[0]), sqlite3_value_int(argv[1])));
+}
+
+int calculateRatio(int points, int playingTime)
+{
+    /*
+        The score of a cup that isn't rated: the points a player would
+        have after playing for a whole day at the rate they have been
+        earning them
+    */
+
+    if (playingTime <= 0)
+        return 0;
+
+    float ratio = (float)points/(float)((float)playingTime/86400.0);
+
+    return int(ratio);
+}
+
+double calculateRatingChange(double killerRating, double victimRating, int kFactor)
+{
+    /*
+        How far a kill moves the killer's rating up and the victim's
+        down with the Elo formula. The K-factor is the most a single
+        kill can move a rating by.
+    */
+
+    double expected = 1.0 / (1.0 + pow(10.0, (victimRating - killerRating) / 400.0)); //the chance the killer had of winning
+
+    return kFactor * (1.0 - expected);
+}
+
+std::string getDefaultFormula(std::string hookName)
+{
+    /*
+        The formula a scoring hook uses when a cup doesn't set its own,
+        empty if there's no such hook
+    */
+
+    for (int i = 0; i < eScoringHookCount; i++)
+    {
+        if (hookName == scoringHookNames[i])
+            return defaultFormulas[i];
+    }
+
+    return "";
+}
+
+csvExportWriter::csvExportWriter(FILE *output) : file(output), headerWritten(false)
+{
+}
+
+bool csvExportWriter::endChunk(void)
+{
+    return (fflush(file) == 0);
+}
+
+bool csvExportWriter::finish(void)
+{
+    if (!headerWritten && fputs("CupID,CupType,Place,BZID,Callsign,Points,Ratio,PlayingTime\n", file) < 0) //an empty export still says what it would hold
+        return false;
+
+    headerWritten = true;
+    return (fflush(file) == 0);
+}
+
+bool csvExportWriter::writeRow(int cupID, const std::string &cupType, const mofocupStanding &standing)
+{
+    /*
+        Write a row, quoting the callsign if it needs to be
+    */
+
+    if (!headerWritten && fputs("CupID,CupType,Place,BZID,Callsign,Points,Ratio,PlayingTime\n", file) < 0)
+        return false;
+
+    headerWritten = true;
+
+    std::string callsign = standing.callsign;
+
+    if (callsign.find_first_of(",\"\r\n") != std::string::npos) //quote the callsign, doubling any quotes in it
+    {
+        for (size_t quote = callsign.find('"'); quote != std::string::npos; quote = callsign.find('"', quote + 2))
+            callsign.insert(quote, "\"");
+
+        callsign = "\"" + callsign + "\"";
+    }
+
+    return fprintf(file, "%i,%s,%i,%llu,%s,%i,%i,%i\n", cupID, cupType.c_str(), standing.place, (unsigned long long)standing.bzid, callsign.c_str(),
+                   standing.points, standing.ratio, standing.playingTime) > 0;
+}
+
+columnarExportWriter::columnarExportWriter(FILE *output) : file(output), headerWritten(false), rowCount(0)
+{
+}
+
+bool columnarExportWriter::endChunk(void)
+{
+    /*
+        Write the rows of the chunk as a row group and start the next
+        one empty
+    */
+
+    if (rowCount == 0)
+        return true;
+
+    if (!writeHeader())
+        return false;
+
+    std::string rowGroup;
+    appendUint32(rowGroup, rowCount);
+
+    for (int column = 0; column < eColumnCount; column++)
+    {
+        std::string block;
+
+        if (column == eCupTypeColumn || column == eCallsignColumn)
+        {
+            std::map<std::string, uint64_t> dictionary;
+            std::string indexes;
+
+            for (unsigned int i = 0; i < texts[column].size(); i++)
+            {
+                std::map<std::string, uint64_t>::iterator entry = dictionary.find(texts[column][i]);
+
+                if (entry == dictionary.end()) //the first time the value is seen in this row group
+                {
+                    entry = dictionary.insert(std::make_pair(texts[column][i], (uint64_t)dictionary.size())).first;
+
+                    appendVarint(block, texts[column][i].size());
+                    block += texts[column][i];
+                }
+
+                appendVarint(indexes, entry->second);
+            }
+
+            std::string dictionarySize;
+            appendVarint(dictionarySize, dictionary.size());
+
+            block = dictionarySize + block + indexes;
+            texts[column].clear();
+        }
+        else
+        {
+            int64_t previous = 0;
+
+            for (unsigned int i = 0; i < integers[column].size(); i++)
+            {
+                int64_t difference = integers[column][i] - previous;
+
+                appendVarint(block, ((uint64_t)difference << 1) ^ (uint64_t)(difference >> 63)); //zigzag so small negative differences stay small
+                previous = integers[column][i];
+            }
+
+            integers[column].clear();
+        }
+
+        appendUint32(rowGroup, block.size());
+        rowGroup += block;
+    }
+
+    rowCount = 0;
+
+    return writeBlock(rowGroup) && (fflush(file) == 0);
+}
+
+bool columnarExportWriter::finish(void)
+{
+    /*
+        Write whatever is left and mark the end of the file
+    */
+
+    if (!endChunk() || !writeHeader())
+        return false;
+
+    std::string end;
+    appendUint32(end, 0);
+
+    return writeBlock(end) && (fflush(file) == 0);
+}
+
+bool columnarExportWriter::writeBlock(const std::string &block)
+{
+    return (fwrite(block.data(), 1, block.size(), file) == block.size());
+}
+
+bool columnarExportWriter::writeHeader(void)
+{
+    /*
+        Describe the columns at the start of the file
+    */
+
+    if (headerWritten)
+        return true;
+
+    const char* names[eColumnCount] = {"CupID", "CupType", "Place", "BZID", "Callsign", "Points", "Ratio", "PlayingTime"};
+    std::string header;
+
+    appendUint32(header, COLUMNAR_MAGIC);
+    appendUint32(header, COLUMNAR_VERSION);
+    appendUint32(header, eColumnCount);
+
+    for (int column = 0; column < eColumnCount; column++)
+    {
+        header += (char)((column == eCupTypeColumn || column == eCallsignColumn) ? 1 : 0);
+        header += (char)strlen(names[column]);
+        header += names[column];
+    }
+
+    headerWritten = true;
+    return writeBlock(header);
+}
+
+bool columnarExportWriter::writeRow(int cupID, const std::string &cupType, const mofocupStanding &standing)
+{
+    /*
+        Add a row to the current row group
+    */
+
+    integers[eCupIDColumn].push_back(cupID);
+    texts[eCupTypeColumn].push_back(cupType);
+    integers[ePlaceColumn].push_back(standing.place);
+    integers[eBZIDColumn].push_back((int64_t)standing.bzid);
+    texts[eCallsignColumn].push_back(standing.callsign);
+    integers[ePointsColumn].push_back(standing.points);
+    integers[eRatioColumn].push_back(standing.ratio);
+    integers[ePlayingTimeColumn].push_back(standing.playingTime);
+    rowCount++;
+
+    return true;
+}
+
+bool mofocupConfig::load(std::string filename, std::vector<std::string> &ignoredLines)
+{
+    /*
+        Read the configuration file, returns false if it couldn't be
+        read. Lines that aren't a section or a setting are skipped and
+        added to ignoredLines.
+    */
+
+    sections.clear();
+
+    if (filename.empty()) //no configuration file, everything will use the defaults
+        return true;
+
+    std::ifstream configFile(filename.c_str());
+
+    if (!configFile)
+        return false;
+
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(configFile, line))
+    {
+        lineNumber++;
+        line = trimWhitespace(line.substr(0, line.find_first_of("#;"))); //ignore comments
+
+        if (line.empty())
+            continue;
+
+        if (line[0] == '[' && line[line.size() - 1] == ']') //start a new section
+        {
+            configSection newSection;
+            newSection.name = trimWhitespace(line.substr(1, line.size() - 2));
+            sections.push_back(newSection);
+        }
+        else if (line.find("=") != std::string::npos && !sections.empty())
+        {
+            std::string key = toLowerCase(trimWhitespace(line.substr(0, line.find("=")))),
+                        value = trimWhitespace(line.substr(line.find("=") + 1));
+
+            sections.back().settings[key] = value;
+        }
+        else
+        {
+            std::ostringstream ignoredLine;
+            ignoredLine << "line " << lineNumber << " of " << filename << ": " << line;
+            ignoredLines.push_back(ignoredLine.str());
+        }
+    }
+
+    return true;
+}
+
+std::vector<cupSettings> mofocupConfig::getCups(void) const
+{
+    /*
+        Every section of the configuration file, other than the
+        [MoFoCup] section, is a cup. The name of
+        the section is the name of the cup that will be stored in the
+        database and any setting that is left out uses a default:
+
+            [Kill]
+            alias = kills       (the lowercase cup name)
+            hook = kill         (the lowercase cup name)
+            flush = deferred    (deferred or immediate)
+            top = 5
+            formula = 1         (the default formula of the scoring hook)
+
+        Without any cups in the configuration file, the original four
+        cups and the Rating cup are used.
+    */
+
+    std::vector<cupSettings> cups;
+
+    for (unsigned int i = 0; i < sections.size(); i++)
+    {
+        std::string name = sections[i].name;
+
+        if (name == "MoFoCup") //the plugin's own settings
+            continue;
+
+        cupSettings cup;
+        cup.name = name;
+        cup.alias = getValue(name, "alias", toLowerCase(name));
+        cup.hookName = getValue(name, "hook", toLowerCase(name));
+        cup.flushPolicy = getValue(name, "flush", "deferred");
+        cup.topN = atoi(getValue(name, "top", "5").c_str());
+        cup.formula = getValue(name, "formula", "");
+
+        cups.push_back(cup);
+    }
+
+    if (cups.empty())
+    {
+        const char* defaults[][4] = {{"Bounty", "bounty", "bounty", "deferred"},
+                                     {"CTF",    "ctf",    "ctf",    "immediate"},
+                                     {"Geno",   "geno",   "geno",   "deferred"},
+                                     {"Kill",   "kills",  "kill",   "deferred"},
+                                     {"Rating", "rating", "rating", "deferred"}};
+
+        for (unsigned int i = 0; i < sizeof(defaults)/sizeof(defaults[0]); i++)
+        {
+            cupSettings cup;
+            cup.name = defaults[i][0];
+            cup.alias = defaults[i][1];
+            cup.hookName = defaults[i][2];
+            cup.flushPolicy = defaults[i][3];
+            cup.topN = 5;
+
+            cups.push_back(cup);
+        }
+    }
+
+    return cups;
+}
+
+std::string mofocupConfig::getValue(std::string section, std::string key, std::string defaultValue) const
+{
+    /*
+        Get a setting from the configuration file or the default
+        value if it wasn't set
+    */
+
+    for (unsigned int i = 0; i < sections.size(); i++)
+    {
+        std::map<std::string, std::string>::const_iterator setting = sections[i].settings.find(toLowerCase(key)); //keys are stored in lower case when the file is read
+
+        if (sections[i].name == section && setting != sections[i].settings.end())
+            return setting->second;
+    }
+
+    return defaultValue;
+}
+
+mofocupDatabase::mofocupDatabase() : db(NULL), ownsConnection(false)
+{
+}
+
+mofocupDatabase::~mofocupDatabase()
+{
+    close();
+}
+
+bool mofocupDatabase::archiveCup(int cupID)
+{
+    /*
+        Move a finished cup to the archive database. The final standings
+        of every cup type are written with each player's totals, and the
+        rows are then removed from the live tables so the queries made
+        while playing only go through the current cup. The places are
+        numbered by SQLite as the standings are copied, so a cup of any
+        size is archived in a handful of statements.
+    */
+
+    sqlite3_stmt *archiveCupInfoStmt = prepare("INSERT OR REPLACE INTO `archive`.`Cups` SELECT `CupID`, `ServerID`, `StartTime`, `EndTime` FROM `Cups` WHERE `CupID` = ?");
+    sqlite3_stmt *archiveStandingsStmt = prepare("INSERT OR REPLACE INTO `archive`.`Standings` SELECT ?1, `Points`.`CupType`, ROW_NUMBER() OVER (PARTITION BY `Points`.`CupType` ORDER BY `Points`.`Ratio` DESC, `Players`.`PlayingTime` ASC), "
+                                                 "`Points`.`BZID`, COALESCE(`Players`.`Callsign`, 'Anonymous'), `Points`.`Points`, `Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, 0) FROM `Points` LEFT JOIN `Players` ON `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` WHERE `Points`.`CupID` = ?1");
+    sqlite3_stmt *deletePointsStmt = prepare("DELETE FROM `Points` WHERE `CupID` = ?");
+    sqlite3_stmt *deletePlayersStmt = prepare("DELETE FROM `Players` WHERE `CupID` = ?");
+    sqlite3_stmt *archiveDailyPointsStmt = prepare("INSERT OR REPLACE INTO `archive`.`DailyPoints` SELECT * FROM `DailyPoints` WHERE `CupID` = ?");
+    sqlite3_stmt *deleteDailyPointsStmt = prepare("DELETE FROM `DailyPoints` WHERE `CupID` = ?");
+
+    if (archiveCupInfoStmt == NULL || archiveStandingsStmt == NULL || deletePointsStmt == NULL || deletePlayersStmt == NULL ||
+        archiveDailyPointsStmt == NULL || deleteDailyPointsStmt == NULL)
+        return false;
+
+    bool success = true;
+
+    if (!run("SAVEPOINT archiveCup")) //a savepoint so a cup can also be archived as part of a bigger transaction
+        return false;
+
+    sqlite3_bind_int(archiveCupInfoStmt, 1, cupID);
+    success = (sqlite3_step(archiveCupInfoStmt) == SQLITE_DONE);
+    sqlite3_reset(archiveCupInfoStmt);
+
+    if (success) //every player in every cup type, numbered best first
+    {
+        sqlite3_bind_int(archiveStandingsStmt, 1, cupID);
+        success = (sqlite3_step(archiveStandingsStmt) == SQLITE_DONE);
+        sqlite3_reset(archiveStandingsStmt);
+    }
+
+    if (success) //keep the daily totals so a finished cup's trends can still be looked at
+    {
+        sqlite3_bind_int(archiveDailyPointsStmt, 1, cupID);
+        success = (sqlite3_step(archiveDailyPointsStmt) == SQLITE_DONE);
+        sqlite3_reset(archiveDailyPointsStmt);
+    }
+
+    if (success) //only clear the live tables once the archive has everything
+    {
+        sqlite3_bind_int(deletePointsStmt, 1, cupID);
+        sqlite3_bind_int(deletePlayersStmt, 1, cupID);
+        sqlite3_bind_int(deleteDailyPointsStmt, 1, cupID);
+
+        success = (sqlite3_step(deletePointsStmt) == SQLITE_DONE && sqlite3_step(deletePlayersStmt) == SQLITE_DONE && sqlite3_step(deleteDailyPointsStmt) == SQLITE_DONE);
+
+        sqlite3_reset(deletePointsStmt);
+        sqlite3_reset(deletePlayersStmt);
+        sqlite3_reset(deleteDailyPointsStmt);
+    }
+
+    if (!success)
+    {
+        lastError = sqlite3_errmsg(db);
+        run("ROLLBACK TO archiveCup");
+        run("RELEASE archiveCup");
+        return false;
+    }
+
+    return run("RELEASE archiveCup");
+}
+
+bool mofocupDatabase::attachArchive(std::string filename)
+{
+    /*
+        Attach the database finished cups are moved to as `archive`
+    */
+
+    sqlite3_stmt *attachArchiveStmt = prepare("ATTACH DATABASE ? AS `archive`");
+
+    if (attachArchiveStmt == NULL)
+        return false;
+
+    sqlite3_bind_text(attachArchiveStmt, 1, filename.c_str(), -1, SQLITE_TRANSIENT);
+
+    bool success = (sqlite3_step(attachArchiveStmt) == SQLITE_DONE);
+
+    if (!success)
+        lastError = sqlite3_errmsg(db);
+
+    sqlite3_reset(attachArchiveStmt);
+    return success;
+}
+
+void mofocupDatabase::close(void)
+{
+    /*
+        Finalize every statement and close the connection if it's ours
+    */
+
+    for (std::map<std::string, sqlite3_stmt*>::iterator itr = statements.begin(); itr != statements.end(); ++itr)
+        sqlite3_finalize(itr->second);
+
+    statements.clear();
+
+    if (db != NULL && ownsConnection)
+        sqlite3_close(db);
+
+    db = NULL;
+    ownsConnection = false;
+}
+
+bool mofocupDatabase::compact(void)
+{
+    /*
+        Give the space left behind by archived cups back to the file
+        system. The write-ahead log is folded into the database first so
+        nothing is left behind in it.
+    */
+
+    bool archiveAttached = (sqlite3_db_filename(db, "archive") != NULL);
+
+    if (!run("PRAGMA main.wal_checkpoint(TRUNCATE)") || !run("VACUUM main"))
+        return false;
+
+    if (archiveAttached && (!run("PRAGMA archive.wal_checkpoint(TRUNCATE)") || !run("VACUUM archive")))
+        return false;
+
+    return run("PRAGMA optimize");
+}
+
+bool mofocupDatabase::createSchema(void)
+{
+    /*
+        Create any table or index that's missing, in the archive as well
+        when it's attached
+    */
+
+    const char* schema[] = {
+        "CREATE TABLE IF NOT EXISTS \"Players\" (\"BZID\" INTEGER NOT NULL UNIQUE DEFAULT (0), \"Callsign\" TEXT NOT NULL DEFAULT ('Anonymous'), \"CupID\" INTEGER NOT NULL DEFAULT (0), \"PlayingTime\" INTEGER NOT NULL DEFAULT (0));",
+        "CREATE TABLE IF NOT EXISTS \"Cups\" (\"CupID\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, \"ServerID\" TEXT NOT NULL, \"StartTime\" REAL NOT NULL, \"EndTime\" REAL NOT NULL);",
+        "CREATE TABLE IF NOT EXISTS \"Points\" (\"CupType\" TEXT NOT NULL, \"BZID\" INTEGER NOT NULL, \"CupID\" INTEGER NOT NULL, \"Points\" INTEGER NOT NULL, \"Ratio\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"DailyPoints\" (\"CupID\" INTEGER NOT NULL, \"CupType\" TEXT NOT NULL, \"Day\" TEXT NOT NULL, \"BZID\" INTEGER NOT NULL, \"Points\" INTEGER NOT NULL, PRIMARY KEY (\"CupID\", \"CupType\", \"Day\", \"BZID\")) WITHOUT ROWID;",
+        "CREATE INDEX IF NOT EXISTS \"PointsByPlayer\" ON \"Points\" (\"CupID\", \"CupType\", \"BZID\");", //every player's points are updated on their own
+        "CREATE INDEX IF NOT EXISTS \"PointsByRatio\" ON \"Points\" (\"CupID\", \"CupType\", \"Ratio\");", //the standings are read in order
+        "CREATE INDEX IF NOT EXISTS \"PlayersByCup\" ON \"Players\" (\"CupID\", \"BZID\");" //everyone entered in a cup is looked up at once when it starts
+    };
+
+    const char* archiveSchema[] = {
+        "CREATE TABLE IF NOT EXISTS `archive`.\"Cups\" (\"CupID\" INTEGER NOT NULL PRIMARY KEY, \"ServerID\" TEXT NOT NULL, \"StartTime\" REAL NOT NULL, \"EndTime\" REAL NOT NULL);",
+        "CREATE TABLE IF NOT EXISTS `archive`.\"Standings\" (\"CupID\" INTEGER NOT NULL, \"CupType\" TEXT NOT NULL, \"Place\" INTEGER NOT NULL, \"BZID\" INTEGER NOT NULL, \"Callsign\" TEXT NOT NULL, \"Points\" INTEGER NOT NULL, \"Ratio\" INTEGER NOT NULL, \"PlayingTime\" INTEGER NOT NULL, PRIMARY KEY (\"CupID\", \"CupType\", \"Place\")) WITHOUT ROWID;",
+        "CREATE TABLE IF NOT EXISTS `archive`.\"DailyPoints\" (\"CupID\" INTEGER NOT NULL, \"CupType\" TEXT NOT NULL, \"Day\" TEXT NOT NULL, \"BZID\" INTEGER NOT NULL, \"Points\" INTEGER NOT NULL, PRIMARY KEY (\"CupID\", \"CupType\", \"Day\", \"BZID\")) WITHOUT ROWID;",
+        "CREATE INDEX IF NOT EXISTS `archive`.\"StandingsByPlayer\" ON \"Standings\" (\"CupID\", \"CupType\", \"BZID\");"
+    };
+
+    for (unsigned int i = 0; i < sizeof(schema)/sizeof(schema[0]); i++)
+    {
+        if (!run(schema[i]))
+            return false;
+    }
+
+    if (sqlite3_db_filename(db, "archive") == NULL) //finished cups aren't kept apart
+        return true;
+
+    for (unsigned int i = 0; i < sizeof(archiveSchema)/sizeof(archiveSchema[0]); i++)
+    {
+        if (!run(archiveSchema[i]))
+            return false;
+    }
+
+    return true;
+}
+
+bool mofocupDatabase::exportCup(int cupID, std::string cupType, mofocupExportWriter &writer, int chunkSize)
+{
+    /*
+        Export every row of a cup, or of one cup type if cupType isn't
+        empty. The rows are read in chunks, each in its own short read
+        transaction that starts after the last row of the chunk before
+        it, so the export never holds up the plug-in's writes or the
+        checkpoints of the write-ahead log however long it takes. A row
+        that changes while the export is running is exported as it was
+        when its chunk was read.
+
+        The places of a cup that hasn't been archived are numbered the
+        way forEachStanding() numbers them, best ratio first and the least
+        playing time first between equal ratios. They're only final once
+        the cup is over.
+    */
+
+    bool archived = isArchived(cupID);
+    sqlite3_stmt *getChunkStmt;
+
+    //the last four columns are where the row sorts, the next chunk starts after them
+    if (archived) //ordered by the primary key of the archived standings
+        getChunkStmt = prepare("SELECT `CupType`, `Place`, `BZID`, `Callsign`, `Points`, `Ratio`, `PlayingTime`, `Place`, 0, 0 FROM `archive`.`Standings` "
+                               "WHERE `CupID` = ?1 AND (`CupType`, `Place`) > (?2, ?3) ORDER BY `CupType`, `Place` LIMIT ?6");
+    else //ordered like the live standings, with the players who never joined first between equal ratios as they are there
+        getChunkStmt = prepare("SELECT `Points`.`CupType`, 0, `Points`.`BZID`, COALESCE(`Players`.`Callsign`, 'Anonymous'), `Points`.`Points`, `Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, 0), "
+                               "-`Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, -1), `Points`.`rowid` "
+                               "FROM `Points` LEFT JOIN `Players` ON `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` WHERE `Points`.`CupID` = ?1 "
+                               "AND (`Points`.`CupType`, -`Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, -1), `Points`.`rowid`) > (?2, ?3, ?4, ?5) "
+                               "ORDER BY `Points`.`CupType`, -`Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, -1), `Points`.`rowid` LIMIT ?6");
+
+    if (getChunkStmt == NULL)
+        return false;
+
+    //where the next chunk starts, every row sorts after the first key
+    std::string lastCupType = cupType;
+    int64_t lastKeys[3] = {INT64_MIN, INT64_MIN, INT64_MIN};
+    int place = 0; //the place of the last live row of lastCupType
+    bool finished = false;
+
+    while (!finished)
+    {
+        int rows = 0, result;
+
+        sqlite3_bind_int(getChunkStmt, 1, cupID);
+        sqlite3_bind_text(getChunkStmt, 2, lastCupType.c_str(), -1, SQLITE_TRANSIENT);
+
+        for (int i = 0; i < 3; i++)
+            sqlite3_bind_int64(getChunkStmt, 3 + i, lastKeys[i]);
+
+        sqlite3_bind_int(getChunkStmt, 6, chunkSize);
+
+        while ((result = sqlite3_step(getChunkStmt)) == SQLITE_ROW)
+        {
+            std::string rowCupType = (char*)sqlite3_column_text(getChunkStmt, 0);
+
+            if (!cupType.empty() && rowCupType != cupType) //past the cup type being exported
+            {
+                result = SQLITE_DONE;
+                finished = true;
+                break;
+            }
+
+            if (rowCupType != lastCupType) //the places start over with every cup type
+                place = 0;
+
+            mofocupStanding standing;
+            standing.place = archived ? sqlite3_column_int(getChunkStmt, 1) : ++place;
+            standing.bzid = sqlite3_column_int64(getChunkStmt, 2);
+            standing.callsign = (char*)sqlite3_column_text(getChunkStmt, 3);
+            standing.points = sqlite3_column_int(getChunkStmt, 4);
+            standing.ratio = sqlite3_column_int(getChunkStmt, 5);
+            standing.playingTime = sqlite3_column_int(getChunkStmt, 6);
+
+            if (!writer.writeRow(cupID, rowCupType, standing))
+            {
+                sqlite3_reset(getChunkStmt);
+                lastError = "could not write the export";
+                return false;
+            }
+
+            lastCupType = rowCupType;
+
+            for (int i = 0; i < 3; i++)
+                lastKeys[i] = sqlite3_column_int64(getChunkStmt, 7 + i);
+
+            rows++;
+        }
+
+        if (result != SQLITE_DONE)
+            lastError = sqlite3_errmsg(db);
+
+        sqlite3_reset(getChunkStmt); //ends the read transaction
+
+        if (result != SQLITE_DONE)
+            return false;
+
+        if (!writer.endChunk())
+        {
+            lastError = "could not write the export";
+            return false;
+        }
+
+        finished = finished || (rows < chunkSize);
+    }
+
+    return true;
+}
+
+bool mofocupDatabase::forEachStanding(std::string cupType, int cupID, int limit, standingCallback callback, void *data)
+{
+    /*
+        Go through the standings of a cup best first, up to limit places
+        or all of them if limit is negative. The rows are handed over one
+        at a time as they are read, so even the largest cup is read in
+        the same amount of memory. Returns false if the standings couldn't
+        be read.
+    */
+
+    bool archived = isArchived(cupID);
+    sqlite3_stmt *getStandingsStmt;
+
+    if (archived)
+        getStandingsStmt = prepare("SELECT `Place`, `BZID`, `Callsign`, `Points`, `Ratio`, `PlayingTime` FROM `archive`.`Standings` WHERE `CupID` = ? AND `CupType` = ? ORDER BY `Place` LIMIT ?");
+    else
+        getStandingsStmt = prepare(LIVE_STANDINGS_QUERY);
+
+    if (getStandingsStmt == NULL)
+        return false;
+
+    sqlite3_bind_int(getStandingsStmt, 1, cupID);
+    sqlite3_bind_text(getStandingsStmt, 2, cupType.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(getStandingsStmt, 3, limit < 0 ? -1 : limit);
+    sqlite3_bind_int(getStandingsStmt, 4, 0);
+
+    mofocupStanding standing;
+    int place = 0, result;
+
+    while ((result = sqlite3_step(getStandingsStmt)) == SQLITE_ROW)
+    {
+        standing.place = archived ? sqlite3_column_int(getStandingsStmt, 0) : ++place; //the live standings are numbered the way /cup numbers them
+        standing.bzid = sqlite3_column_int64(getStandingsStmt, 1);
+        standing.callsign = (char*)sqlite3_column_text(getStandingsStmt, 2);
+        standing.points = sqlite3_column_int(getStandingsStmt, 3);
+        standing.ratio = sqlite3_column_int(getStandingsStmt, 4);
+        standing.playingTime = sqlite3_column_int(getStandingsStmt, 5);
+
+        if (!callback(standing, data))
+        {
+            result = SQLITE_DONE;
+            break;
+        }
+    }
+
+    if (result != SQLITE_DONE)
+        lastError = sqlite3_errmsg(db);
+
+    sqlite3_reset(getStandingsStmt);
+    return (result == SQLITE_DONE);
+}
+
+std::vector<std::string> mofocupDatabase::getCupTypes(int cupID)
+{
+    /*
+        Get the name of every cup type that has standings in a cup
+    */
+
+    std::vector<std::string> cupTypes;
+    sqlite3_stmt *getCupTypesStmt = prepare(isArchived(cupID) ? "SELECT DISTINCT `CupType` FROM `archive`.`Standings` WHERE `CupID` = ? ORDER BY `CupType`"
+                                                              : "SELECT DISTINCT `CupType` FROM `Points` WHERE `CupID` = ? ORDER BY `CupType`");
+
+    if (getCupTypesStmt == NULL)
+        return cupTypes;
+
+    sqlite3_bind_int(getCupTypesStmt, 1, cupID);
+
+    while (sqlite3_step(getCupTypesStmt) == SQLITE_ROW)
+        cupTypes.push_back((char*)sqlite3_column_text(getCupTypesStmt, 0));
+
+    sqlite3_reset(getCupTypesStmt);
+    return cupTypes;
+}
+
+std::vector<int> mofocupDatabase::getFinishedCups(std::string serverID)
+{
+    /*
+        Get every cup that has ended but is still in the live tables,
+        only the cups of one server unless serverID is empty
+    */
+
+    std::vector<int> finishedCups;
+    sqlite3_stmt *getFinishedCupsStmt = prepare("SELECT `CupID` FROM `Cups` WHERE (?1 = '' OR `ServerID` = ?1) AND `EndTime` < strftime('%s','now') AND `CupID` NOT IN (SELECT `CupID` FROM `archive`.`Cups`) ORDER BY `CupID`");
+
+    if (getFinishedCupsStmt == NULL)
+        return finishedCups;
+
+    sqlite3_bind_text(getFinishedCupsStmt, 1, serverID.c_str(), -1, SQLITE_TRANSIENT);
+
+    while (sqlite3_step(getFinishedCupsStmt) == SQLITE_ROW)
+        finishedCups.push_back(sqlite3_column_int(getFinishedCupsStmt, 0));
+
+    sqlite3_reset(getFinishedCupsStmt);
+    return finishedCups;
+}
+
+int mofocupDatabase::getLatestCup(std::string serverID)
+{
+    /*
+        Get the cup that started last, only looking at the cups of one
+        server unless serverID is empty. Returns -1 if there isn't one.
+    */
+
+    sqlite3_stmt *getLatestCupStmt = prepare("SELECT `CupID` FROM `Cups` WHERE (?1 = '' OR `ServerID` = ?1) ORDER BY `StartTime` DESC, `CupID` DESC LIMIT 1");
+    int cupID = -1;
+
+    if (getLatestCupStmt == NULL)
+        return cupID;
+
+    sqlite3_bind_text(getLatestCupStmt, 1, serverID.c_str(), -1, SQLITE_TRANSIENT);
+
+    if (sqlite3_step(getLatestCupStmt) == SQLITE_ROW)
+        cupID = sqlite3_column_int(getLatestCupStmt, 0);
+
+    sqlite3_reset(getLatestCupStmt);
+    return cupID;
+}
+
+bool mofocupDatabase::getStanding(std::string cupType, int cupID, uint64_t bzid, std::string callsign, mofocupStanding &standing)
+{
+    /*
+        Look up a player's standing in a cup by their BZID, or by their
+        callsign if the BZID is 0. The place is worked out the same way
+        /rank does while the cup is being played, so players with the
+        same score share a place. Returns false if the player isn't in
+        the cup.
+    */
+
+    sqlite3_stmt *getStandingStmt;
+
+    if (isArchived(cupID))
+        getStandingStmt = prepare(bzid != 0 ? "SELECT `Place`, `BZID`, `Callsign`, `Points`, `Ratio`, `PlayingTime` FROM `archive`.`Standings` WHERE `CupID` = ?1 AND `CupType` = ?2 AND `BZID` = ?3"
+                                            : "SELECT `Place`, `BZID`, `Callsign`, `Points`, `Ratio`, `PlayingTime` FROM `archive`.`Standings` WHERE `CupID` = ?1 AND `CupType` = ?2 AND `Callsign` LIKE ?4 ORDER BY `Place` LIMIT 1");
+    else
+        getStandingStmt = prepare(bzid != 0 ? LIVE_STANDING_BY_BZID_QUERY : LIVE_STANDING_BY_CALLSIGN_QUERY);
+
+    if (getStandingStmt == NULL)
+        return false;
+
+    sqlite3_bind_int(getStandingStmt, 1, cupID);
+    sqlite3_bind_text(getStandingStmt, 2, cupType.c_str(), -1, SQLITE_TRANSIENT);
+
+    if (bzid != 0)
+        sqlite3_bind_int64(getStandingStmt, 3, bzid);
+    else
+        sqlite3_bind_text(getStandingStmt, 4, callsign.c_str(), -1, SQLITE_TRANSIENT);
+
+    bool found = (sqlite3_step(getStandingStmt) == SQLITE_ROW);
+
+    if (found)
+    {
+        standing.place = sqlite3_column_int(getStandingStmt, 0);
+        standing.bzid = sqlite3_column_int64(getStandingStmt, 1);
+        standing.callsign = (char*)sqlite3_column_text(getStandingStmt, 2);
+        standing.points = sqlite3_column_int(getStandingStmt, 3);
+        standing.ratio = sqlite3_column_int(getStandingStmt, 4);
+        standing.playingTime = sqlite3_column_int(getStandingStmt, 5);
+    }
+
+    sqlite3_reset(getStandingStmt);
+    return found;
+}
+
+bool mofocupDatabase::isArchived(int cupID)
+{
+    /*
+        Check whether a cup has been moved to the archive
+    */
+
+    if (sqlite3_db_filename(db, "archive") == NULL)
+        return false;
+
+    sqlite3_stmt *isArchivedStmt = prepare("SELECT 1 FROM `archive`.`Cups` WHERE `CupID` = ?");
+
+    if (isArchivedStmt == NULL)
+        return false;
+
+    sqlite3_bind_int(isArchivedStmt, 1, cupID);
+
+    bool archived = (sqlite3_step(isArchivedStmt) == SQLITE_ROW);
+
+    sqlite3_reset(isArchivedStmt);
+    return archived;
+}
+
+bool mofocupDatabase::open(std::string filename, bool readOnly)
+{
+    /*
+        Open our own connection to a database. While the plug-in is
+        writing to it, a statement waits a few seconds for the plug-in
+        to finish instead of failing right away.
+    */
+
+    close();
+
+    if (sqlite3_open_v2(filename.c_str(), &db, readOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE), NULL) != SQLITE_OK)
+    {
+        lastError = (db != NULL) ? sqlite3_errmsg(db) : "out of memory";
+        sqlite3_close(db);
+        db = NULL;
+        return false;
+    }
+
+    ownsConnection = true;
+    sqlite3_busy_timeout(db, 5000);
+
+    return true;
+}
+
+sqlite3_stmt* mofocupDatabase::prepare(std::string sql)
+{
+    /*
+        Get a prepared statement, preparing it the first time it's used
+    */
+
+    std::map<std::string, sqlite3_stmt*>::iterator itr = statements.find(sql);
+
+    if (itr != statements.end())
+        return itr->second;
+
+    sqlite3_stmt *newStatement;
+
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &newStatement, 0) != SQLITE_OK)
+    {
+        lastError = sqlite3_errmsg(db);
+        return NULL;
+    }
+
+    statements[sql] = newStatement;
+    return newStatement;
+}
+
+int mofocupDatabase::recomputeRatios(std::string cupType, int cupID)
+{
+    /*
+        Work out every player's ratio in a cup again from their points
+        and playing time, in a single statement. Returns how many ratios
+        changed or -1 if they couldn't be updated. Rated cups are ranked
+        by the rating stored with the points and have nothing to
+        recompute, and archived cups are final.
+    */
+
+    if (isArchived(cupID))
+    {
+        lastError = "the cup has been archived";
+        return -1;
+    }
+
+    if (sqlite3_create_function(db, "mofocup_ratio", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, &ratioFunction, NULL, NULL) != SQLITE_OK)
+    {
+        lastError = sqlite3_errmsg(db);
+        return -1;
+    }
+
+    sqlite3_stmt *recomputeRatiosStmt = prepare("UPDATE `Points` SET `Ratio` = mofocup_ratio(`Points`, COALESCE((SELECT `PlayingTime` FROM `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID`), 0)) "
+                                                "WHERE `CupID` = ?1 AND `CupType` = ?2 AND `Ratio` != mofocup_ratio(`Points`, COALESCE((SELECT `PlayingTime` FROM `Players` WHERE `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID`), 0))");
+
+    if (recomputeRatiosStmt == NULL)
+        return -1;
+
+    sqlite3_bind_int(recomputeRatiosStmt, 1, cupID);
+    sqlite3_bind_text(recomputeRatiosStmt, 2, cupType.c_str(), -1, SQLITE_TRANSIENT);
+
+    int changed = -1;
+
+    if (sqlite3_step(recomputeRatiosStmt) == SQLITE_DONE)
+        changed = sqlite3_changes(db);
+    else
+        lastError = sqlite3_errmsg(db);
+
+    sqlite3_reset(recomputeRatiosStmt);
+    return changed;
+}
+
+int mofocupDatabase::replayEvents(std::string eventsFilename, const std::vector<int> &cupIDs, const std::vector<cupSettings> &cups, unsigned int threads)
+{
+    /*
+        Score cups again from the event log with the hooks and formulas
+        they have now and write the standings they end up with to
+        `ReplayedStandings`, which is replaced every time. Farmed kills
+        are left out just like they were when they happened.
+
+        The events are split by cup and player: the events of the cups
+        that earn points into REPLAY_PARTITIONS groups of players, whose
+        totals don't depend on each other, and the kills of each rated
+        cup into a group of their own because every kill depends on the
+        ratings the ones before it left behind. The groups are scored on
+        `threads` threads at once and the results are written in a
+        single savepoint.
+
+        The event log doesn't know how long anyone played, so ratios are
+        worked out with the playing time already in the database. Returns
+        how many events were replayed or -1 if something failed.
+    */
+
+    std::vector<replayedCup> replayed(cups.size());
+    bool hasPointsCups = false, hasRatedCups = false;
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        std::string formulaError;
+
+        replayed[i].hook = eScoringHookCount;
+
+        for (int j = 0; j < eScoringHookCount; j++)
+        {
+            if (cups[i].hookName == scoringHookNames[j])
+                replayed[i].hook = j;
+        }
+
+        if (replayed[i].hook == eScoringHookCount)
+        {
+            lastError = "the " + cups[i].name + " Cup uses an unknown scoring hook '" + cups[i].hookName + "'";
+            return -1;
+        }
+
+        if (!replayed[i].formula.compile(cups[i].formula.empty() ? getDefaultFormula(cups[i].hookName) : cups[i].formula, formulaError))
+        {
+            lastError = "the formula of the " + cups[i].name + " Cup doesn't work: " + formulaError;
+            return -1;
+        }
+
+        hasRatedCups = hasRatedCups || (replayed[i].hook == eRatingHook);
+        hasPointsCups = hasPointsCups || (replayed[i].hook != eRatingHook);
+    }
+
+    //everyone already in the standings keeps a place, even if the new formulas give them nothing
+    unsigned int slotCount = cupIDs.size() * cups.size(); //every cup type of every CupID
+    std::vector<std::unordered_map<uint64_t, double> > scores(slotCount); //points or ratings by BZID
+    std::vector<std::unordered_map<uint64_t, int> > playingTimes(cupIDs.size()); //by BZID
+    std::map<int, unsigned int> cupIndexes; //the position of each CupID in cupIDs
+
+    for (unsigned int i = 0; i < cupIDs.size(); i++)
+    {
+        sqlite3_stmt *getRosterStmt = isArchived(cupIDs[i]) ?
+            prepare("SELECT `CupType`, `BZID`, `PlayingTime` FROM `archive`.`Standings` WHERE `CupID` = ?") :
+            prepare("SELECT `Points`.`CupType`, `Points`.`BZID`, COALESCE(`Players`.`PlayingTime`, 0) FROM `Points` LEFT JOIN `Players` ON `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` WHERE `Points`.`CupID` = ?");
+
+        if (getRosterStmt == NULL)
+            return -1;
+
+        cupIndexes[cupIDs[i]] = i;
+        sqlite3_bind_int(getRosterStmt, 1, cupIDs[i]);
+
+        while (sqlite3_step(getRosterStmt) == SQLITE_ROW)
+        {
+            std::string cupType = (const char*)sqlite3_column_text(getRosterStmt, 0);
+            uint64_t bzid = sqlite3_column_int64(getRosterStmt, 1);
+
+            playingTimes[i][bzid] = sqlite3_column_int(getRosterStmt, 2);
+
+            for (unsigned int j = 0; j < cups.size(); j++)
+            {
+                if (cups[j].name == cupType)
+                    scores[i * cups.size() + j][bzid] = (replayed[j].hook == eRatingHook) ? STARTING_RATING : 0;
+            }
+        }
+
+        sqlite3_reset(getRosterStmt);
+    }
+
+    if (cupIDs.empty())
+        return 0;
+
+    sqlite3 *eventsDb = NULL;
+    sqlite3_stmt *getEventsStmt = NULL;
+
+    if (sqlite3_open_v2(eventsFilename.c_str(), &eventsDb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+        lastError = "could not open the event log: " + std::string((eventsDb != NULL) ? sqlite3_errmsg(eventsDb) : "out of memory");
+        sqlite3_close(eventsDb);
+        return -1;
+    }
+
+    std::string selectEvents = "SELECT `CupID`, `Type`, `BZID`, COALESCE(`VictimBZID`, 0), `Flag`, `Team`, `VictimTeam`, `Capped`, `Capping`, `Bounty`, `Carrier`, `Victims`, `SelfKill`, ";
+    std::string fromEvents = " FROM `Events` WHERE `CupID` BETWEEN ? AND ? ORDER BY `EventID`";
+
+    //event logs written before farmed kills were marked don't have the column and count every kill
+    if (sqlite3_prepare_v2(eventsDb, (selectEvents + "`Farmed`" + fromEvents).c_str(), -1, &getEventsStmt, 0) != SQLITE_OK &&
+        sqlite3_prepare_v2(eventsDb, (selectEvents + "0" + fromEvents).c_str(), -1, &getEventsStmt, 0) != SQLITE_OK)
+    {
+        lastError = "could not read the event log: " + std::string(sqlite3_errmsg(eventsDb));
+        sqlite3_close(eventsDb);
+        return -1;
+    }
+
+    static const char teamFlags[] = "RGBP"; //the team flags in the order of their teams in bz_eTeamType, from red (1) to purple (4)
+    std::vector<std::vector<loggedEvent> > partitions(REPLAY_PARTITIONS); //the events of the cups that earn points, by player
+    std::vector<std::vector<loggedEvent> > ratedKills(cupIDs.size()); //the kills rated cups count, by CupID
+    int eventCount = 0, result;
+
+    sqlite3_bind_int(getEventsStmt, 1, *std::min_element(cupIDs.begin(), cupIDs.end()));
+    sqlite3_bind_int(getEventsStmt, 2, *std::max_element(cupIDs.begin(), cupIDs.end()));
+
+    while ((result = sqlite3_step(getEventsStmt)) == SQLITE_ROW)
+    {
+        std::map<int, unsigned int>::iterator cupIndex = cupIndexes.find(sqlite3_column_int(getEventsStmt, 0));
+
+        if (cupIndex == cupIndexes.end() || sqlite3_column_int(getEventsStmt, 13) != 0) //not a cup being replayed, or a farmed kill that no cup counts
+            continue;
+
+        loggedEvent event;
+        std::string flag = (const char*)sqlite3_column_text(getEventsStmt, 4);
+        int team = sqlite3_column_int(getEventsStmt, 5), victimTeam = sqlite3_column_int(getEventsStmt, 6);
+        const char *teamFlag = (flag.size() == 2 && flag[1] == '*') ? strchr(teamFlags, flag[0]) : NULL;
+        int flagTeam = (teamFlag != NULL) ? (teamFlag - teamFlags + 1) : 0;
+
+        event.bzid = sqlite3_column_int64(getEventsStmt, 2);
+        event.victimBZID = sqlite3_column_int64(getEventsStmt, 3);
+        event.cupIndex = cupIndex->second;
+        event.capture = (strcmp((const char*)sqlite3_column_text(getEventsStmt, 1), "Capture") == 0);
+
+        for (int i = 0; i < eFormulaVariableCount; i++)
+            event.variables[i] = sqlite3_column_int(getEventsStmt, 7 + i);
+
+        //the same checks as mofocup::isGenocideHit()
+        event.genocide = !event.capture && flagTeam != 0 && victimTeam != flagTeam && victimTeam != team && !event.variables[eSelfKill];
+
+        eventCount++;
+
+        if (hasPointsCups)
+            partitions[event.bzid % REPLAY_PARTITIONS].push_back(event);
+
+        if (hasRatedCups && !event.capture && !event.variables[eSelfKill] && event.victimBZID != 0) //both players need a rating
+            ratedKills[event.cupIndex].push_back(event);
+    }
+
+    if (result != SQLITE_DONE)
+        lastError = "could not read the event log: " + std::string(sqlite3_errmsg(eventsDb));
+
+    sqlite3_finalize(getEventsStmt);
+    sqlite3_close(eventsDb);
+
+    if (result != SQLITE_DONE)
+        return -1;
+
+    //the player partitions come first, then a task for every rated cup of every CupID
+    std::vector<unsigned int> ratedSlots;
+
+    for (unsigned int i = 0; i < slotCount; i++)
+    {
+        if (replayed[i % cups.size()].hook == eRatingHook && !ratedKills[i / cups.size()].empty())
+            ratedSlots.push_back(i);
+    }
+
+    std::vector<std::vector<std::unordered_map<uint64_t, int> > > partitionPoints(REPLAY_PARTITIONS);
+    std::vector<std::unordered_map<uint64_t, double> > ratings(ratedSlots.size());
+    unsigned int taskCount = REPLAY_PARTITIONS + ratedSlots.size();
+    std::atomic<unsigned int> nextTask(0);
+
+    auto runTasks = [&]()
+    {
+        for (unsigned int task = nextTask++; task < taskCount; task = nextTask++)
+        {
+            if (task < REPLAY_PARTITIONS)
+            {
+                partitionPoints[task].resize(slotCount);
+                scorePartition(partitions[task], replayed, partitionPoints[task]);
+            }
+            else
+            {
+                unsigned int slot = ratedSlots[task - REPLAY_PARTITIONS];
+                rateKills(ratedKills[slot / cups.size()], replayed[slot % cups.size()], ratings[task - REPLAY_PARTITIONS]);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 1; i < threads; i++) //this thread is one of them
+        workers.push_back(std::thread(runTasks));
+
+    runTasks();
+
+    for (unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    //every player is only in one partition, so their totals are added to the standings as they are
+    for (unsigned int i = 0; i < REPLAY_PARTITIONS; i++)
+    {
+        for (unsigned int slot = 0; slot < partitionPoints[i].size(); slot++)
+        {
+            for (std::unordered_map<uint64_t, int>::iterator itr = partitionPoints[i][slot].begin(); itr != partitionPoints[i][slot].end(); ++itr)
+                scores[slot][itr->first] += itr->second;
+        }
+    }
+
+    for (unsigned int i = 0; i < ratedSlots.size(); i++)
+    {
+        for (std::unordered_map<uint64_t, double>::iterator itr = ratings[i].begin(); itr != ratings[i].end(); ++itr)
+            scores[ratedSlots[i]][itr->first] = itr->second;
+    }
+
+    if (!run("SAVEPOINT replayEvents")) //a savepoint so the replay can also be part of a bigger transaction
+        return -1;
+
+    bool success = run("DROP TABLE IF EXISTS `ReplayedStandings`") &&
+        run("CREATE TABLE \"ReplayedStandings\" (\"CupID\" INTEGER NOT NULL, \"CupType\" TEXT NOT NULL, \"Place\" INTEGER NOT NULL, \"BZID\" INTEGER NOT NULL, \"Points\" INTEGER NOT NULL, \"Ratio\" INTEGER NOT NULL, \"PlayingTime\" INTEGER NOT NULL, "
+            "PRIMARY KEY (\"CupID\", \"CupType\", \"Place\")) WITHOUT ROWID");
+
+    sqlite3_stmt *insertStandingStmt = success ? prepare("INSERT INTO `ReplayedStandings` VALUES (?, ?, ?, ?, ?, ?, ?)") : NULL;
+
+    for (unsigned int slot = 0; slot < slotCount && insertStandingStmt != NULL && success; slot++)
+    {
+        unsigned int cupIndex = slot / cups.size(), cup = slot % cups.size();
+        std::vector<mofocupStanding> standings;
+
+        for (std::unordered_map<uint64_t, double>::iterator itr = scores[slot].begin(); itr != scores[slot].end(); ++itr)
+        {
+            mofocupStanding standing;
+
+            standing.bzid = itr->first;
+            standing.playingTime = playingTimes[cupIndex].count(itr->first) ? playingTimes[cupIndex][itr->first] : 0;
+            standing.points = (int)floor(itr->second + 0.5); //a rating is stored as both the points and the ratio
+            standing.ratio = (replayed[cup].hook == eRatingHook) ? standing.points : calculateRatio(standing.points, standing.playingTime);
+
+            standings.push_back(standing);
+        }
+
+        //ranked the way archived cups are, with the BZID settling the ties SQLite would leave to chance
+        std::sort(standings.begin(), standings.end(), [](const mofocupStanding &a, const mofocupStanding &b)
+        {
+            if (a.ratio != b.ratio)
+                return a.ratio > b.ratio;
+
+            if (a.playingTime != b.playingTime)
+                return a.playingTime < b.playingTime;
+
+            return a.bzid < b.bzid;
+        });
+
+        for (unsigned int i = 0; i < standings.size() && success; i++)
+        {
+            sqlite3_bind_int(insertStandingStmt, 1, cupIDs[cupIndex]);
+            sqlite3_bind_text(insertStandingStmt, 2, cups[cup].name.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(insertStandingStmt, 3, i + 1);
+            sqlite3_bind_int64(insertStandingStmt, 4, standings[i].bzid);
+            sqlite3_bind_int(insertStandingStmt, 5, standings[i].points);
+            sqlite3_bind_int(insertStandingStmt, 6, standings[i].ratio);
+            sqlite3_bind_int(insertStandingStmt, 7, standings[i].playingTime);
+
+            success = (sqlite3_step(insertStandingStmt) == SQLITE_DONE);
+
+            if (!success)
+                lastError = sqlite3_errmsg(db);
+
+            sqlite3_reset(insertStandingStmt);
+        }
+    }
+
+    if (insertStandingStmt == NULL || !success || !run("CREATE INDEX \"ReplayedStandingsByPlayer\" ON \"ReplayedStandings\" (\"CupID\", \"CupType\", \"BZID\")"))
+    {
+        run("ROLLBACK TO replayEvents");
+        run("RELEASE replayEvents");
+        return -1;
+    }
+
+    return run("RELEASE replayEvents") ? eventCount : -1;
+}
+
+bool mofocupDatabase::run(std::string sql)
+{
+    /*
+        Run SQL that doesn't return anything we need
+    */
+
+    char *error = NULL;
+
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK)
+    {
+        lastError = (error != NULL) ? error : sqlite3_errmsg(db);
+        sqlite3_free(error);
+        return false;
+    }
+
+    return true;
+}
+
+void mofocupDatabase::use(sqlite3 *connection)
+{
+    /*
+        Work on a connection that someone else opened and will close
+    */
+
+    close();
+
+    db = connection;
+    ownsConnection = false;
+}
+
+scoringFormula::scoringFormula() : builtin(NULL), length(0), position(0), stackDepth(0)
+{
+}
+
+bool scoringFormula::compile(std::string expression, std::string &error)
+{
+    /*
+        Compile a formula into instructions, or explain why it couldn't
+        be compiled
+    */
+
+    source = expression;
+    builtin = NULL;
+    length = 0;
+    position = 0;
+    stackDepth = 0;
+    compileError = "";
+
+    if (parseComparison())
+    {
+        match(""); //skip any trailing whitespace
+
+        if (position < source.size())
+            compileError = "unexpected '" + source.substr(position) + "'";
+    }
+
+    if (compileError.empty() && length == 0)
+        compileError = "the formula is empty";
+
+    std::string spacelessSource; //compare formulas without caring about the spacing
+
+    for (unsigned int i = 0; i < source.size(); i++)
+    {
+        if (!isspace(source[i]))
+            spacelessSource += source[i];
+    }
+
+    for (unsigned int i = 0; i < sizeof(builtinFormulas)/sizeof(builtinFormulaEntry) && compileError.empty(); i++)
+    {
+        std::string builtinSource;
+
+        for (const char* c = builtinFormulas[i].source; *c; c++)
+        {
+            if (!isspace(*c))
+                builtinSource += *c;
+        }
+
+        if (builtinSource == spacelessSource)
+            builtin = builtinFormulas[i].function;
+    }
+
+    error = compileError;
+    return compileError.empty();
+}
+
+int scoringFormula::evaluate(const int *variables) const
+{
+    /*
+        Run the compiled instructions with the values of the current
+        event, or the native version of a default formula. Dividing by
+        zero results in 0.
+    */
+
+    if (builtin != NULL)
+        return builtin(variables);
+
+    int stack[MAX_FORMULA_STACK + 1];
+    int *top = stack; //stack[0] is never used so an empty formula results in 0
+
+    stack[0] = 0;
+
+    for (const formulaInstruction *instruction = code; instruction < code + length; instruction++)
+    {
+        switch (instruction->opcode)
+        {
+            case ePushConstant: *++top = instruction->operand; break;
+            case ePushVariable: *++top = variables[instruction->operand]; break;
+            case eNegate: *top = -*top; break;
+            case eAdd: top--; *top += top[1]; break;
+            case eSubtract: top--; *top -= top[1]; break;
+            case eMultiply: top--; *top *= top[1]; break;
+            case eDivide: top--; *top = (top[1] == 0) ? 0 : *top / top[1]; break;
+            case eModulo: top--; *top = (top[1] == 0) ? 0 : *top % top[1]; break;
+            case eMinimum: top--; *top = (top[1] < *top) ? top[1] : *top; break;
+            case eMaximum: top--; *top = (top[1] > *top) ? top[1] : *top; break;
+            case eLessThan: top--; *top = (*top < top[1]); break;
+            case eLessOrEqual: top--; *top = (*top <= top[1]); break;
+            case eGreaterThan: top--; *top = (*top > top[1]); break;
+            case eGreaterOrEqual: top--; *top = (*top >= top[1]); break;
+            case eEqual: top--; *top = (*top == top[1]); break;
+            case eNotEqual: top--; *top = (*top != top[1]); break;
+        }
+    }
+
+    return *top;
+}
+
+bool scoringFormula::emit(int opcode, int operand)
+{
+    /*
+        Add an instruction to the compiled formula while keeping track
+        of how many values it will need on the stack
+    */
+
+    if (length >= MAX_FORMULA_LENGTH)
+    {
+        compileError = "the formula is too long";
+        return false;
+    }
+
+    if (opcode == ePushConstant || opcode == ePushVariable)
+        stackDepth++;
+    else if (opcode != eNegate)
+        stackDepth--;
+
+    if (stackDepth > MAX_FORMULA_STACK)
+    {
+        compileError = "the formula is nested too deeply";
+        return false;
+    }
+
+    code[length].opcode = opcode;
+    code[length].operand = operand;
+    length++;
+
+    return true;
+}
+
+bool scoringFormula::match(std::string token)
+{
+    /*
+        Skip any whitespace and consume the token if it's next
+    */
+
+    while (position < source.size() && isspace(source[position]))
+        position++;
+
+    if (source.compare(position, token.size(), token) != 0)
+        return false;
+
+    position += token.size();
+    return true;
+}
+
+bool scoringFormula::parseComparison(void)
+{
+    //comparison := sum [ ( "<=" | ">=" | "==" | "!=" | "<" | ">" ) sum ]
+
+    if (!parseSum())
+        return false;
+
+    const char* operators[] = {"<=", ">=", "==", "!=", "<", ">"};
+    const int opcodes[] = {eLessOrEqual, eGreaterOrEqual, eEqual, eNotEqual, eLessThan, eGreaterThan};
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (match(operators[i]))
+            return parseSum() && emit(opcodes[i]);
+    }
+
+    return true;
+}
+
+bool scoringFormula::parseSum(void)
+{
+    //sum := product { ( "+" | "-" ) product }
+
+    if (!parseProduct())
+        return false;
+
+    while (true)
+    {
+        if (match("+"))
+        {
+            if (!parseProduct() || !emit(eAdd))
+                return false;
+        }
+        else if (match("-"))
+        {
+            if (!parseProduct() || !emit(eSubtract))
+                return false;
+        }
+        else
+            return true;
+    }
+}
+
+bool scoringFormula::parseProduct(void)
+{
+    //product := unary { ( "*" | "/" | "%" ) unary }
+
+    if (!parseUnary())
+        return false;
+
+    while (true)
+    {
+        int opcode;
+
+        if (match("*")) opcode = eMultiply;
+        else if (match("/")) opcode = eDivide;
+        else if (match("%")) opcode = eModulo;
+        else return true;
+
+        if (!parseUnary() || !emit(opcode))
+            return false;
+    }
+}
+
+bool scoringFormula::parseUnary(void)
+{
+    //unary := "-" unary | value
+
+    if (match("-"))
+        return parseUnary() && emit(eNegate);
+
+    return parseValue();
+}
+
+bool scoringFormula::parseValue(void)
+{
+    //value := number | variable | ( "min" | "max" ) "(" comparison "," comparison ")" | "(" comparison ")"
+
+    if (match("("))
+    {
+        if (!parseComparison())
+            return false;
+
+        if (!match(")"))
+        {
+            compileError = "missing ')'";
+            return false;
+        }
+
+        return true;
+    }
+
+    if (position < source.size() && isdigit(source[position]))
+    {
+        int value = 0;
+
+        while (position < source.size() && isdigit(source[position]))
+            value = value * 10 + (source[position++] - '0');
+
+        return emit(ePushConstant, value);
+    }
+
+    std::string name;
+
+    while (position < source.size() && (isalpha(source[position]) || source[position] == '_'))
+        name += source[position++];
+
+    if (name == "min" || name == "max")
+    {
+        if (!match("(") || !parseComparison() || !match(",") || !parseComparison() || !match(")"))
+        {
+            if (compileError.empty())
+                compileError = name + "() needs two values: " + name + "(a, b)";
+
+            return false;
+        }
+
+        return emit(name == "min" ? eMinimum : eMaximum);
+    }
+
+    for (int i = 0; i < eFormulaVariableCount; i++)
+    {
+        if (name == formulaVariableNames[i])
+            return emit(ePushVariable, i);
+    }
+
+    if (compileError.empty())
+        compileError = name.empty() ? "expected a number or variable at '" + source.substr(position) + "'" : "unknown variable '" + name + "'";
+
+    return false;
+}
@@ -0,0 +1,320 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+The parts of the MoFo Cup that don't need a BZFlag server: the scoring
+formulas, the configuration file, the database schema and the queries on
+the standings. The plug-in is built on top of it and so are the tools in
+tools/, which link mofocup_core.cpp without bzfsAPI.h.
+*/
+
+#ifndef MOFOCUP_CORE_H
+#define MOFOCUP_CORE_H
+
+#include <map>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define MAX_FORMULA_LENGTH 64 //the most instructions a compiled scoring formula can have
+#define MAX_FORMULA_STACK 16 //the most values a scoring formula can hold at once while being evaluated
+#define STARTING_RATING 1500 //the skill rating every player starts a cup with
+#define EXPORT_CHUNK_SIZE 4096 //the most rows read in one go when a cup is exported
+#define COLUMNAR_MAGIC 0x5843464d //"MFCX", the start of every columnar export
+#define COLUMNAR_VERSION 1 //changes whenever the columnar layout changes
+#define REPLAY_PARTITIONS 64 //the groups of players the event log is split into when cups are scored again
+
+//The standings of a cup that is still being played, used by the plug-in's /cup and /rank as well. ?1 is the cup ID and ?2 the cup type, and
+//every row is the place, BZID, callsign, points, ratio and playing time. The whole standings leave the place at 0 for the reader to number.
+#define LIVE_STANDINGS_QUERY "SELECT 0, `Points`.`BZID`, COALESCE(`Players`.`Callsign`, 'Anonymous'), `Points`.`Points`, `Points`.`Ratio`, COALESCE(`Players`.`PlayingTime`, 0) FROM `Points` LEFT JOIN `Players` ON `Players`.`BZID` = `Points`.`BZID` AND `Players`.`CupID` = `Points`.`CupID` WHERE `Points`.`CupID` = ?1 AND `Points`.`CupType` = ?2 ORDER BY `Points`.`Ratio` DESC, `Players`.`PlayingTime` ASC LIMIT ?3 OFFSET ?4"
+#define LIVE_STANDING_BY_BZID_QUERY "SELECT (SELECT COUNT(*) FROM `Points` AS c2 WHERE c2.CupID = ?1 AND c2.CupType = ?2 AND c2.Ratio > c1.Ratio) + 1, c1.BZID, COALESCE(`Players`.`Callsign`, 'Anonymous'), c1.Points, c1.Ratio, COALESCE(`Players`.`PlayingTime`, 0) FROM `Points` AS c1 LEFT JOIN `Players` ON `Players`.`BZID` = c1.BZID AND `Players`.`CupID` = c1.CupID WHERE c1.CupID = ?1 AND c1.CupType = ?2 AND c1.BZID = ?3"
+#define LIVE_STANDING_BY_CALLSIGN_QUERY "SELECT (SELECT COUNT(*) FROM `Points` AS c2 WHERE c2.CupID = ?1 AND c2.CupType = ?2 AND c2.Ratio > c1.Ratio) + 1, c1.BZID, `Players`.`Callsign`, c1.Points, c1.Ratio, `Players`.`PlayingTime` FROM `Points` AS c1, `Players` WHERE `Players`.`BZID` = c1.BZID AND `Players`.`CupID` = c1.CupID AND c1.CupID = ?1 AND c1.CupType = ?2 AND `Players`.`Callsign` LIKE ?4 LIMIT 1"
+
+//The values a scoring formula can use, filled in by the scoring hooks when an event happens
+enum formulaVariable
+{
+    eCappedTeamSize,  //capped   - the amount of players on the team whose flag was captured
+    eCappingTeamSize, //capping  - the amount of players on the team that captured the flag
+    eVictimBounty,    //bounty   - the amount of kills the player who died had on their turret
+    eFlagCarrierKill, //carrier  - 1 if the player who died was carrying a team flag
+    eGenoVictims,     //victims  - the amount of players killed by a genocide hit
+    eSelfKill,        //selfkill - 1 if the player killed themselves
+    eFormulaVariableCount
+};
+
+/*
+    A scoring formula is written in the configuration file, for example
+
+        8 * (capped - capping) + 3 * capped
+
+    and is compiled once into a short list of stack instructions so it
+    can be evaluated every time a player scores without any parsing or
+    memory allocation. Formulas use integer math and can use the
+    variables above, numbers, parentheses, + - * / %, comparisons
+    (< <= > >= == !=) that result in 1 or 0, min(a, b) and max(a, b).
+*/
+class scoringFormula
+{
+public:
+    scoringFormula();
+
+    typedef int (*builtinFormula)(const int *variables);
+
+    bool compile(std::string expression, std::string &error);
+    int evaluate(const int *variables) const;
+
+    std::string source; //the formula as written in the configuration file
+    builtinFormula builtin; //the native version of the formula when it's one of the default formulas
+
+private:
+    enum formulaOpcode
+    {
+        ePushConstant,
+        ePushVariable,
+        eNegate,
+        eAdd,
+        eSubtract,
+        eMultiply,
+        eDivide,
+        eModulo,
+        eMinimum,
+        eMaximum,
+        eLessThan,
+        eLessOrEqual,
+        eGreaterThan,
+        eGreaterOrEqual,
+        eEqual,
+        eNotEqual
+    };
+
+    struct formulaInstruction
+    {
+        int opcode;
+        int operand;
+    };
+
+    formulaInstruction code[MAX_FORMULA_LENGTH];
+    int length;
+
+    //only used while compiling
+    unsigned int position;
+    int stackDepth;
+    std::string compileError;
+
+    bool emit(int opcode, int operand = 0);
+    bool match(std::string token);
+    bool parseComparison(void);
+    bool parseSum(void);
+    bool parseProduct(void);
+    bool parseUnary(void);
+    bool parseValue(void);
+};
+
+//A cup as it's set up in the configuration file, before its hook and formula are checked
+struct cupSettings
+{
+    std::string name; //the `CupType` used in the database
+    std::string alias; //the parameter used with /cup
+    std::string hookName; //the name of the scoring hook
+    std::string flushPolicy; //deferred or immediate
+    int topN; //the amount of players shown on the leader board
+    std::string formula; //empty for the default formula of the scoring hook
+};
+
+/*
+    The configuration file. Settings are grouped in sections and
+    comments start with a '#' or ';'
+
+        [Section]
+        key = value
+
+    Keys are case insensitive, section names aren't.
+*/
+class mofocupConfig
+{
+public:
+    bool load(std::string filename, std::vector<std::string> &ignoredLines);
+    std::vector<cupSettings> getCups(void) const;
+    std::string getValue(std::string section, std::string key, std::string defaultValue) const;
+
+private:
+    //the settings of a section, kept in the order they were written
+    struct configSection
+    {
+        std::string name;
+        std::map<std::string, std::string> settings;
+    };
+    std::vector<configSection> sections;
+};
+
+//A player's place in a cup, with everything the database has on them
+struct mofocupStanding
+{
+    int place;
+    uint64_t bzid;
+    std::string callsign;
+    int points;
+    int ratio; //what the player is ranked by, their rating in rated cups
+    int playingTime; //seconds
+};
+
+/*
+    Somewhere to write the rows of an exported cup. The rows of a cup are
+    read in chunks and endChunk() is called after each chunk, so a writer
+    never has to hold more than a chunk in memory.
+*/
+class mofocupExportWriter
+{
+public:
+    virtual ~mofocupExportWriter() {}
+
+    virtual bool endChunk(void) = 0;
+    virtual bool finish(void) = 0;
+    virtual bool writeRow(int cupID, const std::string &cupType, const mofocupStanding &standing) = 0;
+};
+
+//Every row as a line of CSV with a header line first
+class csvExportWriter : public mofocupExportWriter
+{
+public:
+    csvExportWriter(FILE *output);
+
+    virtual bool endChunk(void);
+    virtual bool finish(void);
+    virtual bool writeRow(int cupID, const std::string &cupType, const mofocupStanding &standing);
+
+private:
+    FILE *file;
+    bool headerWritten;
+};
+
+/*
+    The rows stored a column at a time, one row group for every chunk, so
+    a column can be read without going through the others and repeated
+    values take next to no space. All fixed size numbers are little
+    endian.
+
+        uint32 magic, version, column count
+        for each column: uint8 type (0 integer, 1 text), uint8 name length, name
+        for each row group:
+            uint32 row count
+            for each column: uint32 byte length, then the values
+                integer: each value as a zigzag varint of the difference from the value before it, the first from 0
+                text: varint dictionary size, each entry as a varint length and its bytes, then each row's varint dictionary index
+        uint32 0, the end of the file
+
+    The columns are CupID, CupType, Place, BZID, Callsign, Points, Ratio
+    and PlayingTime.
+*/
+class columnarExportWriter : public mofocupExportWriter
+{
+public:
+    columnarExportWriter(FILE *output);
+
+    virtual bool endChunk(void);
+    virtual bool finish(void);
+    virtual bool writeRow(int cupID, const std::string &cupType, const mofocupStanding &standing);
+
+private:
+    enum columnarColumn
+    {
+        eCupIDColumn,
+        eCupTypeColumn,
+        ePlaceColumn,
+        eBZIDColumn,
+        eCallsignColumn,
+        ePointsColumn,
+        eRatioColumn,
+        ePlayingTimeColumn,
+        eColumnCount
+    };
+
+    FILE *file;
+    bool headerWritten;
+    unsigned int rowCount; //rows waiting in the current row group
+    std::vector<int64_t> integers[eColumnCount]; //the integer columns of the current row group
+    std::vector<std::string> texts[eColumnCount]; //the text columns of the current row group
+
+    bool writeBlock(const std::string &block);
+    bool writeHeader(void);
+};
+
+/*
+    The MoFo Cup database. It either opens its own connection or works on
+    a connection that's already open, like the plug-in's. The statements
+    it runs are prepared once and kept until the database is closed, and
+    whenever something fails the reason is left in lastError.
+
+    Finished cups live in the `archive` database attached to the
+    connection, every other cup in the main database.
+*/
+class mofocupDatabase
+{
+public:
+    mofocupDatabase();
+    ~mofocupDatabase();
+
+    //called with every standing in order, return false to stop
+    typedef bool (*standingCallback)(const mofocupStanding &standing, void *data);
+
+    bool archiveCup(int cupID);
+    bool attachArchive(std::string filename);
+    void close(void);
+    bool compact(void);
+    bool createSchema(void);
+    bool exportCup(int cupID, std::string cupType, mofocupExportWriter &writer, int chunkSize = EXPORT_CHUNK_SIZE);
+    bool forEachStanding(std::string cupType, int cupID, int limit, standingCallback callback, void *data);
+    std::vector<std::string> getCupTypes(int cupID);
+    std::vector<int> getFinishedCups(std::string serverID);
+    int getLatestCup(std::string serverID);
+    bool getStanding(std::string cupType, int cupID, uint64_t bzid, std::string callsign, mofocupStanding &standing);
+    bool isArchived(int cupID);
+    bool open(std::string filename, bool readOnly);
+    sqlite3_stmt* prepare(std::string sql);
+    int recomputeRatios(std::string cupType, int cupID);
+    int replayEvents(std::string eventsFilename, const std::vector<int> &cupIDs, const std::vector<cupSettings> &cups, unsigned int threads);
+    bool run(std::string sql);
+    void use(sqlite3 *connection);
+
+    sqlite3 *db; //NULL until the database is opened
+    std::string lastError;
+
+private:
+    bool ownsConnection; //false when working on someone else's connection, which is left open
+    std::map<std::string, sqlite3_stmt*> statements; //by their SQL
+};
+
+int calculateRatio(int points, int playingTime);
+double calculateRatingChange(double killerRating, double victimRating, int kFactor);
+std::string getDefaultFormula(std::string hookName);
+
+#endif
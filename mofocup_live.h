@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+The layout of the shared memory segment the MoFo Cup plugin publishes its
+live stats to. External tools on the same host can map the segment read
+only and take a consistent copy with mofocupReadLiveStats() without any
+system calls or locks.
+
+    int fd = shm_open("/mofocup", O_RDONLY, 0);
+    const struct mofocupLiveStats *live = mmap(NULL, sizeof(struct mofocupLiveStats), PROT_READ, MAP_SHARED, fd, 0);
+    struct mofocupLiveStats snapshot;
+
+    if (mofocupReadLiveStats(live, &snapshot))
+        ...
+
+This header is plain C so it can be used from anything that can include a
+C header.
+*/
+
+#ifndef MOFOCUP_LIVE_H
+#define MOFOCUP_LIVE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MOFOCUP_LIVE_MAGIC 0x4d6f466f //"MoFo"
+#define MOFOCUP_LIVE_VERSION 2 //changes whenever the layout below changes
+#define MOFOCUP_LIVE_MAX_PLAYERS 256
+#define MOFOCUP_LIVE_MAX_CUPS 16
+#define MOFOCUP_LIVE_MAX_TOP 16
+#define MOFOCUP_LIVE_NAME_LENGTH 32
+
+//a player on the server, indexed by their player slot
+struct mofocupLivePlayer
+{
+    uint64_t bzid; //0 if the slot is empty or the player isn't registered
+    char callsign[MOFOCUP_LIVE_NAME_LENGTH];
+    int32_t team; //a bz_eTeamType
+    int32_t bounty; //the kills the player has on their turret
+    int32_t pendingPoints[MOFOCUP_LIVE_MAX_CUPS]; //points earned in each cup that haven't been written to the database yet
+    int32_t ratings[MOFOCUP_LIVE_MAX_CUPS]; //the live skill rating in each rated cup, 0 for other cups
+    int32_t places[MOFOCUP_LIVE_MAX_CUPS]; //the player's place in each cup as of the last database update, 0 if they don't have one yet
+    int32_t scores[MOFOCUP_LIVE_MAX_CUPS]; //the score the player was ranked by in each cup as of the last database update
+};
+
+//a place on a cup's leader board
+struct mofocupLiveStanding
+{
+    uint64_t bzid;
+    char callsign[MOFOCUP_LIVE_NAME_LENGTH];
+    int32_t score;
+    int32_t reserved;
+};
+
+//a cup and its top players as of the last database update
+struct mofocupLiveCup
+{
+    char name[MOFOCUP_LIVE_NAME_LENGTH];
+    char alias[MOFOCUP_LIVE_NAME_LENGTH];
+    int32_t rated; //1 if the cup ranks players by a skill rating
+    int32_t topCount;
+    struct mofocupLiveStanding top[MOFOCUP_LIVE_MAX_TOP];
+};
+
+struct mofocupLiveStats
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence; //odd while the plugin is writing, bumped twice for every update
+    uint32_t cupCount;
+    int64_t cupID; //the cup being played
+    double updated; //when the stats were last published, in seconds since the epoch
+    struct mofocupLiveCup cups[MOFOCUP_LIVE_MAX_CUPS];
+    struct mofocupLivePlayer players[MOFOCUP_LIVE_MAX_PLAYERS];
+};
+
+//Copy the live stats into snapshot, retrying while the plugin is in the middle of an update. Returns 0 if the segment isn't one we understand.
+static inline int mofocupReadLiveStats(const struct mofocupLiveStats *live, struct mofocupLiveStats *snapshot)
+{
+    uint32_t before, after;
+
+    if (live->magic != MOFOCUP_LIVE_MAGIC || live->version != MOFOCUP_LIVE_VERSION)
+        return 0;
+
+    do
+    {
+        before = __atomic_load_n(&live->sequence, __ATOMIC_ACQUIRE);
+
+        if (before & 1) //an update is being written
+            continue;
+
+        memcpy(snapshot, (const void*)live, sizeof(struct mofocupLiveStats));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&live->sequence, __ATOMIC_RELAXED);
+    }
+    while ((before & 1) || before != after);
+
+    return 1;
+}
+
+#endif
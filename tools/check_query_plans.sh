@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Builds the load generator and loads the plug-in with queryPlans = strict,
+# so the check fails as soon as a statement run on every event or database
+# update would scan a whole table or sort in a temporary B-tree. The slow
+# plans are logged before the plug-in unloads itself.
+#
+#     tools/check_query_plans.sh
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+workDirectory=$(mktemp -d)
+trap 'rm -rf "$workDirectory"' EXIT
+
+g++ -std=c++11 -O2 -I. tools/mofocup_loadgen.cpp mofocup.cpp mofocup_core.cpp -lsqlite3 -lpthread -o "$workDirectory/mofocup-loadgen"
+
+if ! "$workDirectory/mofocup-loadgen" -p 10 -H 0.1 -c tools/strict.cfg -d "$workDirectory"; then
+    echo "query plan check failed, see the warnings above" >&2
+    exit 1
+fi
@@ -0,0 +1,520 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+An offline administration tool for the MoFo Cup database. It's built on
+the same core as the plug-in, without bzfsAPI.h, so the standings can be
+looked at and the database looked after without a server or any hand
+written SQL.
+
+    g++ -std=c++11 -O2 -I. tools/mofocup_admin.cpp mofocup_core.cpp -lsqlite3 -lpthread -o mofocup-admin
+    ./mofocup-admin mofocup.sqlite top ctf
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "mofocup_core.h"
+
+//What the command line asked for
+struct adminOptions
+{
+    std::string databaseFile, archiveFile, configFile, eventsFile;
+    std::string serverID; //only look at the cups of this server, every server if it's empty
+    std::string cupID; //a CupID, "all" or empty for the latest cup
+    int count; //how many places to show, 0 for the cup's own top
+    std::string format; //what export writes: csv or columnar
+    std::string outputFile; //where export writes to, standard output if it's empty
+    unsigned int threads; //how many threads replay scores the event log on
+};
+
+static bool printStanding(const mofocupStanding &standing, void *)
+{
+    /*
+        Print a place on the leader board the way /cup does
+    */
+
+    std::string place = "#" + std::to_string(standing.place);
+
+    printf("%-8s%-28.26s%i\n", place.c_str(), standing.callsign.c_str(), standing.ratio);
+    return true;
+}
+
+static const cupSettings* findCup(const std::vector<cupSettings> &cups, std::string name)
+{
+    /*
+        Find a cup by its name or by its /cup alias
+    */
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        if (strcasecmp(cups[i].name.c_str(), name.c_str()) == 0 || strcasecmp(cups[i].alias.c_str(), name.c_str()) == 0)
+            return &cups[i];
+    }
+
+    return NULL;
+}
+
+static std::vector<int> getCups(mofocupDatabase &database, const adminOptions &options)
+{
+    /*
+        The cups a command works on: the one given with -C, every cup
+        with -C all or the latest cup
+    */
+
+    std::vector<int> cupIDs;
+
+    if (options.cupID == "all")
+    {
+        sqlite3_stmt *getCupsStmt = database.prepare("SELECT `CupID` FROM `Cups` WHERE (?1 = '' OR `ServerID` = ?1) ORDER BY `StartTime`, `CupID`");
+
+        if (getCupsStmt == NULL)
+            return cupIDs;
+
+        sqlite3_bind_text(getCupsStmt, 1, options.serverID.c_str(), -1, SQLITE_TRANSIENT);
+
+        while (sqlite3_step(getCupsStmt) == SQLITE_ROW)
+            cupIDs.push_back(sqlite3_column_int(getCupsStmt, 0));
+
+        sqlite3_reset(getCupsStmt);
+    }
+    else if (!options.cupID.empty())
+        cupIDs.push_back(atoi(options.cupID.c_str()));
+    else if (database.getLatestCup(options.serverID) > 0)
+        cupIDs.push_back(database.getLatestCup(options.serverID));
+
+    return cupIDs;
+}
+
+static int fail(std::string message)
+{
+    fprintf(stderr, "mofocup-admin: %s\n", message.c_str());
+    return 1;
+}
+
+static int archiveCups(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments)
+{
+    /*
+        archive [CupID...]
+
+        Move cups to the archive, by default every cup that has ended.
+        All of them are moved in one transaction, so either every cup
+        is archived or none of them are.
+    */
+
+    std::vector<int> cupIDs;
+
+    for (unsigned int i = 0; i < arguments.size(); i++)
+        cupIDs.push_back(atoi(arguments[i].c_str()));
+
+    if (arguments.empty())
+        cupIDs = database.getFinishedCups(options.serverID);
+
+    if (!database.run("BEGIN IMMEDIATE"))
+        return fail("could not start a transaction: " + database.lastError);
+
+    for (unsigned int i = 0; i < cupIDs.size(); i++)
+    {
+        if (database.isArchived(cupIDs[i]))
+        {
+            database.run("ROLLBACK");
+            return fail("cup #" + std::to_string(cupIDs[i]) + " has already been archived");
+        }
+
+        if (!database.archiveCup(cupIDs[i]))
+        {
+            database.run("ROLLBACK");
+            return fail("could not archive cup #" + std::to_string(cupIDs[i]) + ": " + database.lastError);
+        }
+    }
+
+    if (!database.run("COMMIT"))
+        return fail("could not archive the cups: " + database.lastError);
+
+    printf("%lu cups archived\n", (unsigned long)cupIDs.size());
+    return 0;
+}
+
+static int compactDatabase(mofocupDatabase &database, const adminOptions &, const std::vector<std::string> &)
+{
+    /*
+        compact
+
+        Give the space left behind by archived cups back to the file
+        system. The database is locked while it's rewritten, so this is
+        best done while the server is down.
+    */
+
+    if (!database.compact())
+        return fail("could not compact the database: " + database.lastError);
+
+    return 0;
+}
+
+static int exportStandings(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments, const std::vector<cupSettings> &cups)
+{
+    /*
+        export [cup...]
+
+        Write every row of every cup type, or of the cups given, as CSV
+        or in the columnar format described in mofocup_core.h. The rows
+        are read and written a chunk at a time, see
+        mofocupDatabase::exportCup().
+    */
+
+    if (options.format != "csv" && options.format != "columnar")
+        return fail("unknown export format '" + options.format + "', use csv or columnar");
+
+    FILE *output = options.outputFile.empty() ? stdout : fopen(options.outputFile.c_str(), "wb");
+
+    if (output == NULL)
+        return fail("could not write to " + options.outputFile);
+
+    csvExportWriter csvWriter(output);
+    columnarExportWriter columnarWriter(output);
+    mofocupExportWriter &writer = (options.format == "csv") ? (mofocupExportWriter&)csvWriter : (mofocupExportWriter&)columnarWriter;
+
+    std::vector<std::string> cupTypes; //every cup type if it's empty
+
+    for (unsigned int i = 0; i < arguments.size(); i++)
+    {
+        const cupSettings *cup = findCup(cups, arguments[i]);
+        cupTypes.push_back(cup != NULL ? cup->name : arguments[i]);
+    }
+
+    if (cupTypes.empty())
+        cupTypes.push_back("");
+
+    std::vector<int> cupIDs = getCups(database, options);
+    int result = 0;
+
+    for (unsigned int i = 0; i < cupIDs.size() && result == 0; i++)
+    {
+        for (unsigned int j = 0; j < cupTypes.size() && result == 0; j++)
+        {
+            if (!database.exportCup(cupIDs[i], cupTypes[j], writer))
+                result = fail("could not export cup #" + std::to_string(cupIDs[i]) + ": " + database.lastError);
+        }
+    }
+
+    if (result == 0 && !writer.finish())
+        result = fail("could not write the export");
+
+    if (output != stdout && fclose(output) != 0 && result == 0)
+        result = fail("could not write to " + options.outputFile);
+
+    return result;
+}
+
+static int rankPlayer(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments, const std::vector<cupSettings> &cups)
+{
+    /*
+        rank <cup> <BZID or callsign>
+
+        Show a player's place in a cup the way /rank does
+    */
+
+    if (arguments.size() != 2)
+        return fail("rank needs a cup and a BZID or callsign");
+
+    const cupSettings *cup = findCup(cups, arguments[0]);
+    std::string cupType = (cup != NULL) ? cup->name : arguments[0];
+    std::vector<int> cupIDs = getCups(database, options);
+    bool isBZID = (arguments[1].find_first_not_of("0123456789") == std::string::npos);
+
+    for (unsigned int i = 0; i < cupIDs.size(); i++)
+    {
+        mofocupStanding standing;
+
+        if (!database.getStanding(cupType, cupIDs[i], isBZID ? strtoull(arguments[1].c_str(), NULL, 10) : 0, arguments[1], standing))
+        {
+            printf("cup #%i: %s isn't in the %s Cup\n", cupIDs[i], arguments[1].c_str(), cupType.c_str());
+            continue;
+        }
+
+        printf("cup #%i: %s (%llu) is #%i in the %s Cup with a score of %i, %i points in %i seconds played\n", cupIDs[i], standing.callsign.c_str(),
+               (unsigned long long)standing.bzid, standing.place, cupType.c_str(), standing.ratio, standing.points, standing.playingTime);
+    }
+
+    return 0;
+}
+
+static int recomputeRatios(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments, const std::vector<cupSettings> &cups)
+{
+    /*
+        recompute [cup...]
+
+        Work out the ratios of every cup that isn't rated, or of the
+        cups given, again from the points and playing time stored with
+        them. Every cup is updated in one transaction.
+    */
+
+    std::vector<const cupSettings*> recomputed;
+
+    for (unsigned int i = 0; i < cups.size(); i++)
+    {
+        bool wanted = arguments.empty();
+
+        for (unsigned int j = 0; j < arguments.size(); j++)
+            wanted = wanted || (findCup(cups, arguments[j]) == &cups[i]);
+
+        if (wanted && cups[i].hookName != "rating") //a rating isn't worked out from the points
+            recomputed.push_back(&cups[i]);
+    }
+
+    for (unsigned int i = 0; i < arguments.size(); i++)
+    {
+        const cupSettings *cup = findCup(cups, arguments[i]);
+
+        if (cup == NULL)
+            return fail("there is no " + arguments[i] + " cup, cups other than the defaults need the configuration file given with -c");
+
+        if (cup->hookName == "rating")
+            return fail("the " + cup->name + " Cup is rated and has no ratio to recompute");
+    }
+
+    std::vector<int> cupIDs = getCups(database, options);
+
+    if (!database.run("BEGIN IMMEDIATE"))
+        return fail("could not start a transaction: " + database.lastError);
+
+    for (unsigned int i = 0; i < cupIDs.size(); i++)
+    {
+        if (options.cupID == "all" && database.isArchived(cupIDs[i])) //archived cups are final, only complain when one was asked for
+            continue;
+
+        for (unsigned int j = 0; j < recomputed.size(); j++)
+        {
+            int changed = database.recomputeRatios(recomputed[j]->name, cupIDs[i]);
+
+            if (changed < 0)
+            {
+                database.run("ROLLBACK");
+                return fail("could not recompute the " + recomputed[j]->name + " Cup of cup #" + std::to_string(cupIDs[i]) + ": " + database.lastError);
+            }
+
+            printf("cup #%i: %i %s ratios changed\n", cupIDs[i], changed, recomputed[j]->name.c_str());
+        }
+    }
+
+    if (!database.run("COMMIT"))
+        return fail("could not save the ratios: " + database.lastError);
+
+    return 0;
+}
+
+static int replayEvents(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments, const std::vector<cupSettings> &cups)
+{
+    /*
+        replay [cup...]
+
+        Score every cup, or the cups given, again from the event log with
+        the formulas they have now and write the standings they end up
+        with to ReplayedStandings, see mofocupDatabase::replayEvents().
+        The standings the server shows aren't touched.
+    */
+
+    std::vector<cupSettings> replayed;
+
+    for (unsigned int i = 0; i < arguments.size(); i++)
+    {
+        const cupSettings *cup = findCup(cups, arguments[i]);
+
+        if (cup == NULL)
+            return fail("there is no " + arguments[i] + " cup, cups other than the defaults need the configuration file given with -c");
+
+        replayed.push_back(*cup);
+    }
+
+    if (arguments.empty())
+        replayed = cups;
+
+    if (access(options.eventsFile.c_str(), F_OK) != 0)
+        return fail("there is no event log at " + options.eventsFile);
+
+    std::vector<int> cupIDs = getCups(database, options);
+    time_t started = time(NULL);
+
+    if (!database.run("BEGIN IMMEDIATE"))
+        return fail("could not start a transaction: " + database.lastError);
+
+    int eventCount = database.replayEvents(options.eventsFile, cupIDs, replayed, options.threads);
+
+    if (eventCount < 0)
+    {
+        database.run("ROLLBACK");
+        return fail("could not replay the event log: " + database.lastError);
+    }
+
+    if (!database.run("COMMIT"))
+        return fail("could not save the replayed standings: " + database.lastError);
+
+    printf("%i events of %lu cups replayed on %u threads into ReplayedStandings in %li seconds\n", eventCount, (unsigned long)cupIDs.size(), options.threads, (long)(time(NULL) - started));
+    return 0;
+}
+
+static int showTopPlayers(mofocupDatabase &database, const adminOptions &options, const std::vector<std::string> &arguments, const std::vector<cupSettings> &cups)
+{
+    /*
+        top <cup>
+
+        Show the top of a cup the way /cup does, as many places as the
+        cup shows on the server unless -n is given
+    */
+
+    if (arguments.size() != 1)
+        return fail("top needs a cup");
+
+    const cupSettings *cup = findCup(cups, arguments[0]);
+    std::string cupType = (cup != NULL) ? cup->name : arguments[0];
+    int count = (options.count != 0) ? options.count : (cup != NULL ? cup->topN : 5);
+    std::vector<int> cupIDs = getCups(database, options);
+
+    for (unsigned int i = 0; i < cupIDs.size(); i++)
+    {
+        printf("Planet MoFo %s Cup (cup #%i%s)\n", cupType.c_str(), cupIDs[i], database.isArchived(cupIDs[i]) ? ", archived" : "");
+        printf("--------------------\n");
+        printf("        Callsign                    Points\n");
+
+        if (!database.forEachStanding(cupType, cupIDs[i], count, &printStanding, NULL))
+            return fail("could not read the standings: " + database.lastError);
+
+        printf("\n");
+    }
+
+    return 0;
+}
+
+static void showUsage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-a archive] [-c config] [-C CupID | all] [-S server] [-n places] [-f csv | columnar] [-o file] [-e events] [-j threads] database command [arguments]\n\n", program);
+    fprintf(stderr, "  top <cup>                  the top players of a cup\n");
+    fprintf(stderr, "  rank <cup> <BZID|callsign> a player's place in a cup\n");
+    fprintf(stderr, "  recompute [cup...]         work out the ratios of the cups that aren't rated again\n");
+    fprintf(stderr, "  archive [CupID...]         move cups to the archive, by default every cup that has ended\n");
+    fprintf(stderr, "  compact                    give the space left by archived cups back to the file system\n");
+    fprintf(stderr, "  export [cup...]            write every row of the cups as CSV or in the columnar format (-f) to a file (-o)\n");
+    fprintf(stderr, "  replay [cup...]            score the cups again from the event log (-e) into ReplayedStandings\n\n");
+    fprintf(stderr, "cups are named by their name or /cup alias, the commands work on the latest cup unless -C is given\n");
+}
+
+int main(int argc, char **argv)
+{
+    adminOptions options;
+    options.count = 0;
+    options.format = "csv";
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int option;
+
+    while ((option = getopt(argc, argv, "+a:c:C:S:n:f:o:e:j:h")) != -1)
+    {
+        switch (option)
+        {
+            case 'a': options.archiveFile = optarg; break;
+            case 'c': options.configFile = optarg; break;
+            case 'C': options.cupID = optarg; break;
+            case 'S': options.serverID = optarg; break;
+            case 'n': options.count = atoi(optarg); break;
+            case 'f': options.format = optarg; break;
+            case 'o': options.outputFile = optarg; break;
+            case 'e': options.eventsFile = optarg; break;
+            case 'j': options.threads = std::max(1, atoi(optarg)); break;
+            default: showUsage(argv[0]); return 1;
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        showUsage(argv[0]);
+        return 1;
+    }
+
+    options.databaseFile = argv[optind];
+
+    std::string command = argv[optind + 1];
+    std::vector<std::string> arguments(argv + optind + 2, argv + argc);
+
+    //the cups are registered the same way the plug-in registers them, so a configuration file is only needed for cups other than the defaults
+    mofocupConfig config;
+    std::vector<std::string> ignoredLines;
+
+    if (!config.load(options.configFile, ignoredLines))
+        return fail("could not read the configuration file " + options.configFile);
+
+    std::vector<cupSettings> cups = config.getCups();
+
+    if (options.archiveFile.empty())
+        options.archiveFile = config.getValue("MoFoCup", "archive", options.databaseFile + ".archive");
+
+    if (options.eventsFile.empty())
+        options.eventsFile = config.getValue("MoFoCup", "events", options.databaseFile + ".events");
+
+    bool readOnly = (command == "top" || command == "rank" || command == "export");
+    mofocupDatabase database;
+
+    if (access(options.databaseFile.c_str(), F_OK) != 0)
+        return fail("there is no database at " + options.databaseFile);
+
+    if (!database.open(options.databaseFile, readOnly))
+        return fail("could not open " + options.databaseFile + ": " + database.lastError);
+
+    if (!database.attachArchive(options.archiveFile) && !readOnly) //without an archive to read, every cup is looked for in the main database
+        return fail("could not open the archive " + options.archiveFile + ": " + database.lastError);
+
+    if (!readOnly && !database.createSchema())
+        return fail("could not create the tables: " + database.lastError);
+
+    if (command == "top")
+        return showTopPlayers(database, options, arguments, cups);
+    else if (command == "rank")
+        return rankPlayer(database, options, arguments, cups);
+    else if (command == "recompute")
+        return recomputeRatios(database, options, arguments, cups);
+    else if (command == "archive")
+        return archiveCups(database, options, arguments);
+    else if (command == "compact")
+        return compactDatabase(database, options, arguments);
+    else if (command == "export")
+        return exportStandings(database, options, arguments, cups);
+    else if (command == "replay")
+        return replayEvents(database, options, arguments, cups);
+
+    showUsage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+A microbenchmark of the scoring formulas. It scores the same made up
+events with the formulas as they used to be written into the plugin, with
+the native versions of the default formulas, with the compiled
+instructions and by parsing the formula again for every event, which is
+what an interpreter that isn't compiled once would cost. Every way has to
+award the same points or the benchmark fails.
+
+    g++ -std=c++11 -O2 -I. tools/mofocup_formulabench.cpp mofocup_core.cpp -lsqlite3 -lpthread -o mofocup-formulabench
+    ./mofocup-formulabench -e 4096 -r 2000
+*/
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "mofocup_core.h"
+
+//The event variables of one made up kill or capture
+struct benchEvent
+{
+    int variables[eFormulaVariableCount];
+};
+
+//The capture formula as it used to be written into the plugin
+static int hardcodedCapture(const int *variables)
+{
+    return 8 * (variables[eCappedTeamSize] - variables[eCappingTeamSize]) + 3 * variables[eCappedTeamSize];
+}
+
+//The bounty formula as it used to be written into the plugin, with its rampage levels
+static int hardcodedBounty(const int *variables)
+{
+    static const int rampage[8] = {0, 6, 12, 18, 24, 30, 36, 999};
+    int rampageScore = 0;
+
+    if (variables[eVictimBounty] > 0)
+    {
+        for (int i = 0; i < 7; i++)
+        {
+            if (variables[eVictimBounty] >= rampage[i] && variables[eVictimBounty] < rampage[i + 1])
+                rampageScore = 2 * i;
+        }
+    }
+
+    return rampageScore + 2 * variables[eFlagCarrierKill];
+}
+
+static void showUsage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-e events] [-r rounds] [-s seed]\n", program);
+    fprintf(stderr, "  -e  the amount of made up events scored in each round (4096)\n");
+    fprintf(stderr, "  -r  how many times the events are scored (2000), parsing every event only does a tenth as many\n");
+    fprintf(stderr, "  -s  the seed of the made up events (1)\n");
+}
+
+//How many nanoseconds scoring an event takes on average, adding the points awarded to total
+template <typename scorer>
+static double timeScoring(const std::vector<benchEvent> &events, int rounds, scorer score, long long &total)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    total = 0;
+
+    for (int round = 0; round < rounds; round++)
+    {
+        for (unsigned int i = 0; i < events.size(); i++)
+            total += score(events[i].variables);
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count() / ((double)rounds * events.size());
+}
+
+int main(int argc, char **argv)
+{
+    int eventCount = 4096, rounds = 2000;
+    unsigned int seed = 1;
+    int option;
+
+    while ((option = getopt(argc, argv, "e:r:s:h")) != -1)
+    {
+        switch (option)
+        {
+            case 'e': eventCount = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            default: showUsage(argv[0]); return 1;
+        }
+    }
+
+    if (eventCount < 1 || rounds < 10)
+    {
+        showUsage(argv[0]);
+        return 1;
+    }
+
+    std::vector<benchEvent> events(eventCount);
+
+    srand(seed);
+
+    for (int i = 0; i < eventCount; i++) //the sort of values the scoring hooks see on a busy server
+    {
+        events[i].variables[eCappedTeamSize] = rand() % 16;
+        events[i].variables[eCappingTeamSize] = rand() % 16;
+        events[i].variables[eVictimBounty] = (rand() % 4 == 0) ? rand() % 50 : 0;
+        events[i].variables[eFlagCarrierKill] = (rand() % 10 == 0);
+        events[i].variables[eGenoVictims] = rand() % 12;
+        events[i].variables[eSelfKill] = 0;
+    }
+
+    struct benchFormula
+    {
+        const char *hookName;
+        int (*hardcoded)(const int *variables);
+    };
+    const benchFormula formulas[] = {{"ctf", &hardcodedCapture}, {"bounty", &hardcodedBounty}};
+    bool matched = true;
+
+    printf("%i events, %i rounds, nanoseconds per event\n\n", eventCount, rounds);
+    printf("%-8s %10s %10s %10s %10s\n", "formula", "hardcoded", "native", "compiled", "parsed");
+
+    for (unsigned int i = 0; i < sizeof(formulas) / sizeof(formulas[0]); i++)
+    {
+        std::string source = getDefaultFormula(formulas[i].hookName), error;
+        scoringFormula native, compiled;
+
+        if (!native.compile(source, error) || !compiled.compile(source, error))
+        {
+            fprintf(stderr, "%s: could not compile '%s': %s\n", argv[0], source.c_str(), error.c_str());
+            return 1;
+        }
+
+        compiled.builtin = NULL; //run the instructions even though there's a native version
+
+        int (*hardcoded)(const int *variables) = formulas[i].hardcoded;
+        long long hardcodedTotal, nativeTotal, compiledTotal, parsedTotal;
+        double hardcodedTime = timeScoring(events, rounds, [hardcoded](const int *variables) { return hardcoded(variables); }, hardcodedTotal);
+        double nativeTime = timeScoring(events, rounds, [&native](const int *variables) { return native.evaluate(variables); }, nativeTotal);
+        double compiledTime = timeScoring(events, rounds, [&compiled](const int *variables) { return compiled.evaluate(variables); }, compiledTotal);
+        double parsedTime = timeScoring(events, rounds / 10, [&source](const int *variables)
+        {
+            scoringFormula parsed;
+            std::string parseError;
+
+            parsed.compile(source, parseError);
+            parsed.builtin = NULL;
+            return parsed.evaluate(variables);
+        }, parsedTotal);
+
+        if (nativeTotal != hardcodedTotal || compiledTotal != hardcodedTotal || parsedTotal * 10 != hardcodedTotal)
+        {
+            fprintf(stderr, "%s: '%s' awarded different points: %lld hardcoded, %lld native, %lld compiled, %lld parsed\n", argv[0], source.c_str(),
+                    hardcodedTotal, nativeTotal, compiledTotal, parsedTotal * 10);
+            matched = false;
+        }
+
+        printf("%-8s %10.2f %10.2f %10.2f %10.2f\n", formulas[i].hookName, hardcodedTime, nativeTime, compiledTime, parsedTime);
+    }
+
+    return matched ? 0 : 1;
+}
@@ -0,0 +1,673 @@
+/*
+Copyright (c) 2013 Vladimir Jimenez, Ned Anderson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author:
+Vlad Jimenez (allejo)
+Ned Anderson (mdskpr)
+
+Description:
+A load generator for the MoFo Cup plugin. It links the plugin against a
+stand-in for the parts of the bzfs API the plugin uses, fills a server with
+simulated players who join, leave, pause, kill and capture at realistic
+rates over hours of virtual time, and reports how long the plugin held up
+each server tick. Run it for a few server sizes to find the size at which
+the plugin starts to cause visible stalls.
+
+    g++ -std=c++11 -O2 -I. tools/mofocup_loadgen.cpp mofocup.cpp mofocup_core.cpp -lsqlite3 -lpthread -o mofocup-loadgen
+    ./mofocup-loadgen -p 50,100,150,200 -H 2
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <sqlite3.h>
+
+#include "bzfsAPI.h"
+#include "mofocup_core.h"
+
+extern "C" bz_Plugin* bz_GetPlugin(void);
+extern "C" void bz_FreePlugin(bz_Plugin* plugin);
+
+#define FLUSH_INTERVAL 300 //how often the plugin updates the database, in seconds
+
+/*
+    A stand-in for bzfs
+    -------------------
+
+    Only what the plugin calls is here. The clock is the simulation's
+    virtual clock, messages are counted and thrown away and every player
+    has every permission.
+*/
+
+struct simulatedPlayer
+{
+    std::string callsign, bzid;
+    bz_eTeamType team;
+    int identity; //which of the simulated players it is
+};
+
+static double virtualTime = 0; //what bz_getCurrentTime() returns
+static int debugLevel = 0; //debug messages at or under this level are printed
+static unsigned long messagesSent = 0;
+static bool pluginUnloaded = false; //the plugin asked to be unloaded, e.g. because of a query plan regression with queryPlans = strict
+static std::map<int, simulatedPlayer> players; //the players on the server, by slot
+static std::map<std::string, bz_CustomSlashCommandHandler*> slashCommands;
+
+class bz_ApiString::dataBlob { public: std::string str; };
+
+bz_ApiString::bz_ApiString() { data = new dataBlob; }
+bz_ApiString::bz_ApiString(const char* c) { data = new dataBlob; data->str = (c ? c : ""); }
+bz_ApiString::bz_ApiString(const std::string &s) { data = new dataBlob; data->str = s; }
+bz_ApiString::bz_ApiString(const bz_ApiString &r) { data = new dataBlob; data->str = r.data->str; }
+bz_ApiString::~bz_ApiString() { delete data; }
+bz_ApiString& bz_ApiString::operator=(const bz_ApiString& r) { data->str = r.data->str; return *this; }
+bz_ApiString& bz_ApiString::operator=(const std::string& r) { data->str = r; return *this; }
+bz_ApiString& bz_ApiString::operator=(const char* r) { data->str = (r ? r : ""); return *this; }
+bool bz_ApiString::operator==(const bz_ApiString& r) { return data->str == r.data->str; }
+bool bz_ApiString::operator==(const std::string& r) { return data->str == r; }
+bool bz_ApiString::operator==(const char* r) { return data->str == r; }
+bool bz_ApiString::operator!=(const bz_ApiString& r) { return data->str != r.data->str; }
+bool bz_ApiString::operator!=(const std::string& r) { return data->str != r; }
+bool bz_ApiString::operator!=(const char* r) { return data->str != r; }
+unsigned int bz_ApiString::size() const { return data->str.size(); }
+const char* bz_ApiString::c_str() const { return data->str.c_str(); }
+
+class bz_APIIntList::dataBlob { public: std::vector<int> list; };
+
+bz_APIIntList::bz_APIIntList() { data = new dataBlob; }
+bz_APIIntList::~bz_APIIntList() { delete data; }
+void bz_APIIntList::push_back(int value) { data->list.push_back(value); }
+int bz_APIIntList::get(unsigned int i) { return data->list[i]; }
+unsigned int bz_APIIntList::size() { return data->list.size(); }
+void bz_APIIntList::clear() { data->list.clear(); }
+bz_APIIntList* bz_newIntList() { return new bz_APIIntList; }
+void bz_deleteIntList(bz_APIIntList* list) { delete list; }
+
+class bz_APIStringList::dataBlob { public: std::vector<bz_ApiString> list; };
+
+bz_APIStringList::bz_APIStringList() { data = new dataBlob; }
+bz_APIStringList::~bz_APIStringList() { delete data; }
+bz_ApiString bz_APIStringList::get(unsigned int i) const { return (i < data->list.size() ? data->list[i] : bz_ApiString("")); }
+unsigned int bz_APIStringList::size() const { return data->list.size(); }
+
+bz_Plugin::bz_Plugin() : MaxWaitTime(-1), Unloadable(true) {}
+bz_Plugin::~bz_Plugin() {}
+bool bz_Plugin::Register(bz_eEventType) { return true; }
+void bz_Plugin::Flush() {}
+
+double bz_getCurrentTime() { return virtualTime; }
+bz_ApiString bz_getPublicAddr() { return bz_ApiString("loadgen.local:5154"); }
+bool bz_hasPerm(int, const char*) { return true; }
+bool bz_unloadPlugin(const char*) { pluginUnloaded = true; return true; }
+
+void bz_debugMessage(int level, const char* message)
+{
+    if (level <= debugLevel)
+        fprintf(stderr, "%s\n", message);
+}
+
+void bz_debugMessagef(int level, const char* format, ...)
+{
+    if (level > debugLevel)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+bool bz_sendTextMessage(int, int, const char*) { messagesSent++; return true; }
+bool bz_sendTextMessagef(int, int, const char*, ...) { messagesSent++; return true; }
+bool bz_sendTextMessagef(int, bz_eTeamType, const char*, ...) { messagesSent++; return true; }
+
+bool bz_registerCustomSlashCommand(const char* command, bz_CustomSlashCommandHandler *handler) { slashCommands[command] = handler; return true; }
+bool bz_removeCustomSlashCommand(const char* command) { slashCommands.erase(command); return true; }
+
+int bz_getTeamCount(bz_eTeamType team)
+{
+    int count = 0;
+
+    for (std::map<int, simulatedPlayer>::iterator it = players.begin(); it != players.end(); ++it)
+    {
+        if (it->second.team == team)
+            count++;
+    }
+
+    return count;
+}
+
+bz_eTeamType bz_getPlayerTeam(int playerID)
+{
+    return (players.count(playerID) ? players[playerID].team : eNoTeam);
+}
+
+bool bz_getPlayerIndexList(bz_APIIntList *playerList)
+{
+    playerList->clear();
+
+    for (std::map<int, simulatedPlayer>::iterator it = players.begin(); it != players.end(); ++it)
+        playerList->push_back(it->first);
+
+    return true;
+}
+
+bz_BasePlayerRecord *bz_getPlayerByIndex(int playerID)
+{
+    if (!players.count(playerID))
+        return NULL;
+
+    bz_BasePlayerRecord *record = new bz_BasePlayerRecord;
+    record->playerID = playerID;
+    record->callsign = players[playerID].callsign;
+    record->bzID = players[playerID].bzid;
+    record->team = players[playerID].team;
+    record->spawned = true;
+
+    return record;
+}
+
+bool bz_freePlayerRecord(bz_BasePlayerRecord *playerRecord)
+{
+    delete playerRecord;
+    return true;
+}
+
+/*
+    The simulation
+    --------------
+
+    Every rate is per player per second unless it says otherwise. Events
+    are drawn from a Poisson distribution every tick, so a server twice
+    the size sees twice the kills.
+*/
+
+static void removeDatabase(const std::string &database)
+{
+    /*
+        Remove the database of a run and every file the plugin keeps next
+        to it
+    */
+
+    const char *suffixes[] = {"", "-wal", "-shm", ".archive", ".archive-wal", ".archive-shm", ".events", ".events-wal", ".events-shm", ".snapshot"};
+
+    for (unsigned int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+        remove((database + suffixes[i]).c_str());
+}
+
+struct loadOptions
+{
+    std::vector<int> serverSizes; //how many players to simulate, one run each
+    double hours; //virtual hours each run lasts
+    int tickRate; //ticks per second
+    double stallMilliseconds; //a tick the plugin holds up for longer than this is a visible stall
+    std::string databaseDirectory, configFile;
+    unsigned int seed;
+    int onlinePlayers; //players already on the server when the plugin is loaded
+    int enrolledPlayers; //players already entered in the cup when the plugin is loaded, none of them are simulated
+
+    double killRate, captureRate, flagDropRate, pauseRate, partRate; //captureRate is per server
+};
+
+struct loadResult
+{
+    std::vector<double> tickTimes, flushTickTimes; //how long the plugin took on every tick and on the ticks that updated the database, in milliseconds
+    double initTime, cleanupTime;
+    unsigned long events;
+    bool unloaded; //the plugin unloaded itself when it was loaded, nothing was simulated
+};
+
+class loadSimulation
+{
+public:
+    loadSimulation(const loadOptions &options, int serverSize, const std::string &database);
+
+    loadResult run(void);
+
+private:
+    void dispatch(bz_EventData *eventData);
+    void join(int playerID);
+    void part(int playerID);
+    int randomPlayer(bz_eTeamType notOnTeam);
+
+    const loadOptions &options;
+    int serverSize;
+    std::string database;
+
+    bz_Plugin *plugin;
+    std::mt19937 random;
+    std::vector<bool> identityOnline; //which of the simulated identities are on the server
+    std::vector<int> playerIDs; //the slots of the players on the server
+    std::map<int, double> rejoinTimes; //empty slots and when someone takes them again
+    std::map<int, double> unpauseTimes; //paused players and when they unpause
+    double tickTime; //the time the plugin took on the current tick, in milliseconds
+    unsigned long events;
+};
+
+loadSimulation::loadSimulation(const loadOptions &options, int serverSize, const std::string &database) :
+    options(options), serverSize(serverSize), database(database), plugin(NULL), random(options.seed), identityOnline(serverSize * 3, false), tickTime(0), events(0)
+{
+}
+
+void loadSimulation::dispatch(bz_EventData *eventData)
+{
+    if (plugin == NULL) //the plugin isn't loaded yet, it finds the players who are already on the server when it is
+        return;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    plugin->Event(eventData);
+    tickTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    events++;
+}
+
+void loadSimulation::join(int playerID)
+{
+    int identity;
+
+    do //a third of the time it's someone who has played before
+        identity = std::uniform_int_distribution<int>(0, identityOnline.size() - 1)(random);
+    while (identityOnline[identity]);
+
+    identityOnline[identity] = true;
+
+    char callsign[32], bzid[32];
+    snprintf(callsign, sizeof(callsign), "Player %i", identity);
+    snprintf(bzid, sizeof(bzid), "%i", 10000 + identity);
+
+    simulatedPlayer player;
+    player.callsign = callsign;
+    player.bzid = (identity % 20 == 19) ? "" : bzid; //some players aren't registered
+    player.team = (identity % 25 == 24) ? eObservers : ((playerID % 2) ? eGreenTeam : eRedTeam);
+    player.identity = identity;
+    players[playerID] = player;
+    playerIDs.push_back(playerID);
+
+    bz_PlayerJoinPartEventData_V1 joinData;
+    joinData.playerID = playerID;
+    joinData.record = bz_getPlayerByIndex(playerID); //freed with the event data
+    dispatch(&joinData);
+}
+
+void loadSimulation::part(int playerID)
+{
+    bz_PlayerJoinPartEventData_V1 partData;
+    partData.eventType = bz_ePlayerPartEvent;
+    partData.playerID = playerID;
+    partData.record = bz_getPlayerByIndex(playerID);
+    dispatch(&partData);
+
+    identityOnline[players[playerID].identity] = false;
+    players.erase(playerID);
+    playerIDs.erase(std::find(playerIDs.begin(), playerIDs.end(), playerID));
+    unpauseTimes.erase(playerID);
+}
+
+int loadSimulation::randomPlayer(bz_eTeamType notOnTeam)
+{
+    /*
+        Pick a player who is playing and isn't on the given team, or -1
+        if nobody is
+    */
+
+    for (int attempt = 0; attempt < 16 && !playerIDs.empty(); attempt++)
+    {
+        int playerID = playerIDs[std::uniform_int_distribution<int>(0, playerIDs.size() - 1)(random)];
+
+        if (players[playerID].team != eObservers && players[playerID].team != notOnTeam && !unpauseTimes.count(playerID))
+            return playerID;
+    }
+
+    return -1;
+}
+
+loadResult loadSimulation::run(void)
+{
+    loadResult result;
+    result.events = 0;
+    result.cleanupTime = 0;
+
+    removeDatabase(database);
+
+    //a cup that lasts well past the end of the run
+    sqlite3 *db;
+    char query[512];
+    sqlite3_open(database.c_str(), &db);
+    sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS \"Cups\" (\"CupID\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, \"ServerID\" TEXT NOT NULL, \"StartTime\" REAL NOT NULL, \"EndTime\" REAL NOT NULL);", NULL, NULL, NULL);
+    snprintf(query, sizeof(query), "INSERT INTO Cups (ServerID, StartTime, EndTime) VALUES ('loadgen.local:5154', %ld, %ld)", (long)time(NULL) - 86400, (long)time(NULL) + 30 * 86400);
+    sqlite3_exec(db, query, NULL, NULL, NULL);
+
+    if (options.enrolledPlayers > 0) //only the players are needed, they're what the plugin looks up when it enters the players online in the cup
+    {
+        mofocupDatabase schema;
+        schema.use(db);
+        schema.createSchema();
+
+        snprintf(query, sizeof(query), "WITH RECURSIVE `Entered` (`Number`) AS (SELECT 1 UNION ALL SELECT `Number` + 1 FROM `Entered` WHERE `Number` < %i) "
+                 "INSERT INTO `Players` (`BZID`, `Callsign`, `CupID`, `PlayingTime`) SELECT 1000000 + `Number`, 'Entered ' || `Number`, (SELECT MAX(`CupID`) FROM `Cups`), 600 FROM `Entered`", options.enrolledPlayers);
+        sqlite3_exec(db, query, NULL, NULL, NULL);
+    }
+
+    sqlite3_close(db);
+
+    players.clear();
+    virtualTime = 1000;
+    pluginUnloaded = false;
+
+    for (int playerID = 0; playerID < std::min(options.onlinePlayers, serverSize); playerID++) //they're on the server before it's loaded
+        join(playerID);
+
+    std::string commandLine = database + (options.configFile.empty() ? "" : "," + options.configFile);
+    plugin = bz_GetPlugin();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    plugin->Init(commandLine.c_str());
+    result.initTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    result.unloaded = pluginUnloaded;
+
+    if (result.unloaded)
+    {
+        plugin->Cleanup();
+        bz_FreePlugin(plugin);
+        plugin = NULL;
+
+        return result;
+    }
+
+    //the rest of the server fills up over the first minute
+    for (int playerID = std::min(options.onlinePlayers, serverSize); playerID < serverSize; playerID++)
+        rejoinTimes[playerID] = virtualTime + std::uniform_real_distribution<double>(0, 60)(random);
+
+    double tickLength = 1.0 / options.tickRate;
+    double endTime = virtualTime + options.hours * 3600;
+    double lastFlush = -FLUSH_INTERVAL;
+    bz_eTeamType teams[] = {eRedTeam, eGreenTeam};
+    const char *killFlags[] = {"", "", "", "", "GM", "L", "SW", "SB", "R*", "G*"};
+
+    for (; virtualTime < endTime; virtualTime += tickLength)
+    {
+        tickTime = 0;
+
+        for (std::map<int, double>::iterator it = rejoinTimes.begin(); it != rejoinTimes.end();)
+        {
+            if (it->second > virtualTime)
+            {
+                ++it;
+                continue;
+            }
+
+            join(it->first);
+            rejoinTimes.erase(it++);
+        }
+
+        for (std::map<int, double>::iterator it = unpauseTimes.begin(); it != unpauseTimes.end();)
+        {
+            if (it->second > virtualTime)
+            {
+                ++it;
+                continue;
+            }
+
+            bz_PlayerPausedEventData_V1 pauseData;
+            pauseData.playerID = it->first;
+            pauseData.pause = false;
+            unpauseTimes.erase(it++);
+            dispatch(&pauseData);
+        }
+
+        double playing = playerIDs.size();
+        int kills = std::poisson_distribution<int>(playing * options.killRate * tickLength)(random);
+        int captures = std::poisson_distribution<int>(options.captureRate * tickLength)(random);
+        int flagDrops = std::poisson_distribution<int>(playing * options.flagDropRate * tickLength)(random);
+        int pauses = std::poisson_distribution<int>(playing * options.pauseRate * tickLength)(random);
+        int parts = std::poisson_distribution<int>(playing * options.partRate * tickLength)(random);
+
+        for (int i = 0; i < kills; i++)
+        {
+            int killerID = randomPlayer(eObservers);
+
+            if (killerID < 0)
+                break;
+
+            bool selfKill = (std::uniform_int_distribution<int>(0, 49)(random) == 0);
+            int victimID = selfKill ? killerID : randomPlayer(players[killerID].team);
+
+            if (victimID < 0)
+                continue;
+
+            bz_PlayerDieEventData_V1 dieData;
+            dieData.playerID = victimID;
+            dieData.killerID = killerID;
+            dieData.team = players[victimID].team;
+            dieData.killerTeam = players[killerID].team;
+            dieData.flagKilledWith = killFlags[std::uniform_int_distribution<int>(0, 9)(random)];
+            dispatch(&dieData);
+        }
+
+        for (int i = 0; i < captures; i++)
+        {
+            bz_eTeamType team = teams[std::uniform_int_distribution<int>(0, 1)(random)];
+            int capperID = randomPlayer(team == eRedTeam ? eGreenTeam : eRedTeam);
+
+            if (capperID < 0)
+                continue;
+
+            bz_CTFCaptureEventData_V1 captureData;
+            captureData.playerCapping = capperID;
+            captureData.teamCapping = players[capperID].team;
+            captureData.teamCapped = team;
+            dispatch(&captureData);
+        }
+
+        for (int i = 0; i < flagDrops; i++)
+        {
+            int playerID = randomPlayer(eObservers);
+
+            if (playerID < 0)
+                break;
+
+            bz_FlagDroppedEventData_V1 flagData;
+            flagData.playerID = playerID;
+            flagData.flagID = std::uniform_int_distribution<int>(0, 5)(random);
+            dispatch(&flagData);
+        }
+
+        for (int i = 0; i < pauses; i++)
+        {
+            int playerID = randomPlayer(eObservers);
+
+            if (playerID < 0)
+                break;
+
+            bz_PlayerPausedEventData_V1 pauseData;
+            pauseData.playerID = playerID;
+            pauseData.pause = true;
+            unpauseTimes[playerID] = virtualTime + std::uniform_real_distribution<double>(5, 60)(random);
+            dispatch(&pauseData);
+        }
+
+        for (int i = 0; i < parts && !playerIDs.empty(); i++) //someone else takes the slot a little later
+        {
+            int playerID = playerIDs[std::uniform_int_distribution<int>(0, playerIDs.size() - 1)(random)];
+            part(playerID);
+            rejoinTimes[playerID] = virtualTime + std::uniform_real_distribution<double>(2, 30)(random);
+        }
+
+        bz_TickEventData_V1 tickData;
+        dispatch(&tickData);
+
+        if (bz_getTeamCount(eRedTeam) + bz_getTeamCount(eGreenTeam) > 0 && lastFlush + FLUSH_INTERVAL < virtualTime) //the plugin updated the database on this tick
+        {
+            lastFlush = virtualTime;
+            result.flushTickTimes.push_back(tickTime);
+        }
+
+        result.tickTimes.push_back(tickTime);
+    }
+
+    start = std::chrono::steady_clock::now();
+    plugin->Cleanup();
+    result.cleanupTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    bz_FreePlugin(plugin);
+    plugin = NULL;
+    result.events = events;
+
+    return result;
+}
+
+static double percentile(std::vector<double> &values, double fraction)
+{
+    /*
+        The value under which the given fraction of values fall, the list
+        is sorted along the way
+    */
+
+    if (values.empty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(fraction * values.size()))];
+}
+
+static void showUsage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-p players,...] [-H hours] [-t ticks per second] [-s stall ms] [-d directory] [-c config] [-r seed] [-v debug level]\n", program);
+    fprintf(stderr, "          [-k kills] [-a captures] [-f flag drops] [-w pauses] [-l parts] [-o online] [-e entered]\n");
+    fprintf(stderr, "rates are per player per second, except captures which are per server per second\n");
+    fprintf(stderr, "-o players are on the server before the plugin is loaded, -e players are already entered in the cup\n");
+}
+
+int main(int argc, char **argv)
+{
+    loadOptions options;
+    options.hours = 2;
+    options.tickRate = 20;
+    options.stallMilliseconds = 20;
+    options.databaseDirectory = "/tmp";
+    options.seed = 1;
+    options.killRate = 1.0 / 15;
+    options.captureRate = 1.0 / 120;
+    options.flagDropRate = 1.0 / 90;
+    options.pauseRate = 1.0 / 1800;
+    options.partRate = 1.0 / 2400;
+    options.onlinePlayers = 0;
+    options.enrolledPlayers = 0;
+
+    std::string serverSizes = "50,100,150,200";
+    int option;
+
+    while ((option = getopt(argc, argv, "p:H:t:s:d:c:r:v:k:a:f:w:l:o:e:h")) != -1)
+    {
+        switch (option)
+        {
+            case 'p': serverSizes = optarg; break;
+            case 'H': options.hours = atof(optarg); break;
+            case 't': options.tickRate = std::max(1, atoi(optarg)); break;
+            case 's': options.stallMilliseconds = atof(optarg); break;
+            case 'd': options.databaseDirectory = optarg; break;
+            case 'c': options.configFile = optarg; break;
+            case 'r': options.seed = strtoul(optarg, NULL, 10); break;
+            case 'v': debugLevel = atoi(optarg); break;
+            case 'k': options.killRate = atof(optarg); break;
+            case 'a': options.captureRate = atof(optarg); break;
+            case 'f': options.flagDropRate = atof(optarg); break;
+            case 'w': options.pauseRate = atof(optarg); break;
+            case 'l': options.partRate = atof(optarg); break;
+            case 'o': options.onlinePlayers = std::max(0, atoi(optarg)); break;
+            case 'e': options.enrolledPlayers = std::max(0, atoi(optarg)); break;
+            default: showUsage(argv[0]); return 1;
+        }
+    }
+
+    for (char *size = strtok(&serverSizes[0], ","); size != NULL; size = strtok(NULL, ","))
+    {
+        int players = atoi(size);
+
+        if (players < 1 || players > 200)
+        {
+            fprintf(stderr, "%s: server sizes must be between 1 and 200 players\n", argv[0]);
+            return 1;
+        }
+
+        options.serverSizes.push_back(players);
+    }
+
+    printf("%.1f virtual hours at %i ticks per second, a stall is a tick over %.1f ms\n\n", options.hours, options.tickRate, options.stallMilliseconds);
+    printf("%7s %9s %8s %8s %8s %8s %8s | %8s %8s | %7s %9s %9s\n", "players", "events", "p50", "p90", "p99", "p99.9", "max", "flush50", "flushmax", "stalls", "init", "cleanup");
+
+    int firstStallingSize = 0;
+
+    for (unsigned int i = 0; i < options.serverSizes.size(); i++)
+    {
+        std::string database = options.databaseDirectory + "/mofocup-loadgen.sqlite";
+        loadSimulation simulation(options, options.serverSizes[i], database);
+        loadResult result = simulation.run();
+
+        if (result.unloaded)
+        {
+            removeDatabase(database);
+            printf("\nthe plugin unloaded itself when it was loaded, run with -v 1 to see why\n");
+            return 1;
+        }
+
+        int stalls = 0;
+
+        for (unsigned int j = 0; j < result.tickTimes.size(); j++)
+        {
+            if (result.tickTimes[j] > options.stallMilliseconds)
+                stalls++;
+        }
+
+        if (stalls > 0 && firstStallingSize == 0)
+            firstStallingSize = options.serverSizes[i];
+
+        printf("%7i %9lu %8.3f %8.3f %8.3f %8.3f %8.3f | %8.3f %8.3f | %7i %9.3f %9.3f\n", options.serverSizes[i], result.events,
+               percentile(result.tickTimes, 0.5), percentile(result.tickTimes, 0.9), percentile(result.tickTimes, 0.99), percentile(result.tickTimes, 0.999),
+               percentile(result.tickTimes, 1), percentile(result.flushTickTimes, 0.5), percentile(result.flushTickTimes, 1), stalls, result.initTime, result.cleanupTime);
+        fflush(stdout);
+
+        removeDatabase(database);
+    }
+
+    printf("\ntimes are in milliseconds, flush is the ticks on which the plugin updated the database every %i seconds\n", FLUSH_INTERVAL);
+
+    if (firstStallingSize > 0)
+        printf("the plugin first stalled the server with %i players\n", firstStallingSize);
+    else
+        printf("the plugin didn't stall the server at any of these sizes\n");
+
+    return 0;
+}